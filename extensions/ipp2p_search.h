@@ -0,0 +1,872 @@
+/*
+ * Signature matchers of xt_ipp2p, shared with the ipp2pbench replay tool.
+ * The includer provides get_u8, get_u16, get_u32, HX_memmem, the string
+ * functions and the IPP2P_* constants from xt_ipp2p.h.
+ */
+#ifndef _IPP2P_SEARCH_H
+#define _IPP2P_SEARCH_H 1
+
+/*
+ * Payload bytes inspected in nonlinear skbs. The matchers may read up to
+ * min(packet_len, IPP2P_PAYLOAD_WINDOW) bytes without checking wlen.
+ */
+enum {
+	IPP2P_PAYLOAD_WINDOW = 2048,
+};
+
+/* Search for UDP eDonkey/eMule/Kad commands */
+static unsigned int
+udp_search_edk(const unsigned char *t, const unsigned int packet_len,
+    const unsigned int wlen)
+{
+	if (packet_len < 4)
+		return 0;
+
+	switch (t[0]) {
+	case 0xe3:
+		/* edonkey */
+		switch (t[1]) {
+		/* client -> server status request */
+		case 0x96:
+			if (packet_len == 6)
+				return IPP2P_EDK * 100 + 50;
+			break;
+
+		/* server -> client status request */
+		case 0x97:
+			if (packet_len == 34)
+				return IPP2P_EDK * 100 + 51;
+			break;
+
+		/* server description request */
+		/* e3 2a ff f0 .. | size == 6 */
+		case 0xa2:
+			if (packet_len == 6 &&
+			    get_u16(t, 2) == __constant_htons(0xfff0))
+				return IPP2P_EDK * 100 + 52;
+			break;
+
+		/* server description response */
+		/* e3 a3 ff f0 ..  | size > 40 && size < 200 */
+		/*
+		case 0xa3:
+			return IPP2P_EDK * 100 + 53;
+			break;
+		*/
+
+		case 0x9a:
+			if (packet_len == 18)
+				return IPP2P_EDK * 100 + 54;
+			break;
+
+		case 0x92:
+			if (packet_len == 10)
+				return IPP2P_EDK * 100 + 55;
+			break;
+		}
+		break;
+
+	case 0xe4:
+		switch (t[1]) {
+		/* e4 20 .. | size == 35 */
+		case 0x20:
+			if (packet_len == 35 && t[2] != 0x00 && t[34] != 0x00)
+				return IPP2P_EDK * 100 + 60;
+			break;
+
+		/* e4 00 .. 00 | size == 27 ? */
+		case 0x00:
+			if (packet_len == 27 && t[26] == 0x00)
+				return IPP2P_EDK * 100 + 61;
+			break;
+
+		/* e4 10 .. 00 | size == 27 ? */
+		case 0x10:
+			if (packet_len == 27 && t[26] == 0x00)
+				return IPP2P_EDK * 100 + 62;
+			break;
+
+		/* e4 18 .. 00 | size == 27 ? */
+		case 0x18:
+			if (packet_len == 27 && t[26] == 0x00)
+				return IPP2P_EDK * 100 + 63;
+			break;
+
+		/* e4 52 .. | size = 36 */
+		case 0x52:
+			if (packet_len == 36)
+				return IPP2P_EDK * 100 + 64;
+			break;
+
+		/* e4 58 .. | size == 6 */
+		case 0x58:
+			if (packet_len == 6)
+				return IPP2P_EDK * 100 + 65;
+			break;
+
+		/* e4 59 .. | size == 2 */
+		case 0x59:
+			if (packet_len == 2)
+				return IPP2P_EDK * 100 + 66;
+			break;
+
+		/* e4 28 .. | packet_len == 49,69,94,119... */
+		case 0x28:
+			if ((packet_len - 44) % 25 == 0)
+				return IPP2P_EDK * 100 + 67;
+			break;
+
+		/* e4 50 xx xx | size == 4 */
+		case 0x50:
+			if (packet_len == 4)
+				return IPP2P_EDK * 100 + 68;
+			break;
+
+		/* e4 40 xx xx | size == 48 */
+		case 0x40:
+			if (packet_len == 48)
+				return IPP2P_EDK * 100 + 69;
+			break;
+		}
+		break;
+	}
+	return 0;
+}
+
+/* Search for UDP Gnutella commands */
+static unsigned int
+udp_search_gnu(const unsigned char *t, const unsigned int packet_len,
+    const unsigned int wlen)
+{
+	if (packet_len >= 3 && memcmp(t, "GND", 3) == 0)
+		return IPP2P_GNU * 100 + 51;
+	if (packet_len >= 9 && memcmp(t, "GNUTELLA ", 9) == 0)
+		return IPP2P_GNU * 100 + 52;
+	return 0;
+}
+
+/* Search for UDP KaZaA commands */
+static unsigned int
+udp_search_kazaa(const unsigned char *t, const unsigned int packet_len,
+    const unsigned int wlen)
+{
+	/* needs the end of the payload */
+	if (packet_len < 6 || wlen < packet_len)
+		return 0;
+	if (memcmp(t + packet_len - 6, "KaZaA\x00", 6) == 0)
+		return IPP2P_KAZAA * 100 + 50;
+	return 0;
+}
+
+/* Search for UDP DirectConnect commands */
+static unsigned int udp_search_directconnect(const unsigned char *t,
+                                             const unsigned int packet_len,
+                                             const unsigned int wlen)
+{
+	if (packet_len < 5 || wlen < packet_len)
+		return 0;
+	if (t[0] == 0x24 && t[packet_len-1] == 0x7c) {
+		if (memcmp(&t[1], "SR ", 3) == 0)
+			return IPP2P_DC * 100 + 60;
+		if (packet_len >= 7 && memcmp(&t[1], "Ping ", 5) == 0)
+			return IPP2P_DC * 100 + 61;
+	}
+	return 0;
+}
+
+/* Search for UDP BitTorrent commands */
+static unsigned int
+udp_search_bit(const unsigned char *haystack, const unsigned int packet_len,
+    const unsigned int wlen)
+{
+	switch (packet_len) {
+	case 16:
+		/* ^ 00 00 04 17 27 10 19 80 */
+		if (ntohl(get_u32(haystack, 0)) == 0x00000417 &&
+		    ntohl(get_u32(haystack, 4)) == 0x27101980)
+			return IPP2P_BIT * 100 + 50;
+		break;
+	case 36:
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000400) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return IPP2P_BIT * 100 + 51;
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000400))
+			return IPP2P_BIT * 100 + 61;
+		break;
+	case 57:
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000404) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return IPP2P_BIT * 100 + 52;
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000404))
+			return IPP2P_BIT * 100 + 62;
+		break;
+	case 59:
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000406) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return (IPP2P_BIT * 100 + 53);
+		if (get_u32(haystack, 8) == __constant_htonl(0x00000406))
+			return (IPP2P_BIT * 100 + 63);
+		break;
+	case 203:
+		if (get_u32(haystack, 0) == __constant_htonl(0x00000405))
+			return IPP2P_BIT * 100 + 54;
+		break;
+	case 21:
+		if (get_u32(haystack, 0) == __constant_htonl(0x00000401))
+			return IPP2P_BIT * 100 + 55;
+		break;
+	case 44:
+		if (get_u32(haystack, 0)  == __constant_htonl(0x00000827) &&
+		    get_u32(haystack, 4) == __constant_htonl(0x37502950))
+			return IPP2P_BIT * 100 + 80;
+		break;
+	default:
+		/* this packet does not have a constant size */
+		if (packet_len >= 32 &&
+		    get_u32(haystack, 8) == __constant_htonl(0x00000402) &&
+		    get_u32(haystack, 28) == __constant_htonl(0x00000104))
+			return IPP2P_BIT * 100 + 56;
+		break;
+	}
+
+	/* some extra-bitcomet rules: "d1:" [a|r] "d2:id20:" */
+	if (packet_len > 22 && get_u8(haystack, 0) == 'd' &&
+	    get_u8(haystack, 1) == '1' && get_u8(haystack, 2) == ':')
+		if (get_u8(haystack, 3) == 'a' ||
+		    get_u8(haystack, 3) == 'r')
+			if (memcmp(haystack + 4, "d2:id20:", 8) == 0)
+				return IPP2P_BIT * 100 + 57;
+
+#if 0
+	/* bitlord rules */
+	/* packetlen must be bigger than 32 */
+	/* first 4 bytes are zero */
+	if (packet_len > 32 && get_u32(haystack, 0) == 0x00000000) {
+		/* first rule: 00 00 00 00 01 00 00 xx xx xx xx 00 00 00 00*/
+		if (get_u32(haystack, 4) == 0x00000000 &&
+		    get_u32(haystack, 8) == 0x00010000 &&
+		    get_u32(haystack, 16) == 0x00000000)
+			return IPP2P_BIT * 100 + 71;
+
+		/* 00 01 00 00 0d 00 00 xx xx xx xx 00 00 00 00*/
+		if (get_u32(haystack, 4) == 0x00000001 &&
+		    get_u32(haystack, 8) == 0x000d0000 &&
+		    get_u32(haystack, 16) == 0x00000000)
+			return IPP2P_BIT * 100 + 71;
+	}
+#endif
+
+	return 0;
+}
+
+/* Search for Ares commands */
+static unsigned int
+search_ares(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 3)
+		return 0;
+	/* all ares packets start with  */
+	if (payload[1] == 0 && plen - payload[0] == 3) {
+		switch (payload[2]) {
+		case 0x5a:
+			/* ares connect */
+			if (plen == 6 && payload[5] == 0x05)
+				return IPP2P_ARES * 100 + 1;
+			break;
+		case 0x09:
+			/*
+			 * ares search, min 3 chars --> 14 bytes
+			 * lets define a search can be up to 30 chars
+			 * --> max 34 bytes
+			 */
+			if (plen >= 14 && plen <= 34)
+				return IPP2P_ARES * 100 + 1;
+			break;
+#ifdef IPP2P_DEBUG_ARES
+		default:
+			printk(KERN_DEBUG "Unknown Ares command %x "
+			       "recognized, len: %u\n",
+			       (unsigned int)payload[2], plen);
+#endif
+		}
+	}
+
+#if 0
+	/* found connect packet: 03 00 5a 04 03 05 */
+	/* new version ares 1.8: 03 00 5a xx xx 05 */
+	if (plen == 6)
+		/* possible connect command */
+		if (payload[0] == 0x03 && payload[1] == 0x00 &&
+		    payload[2] == 0x5a && payload[5] == 0x05)
+			return IPP2P_ARES * 100 + 1;
+
+	if (plen == 60)
+		/* possible download command*/
+		if (payload[59] == 0x0a && payload[58] == 0x0a)
+			if (memcmp(t, "PUSH SHA1:", 10) == 0)
+				/* found download command */
+				return IPP2P_ARES * 100 + 2;
+#endif
+
+	return 0;
+}
+
+/* Search for SoulSeek commands */
+static unsigned int
+search_soul(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 8)
+		return 0;
+	/* match: xx xx xx xx | xx = sizeof(payload) - 4 */
+	if (get_u32(payload, 0) == plen - 4) {
+		const uint32_t m = get_u32(payload, 4);
+
+		/* match 00 yy yy 00, yy can be everything */
+		if (get_u8(payload, 4) == 0x00 && get_u8(payload, 7) == 0x00) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "0: Soulseek command 0x%x "
+			       "recognized\n", get_u32(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 1;
+		}
+
+		/* next match: 01 yy 00 00 | yy can be everything */
+		if (get_u8(payload, 4) == 0x01 && get_u16(payload, 6) == 0x0000) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "1: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 2;
+		}
+
+		/* other soulseek commandos are: 1-5,7,9,13-18,22,23,26,28,35-37,40-46,50,51,60,62-69,91,92,1001 */
+		/* try to do this in an intelligent way */
+		/* get all small commandos */
+		switch (m) {
+		case 7:
+		case 9:
+		case 22:
+		case 23:
+		case 26:
+		case 28:
+		case 50:
+		case 51:
+		case 60:
+		case 91:
+		case 92:
+		case 1001:
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "2: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 3;
+		}
+
+		if (m > 0 && m < 6) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "3: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 4;
+		}
+
+		if (m > 12 && m < 19) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "4: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 5;
+		}
+
+		if (m > 34 && m < 38) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "5: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 6;
+		}
+
+		if (m > 39 && m < 47) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "6: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 7;
+		}
+
+		if (m > 61 && m < 70) {
+#ifdef IPP2P_DEBUG_SOUL
+			printk(KERN_DEBUG "7: Soulseek command 0x%x "
+			       "recognized\n", get_u16(payload, 4));
+#endif
+			return IPP2P_SOUL * 100 + 8;
+		}
+
+#ifdef IPP2P_DEBUG_SOUL
+		printk(KERN_DEBUG "unknown SOULSEEK command: 0x%x, first "
+		       "16 bit: 0x%x, first 8 bit: 0x%x ,soulseek ???\n",
+		       get_u32(payload, 4), get_u16(payload, 4) >> 16,
+		       get_u8(payload, 4) >> 24);
+#endif
+	}
+
+	/* match 14 00 00 00 01 yy 00 00 00 STRING(YY) 01 00 00 00 00 46|50 00 00 00 00 */
+	/* without size at the beginning !!! */
+	if (get_u32(payload, 0) == 0x14 && get_u8(payload, 4) == 0x01) {
+		uint32_t y = get_u32(payload, 5);
+
+		/* we need 19 chars + string */
+		if (y + 19 <= wlen) {
+			const unsigned char *w = payload + 9 + y;
+			if (get_u32(w, 0) == 0x01 &&
+			    (get_u16(w, 4) == 0x4600 ||
+			    get_u16(w, 4) == 0x5000) &&
+			    get_u32(w, 6) == 0x00)
+				;
+#ifdef IPP2P_DEBUG_SOUL
+	    		printk(KERN_DEBUG "Soulssek special client command recognized\n");
+#endif
+	    		return IPP2P_SOUL * 100 + 9;
+		}
+	}
+	return 0;
+}
+
+/* Search for WinMX commands */
+static unsigned int
+search_winmx(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen == 4 && memcmp(payload, "SEND", 4) == 0)
+		return IPP2P_WINMX * 100 + 1;
+	if (plen == 3 && memcmp(payload, "GET", 3) == 0)
+		return IPP2P_WINMX * 100 + 2;
+	/*
+	if (packet_len < head_len + 10)
+		return 0;
+	*/
+	if (plen < 10)
+		return 0;
+
+	if (memcmp(payload, "SEND", 4) == 0 || memcmp(payload, "GET", 3) == 0) {
+		uint16_t c = 4;
+		const uint16_t end = wlen - 2;
+		uint8_t count = 0;
+
+		while (c < end) {
+			if (payload[c] == 0x20 && payload[c+1] == 0x22) {
+				c++;
+				count++;
+				if (count >= 2)
+					return IPP2P_WINMX * 100 + 3;
+			}
+			c++;
+		}
+	}
+
+	if (plen == 149 && payload[0] == '8') {
+#ifdef IPP2P_DEBUG_WINMX
+		printk(KERN_INFO "maybe WinMX\n");
+#endif
+		if (get_u32(payload, 17) == 0 && get_u32(payload, 21) == 0 &&
+		    get_u32(payload, 25) == 0 &&
+//		    get_u32(payload, 33) == __constant_htonl(0x71182b1a) &&
+//		    get_u32(payload, 37) == __constant_htonl(0x05050000) &&
+//		    get_u32(payload, 133) == __constant_htonl(0x31097edf) &&
+//		    get_u32(payload, 145) == __constant_htonl(0xdcb8f792))
+		    get_u16(payload, 39) == 0 &&
+		    get_u16(payload, 135) == __constant_htons(0x7edf) &&
+		    get_u16(payload,147) == __constant_htons(0xf792))
+		{
+#ifdef IPP2P_DEBUG_WINMX
+			printk(KERN_INFO "got WinMX\n");
+#endif
+			return IPP2P_WINMX * 100 + 4;
+		}
+	}
+	return 0;
+}
+
+/* Search for appleJuice commands */
+static unsigned int
+search_apple(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen > 7 && payload[6] == 0x0d && payload[7] == 0x0a &&
+	    memcmp(payload, "ajprot", 6) == 0)
+		return IPP2P_APPLE * 100;
+
+	return 0;
+}
+
+/* Search for BitTorrent commands */
+static unsigned int
+search_bittorrent(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen > 20) {
+		/* test for match 0x13+"BitTorrent protocol" */
+		if (payload[0] == 0x13)
+			if (memcmp(payload + 1, "BitTorrent protocol", 19) == 0)
+				return IPP2P_BIT * 100;
+		/*
+		 * Any tracker command starts with GET / then *may be* some file on web server
+		 * (e.g. announce.php or dupa.pl or whatever.cgi or NOTHING for tracker on root dir)
+		 * but *must have* one (or more) of strings listed below (true for scrape and announce)
+		 */
+		if (memcmp(payload, "GET /", 5) == 0) {
+			if (HX_memmem(payload, wlen, "info_hash=", 10) != NULL)
+				return IPP2P_BIT * 100 + 1;
+			if (HX_memmem(payload, wlen, "peer_id=", 8) != NULL)
+				return IPP2P_BIT * 100 + 2;
+			if (HX_memmem(payload, wlen, "passkey=", 8) != NULL)
+				return IPP2P_BIT * 100 + 4;
+		}
+	} else {
+	    	/* bitcomet encryptes the first packet, so we have to detect another
+	    	 * one later in the flow */
+		/* first try failed, too many false positives */
+	    	/*
+		if (size == 5 && get_u32(t, 0) == __constant_htonl(1) &&
+		    t[4] < 3)
+			return IPP2P_BIT * 100 + 3;
+		*/
+
+	    	/* second try: block request packets */
+	    	if (plen == 17 &&
+		    get_u32(payload, 0) == __constant_htonl(0x0d) &&
+		    payload[4] == 0x06 &&
+		    get_u32(payload,13) == __constant_htonl(0x4000))
+			return IPP2P_BIT * 100 + 3;
+	}
+
+	return 0;
+}
+
+/* check for Kazaa get command */
+static unsigned int
+search_kazaa(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 13 || wlen < plen)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a &&
+	    memcmp(payload, "GET /.hash=", 11) == 0)
+		return IPP2P_DATA_KAZAA * 100;
+
+	return 0;
+}
+
+/*
+ * Find the next CRLF whose CR lies in [@line, @end) and return the start of
+ * the line following it, or NULL. The byte scan is left to memchr, which is
+ * word-at-a-time or vectorized on most architectures. @end must be at least
+ * one byte short of the payload end.
+ */
+static const unsigned char *
+ipp2p_next_line(const unsigned char *line, const unsigned char *end)
+{
+	while (line < end) {
+		line = memchr(line, 0x0d, end - line);
+		if (line == NULL)
+			return NULL;
+		if (line[1] == 0x0a)
+			return line + 2;
+		++line;
+	}
+	return NULL;
+}
+
+/* check for gnutella get command */
+static unsigned int
+search_gnu(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 11 || wlen < plen)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
+		if (memcmp(payload, "GET /get/", 9) == 0)
+			return IPP2P_DATA_GNU * 100 + 1;
+		if (plen >= 15 && memcmp(payload, "GET /uri-res/", 13) == 0)
+			return IPP2P_DATA_GNU * 100 + 2;
+	}
+	return 0;
+}
+
+/* check for gnutella get commands and other typical data */
+static unsigned int
+search_all_gnu(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 11 || wlen < plen)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
+		if (plen >= 19 && memcmp(payload, "GNUTELLA CONNECT/", 17) == 0)
+			return IPP2P_GNU * 100 + 1;
+		if (memcmp(payload, "GNUTELLA/", 9) == 0)
+			return IPP2P_GNU * 100 + 2;
+
+		if (plen >= 22 && (memcmp(payload, "GET /get/", 9) == 0 ||
+		    memcmp(payload, "GET /uri-res/", 13) == 0))
+		{
+			const unsigned char *line = payload;
+			const unsigned char *end  = payload + plen - 22;
+
+			while ((line = ipp2p_next_line(line, end)) != NULL)
+				if (memcmp(line, "X-Gnutella-", 11) == 0 ||
+				    memcmp(line, "X-Queue:", 8) == 0)
+					return IPP2P_GNU * 100 + 3;
+		}
+	}
+	return 0;
+}
+
+/* check for KaZaA download commands and other typical data */
+/* plen is guaranteed to be >= 5 (see @matchlist) */
+static unsigned int
+search_all_kazaa(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	const unsigned char *line, *end;
+
+	if (plen < 7 || wlen < plen)
+		/* too short for anything we test for - early bailout */
+		return 0;
+
+	if (payload[plen-2] != 0x0d || payload[plen-1] != 0x0a)
+		return 0;
+
+	if (memcmp(payload, "GIVE ", 5) == 0)
+		return IPP2P_KAZAA * 100 + 1;
+
+	if (memcmp(payload, "GET /", 5) != 0)
+		return 0;
+
+	if (plen < 18)
+		/* The next tests would not succeed anyhow. */
+		return 0;
+
+	line = payload + 5;
+	end  = payload + plen - 18;
+	while ((line = ipp2p_next_line(line, end)) != NULL) {
+		unsigned int rem = payload + plen - line;
+
+		if (rem >= 18 &&
+		    memcmp(line, "X-Kazaa-Username: ", 18) == 0)
+			return IPP2P_KAZAA * 100 + 2;
+		if (rem >= 24 &&
+		    memcmp(line, "User-Agent: PeerEnabler/", 24) == 0)
+			return IPP2P_KAZAA * 100 + 2;
+	}
+
+	return 0;
+}
+
+/* fast check for edonkey file segment transfer command */
+static unsigned int
+search_edk(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 6)
+		return 0;
+	if (payload[0] != 0xe3) {
+		return 0;
+	} else {
+		if (payload[5] == 0x47)
+			return IPP2P_DATA_EDK * 100;
+		else
+			return 0;
+	}
+}
+
+/* intensive but slower search for some edonkey packets including size-check */
+static unsigned int
+search_all_edk(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 6)
+		return 0;
+	if (payload[0] != 0xe3) {
+		return 0;
+	} else {
+		unsigned int cmd = get_u16(payload, 1);
+
+		if (cmd == plen - 5) {
+			switch (payload[5]) {
+			case 0x01:
+				/* Client: hello or Server:hello */
+			return IPP2P_EDK * 100 + 1;
+				case 0x4c:
+				/* Client: Hello-Answer */
+				return IPP2P_EDK * 100 + 9;
+			}
+		}
+		return 0;
+	}
+}
+
+/* fast check for Direct Connect send command */
+static unsigned int
+search_dc(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 6)
+		return 0;
+	if (payload[0] != 0x24) {
+		return 0;
+	} else {
+		if (memcmp(&payload[1], "Send|", 5) == 0)
+			return IPP2P_DATA_DC * 100;
+		else
+			return 0;
+	}
+}
+
+/* intensive but slower check for all direct connect packets */
+static unsigned int
+search_all_dc(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 7 || wlen < plen)
+		return 0;
+	if (payload[0] == 0x24 && payload[plen-1] == 0x7c) {
+		const unsigned char *t = &payload[1];
+
+		/* Client-Hub-Protocol */
+		if (memcmp(t, "Lock ", 5) == 0)
+			return IPP2P_DC * 100 + 1;
+
+		/*
+		 * Client-Client-Protocol, some are already recognized by
+		 * client-hub (like lock)
+		 */
+		if (plen >= 9 && memcmp(t, "MyNick ", 7) == 0)
+			return IPP2P_DC * 100 + 38;
+	}
+	return 0;
+}
+
+/* check for mute */
+static unsigned int
+search_mute(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen == 209 || plen == 345 || plen == 473 || plen == 609 ||
+	    plen == 1121) {
+		//printk(KERN_DEBUG "size hit: %u", size);
+		if (memcmp(payload,"PublicKey: ", 11) == 0) {
+			return IPP2P_MUTE * 100 + 0;
+			/*
+			if (memcmp(t + size - 14, "\x0aEndPublicKey\x0a", 14) == 0)
+				printk(KERN_DEBUG "end pubic key hit: %u", size);
+			*/
+		}
+	}
+	return 0;
+}
+
+/* check for xdcc */
+static unsigned int
+search_xdcc(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	/* search in small packets only, which are never truncated */
+	if (plen > 20 && plen < 200 && wlen == plen &&
+	    payload[plen-1] == 0x0a && payload[plen-2] == 0x0d && memcmp(payload, "PRIVMSG ", 8) == 0)
+	{
+		const unsigned char *x = payload + 10;
+		const unsigned char *end = payload + plen - 13;
+
+		/*
+		 * is seems to be a irc private massage, chedck for
+		 * xdcc command
+		 */
+		while (x < end && (x = memchr(x, ':', end - x)) != NULL) {
+			if (memcmp(x + 1, "xdcc send #", 11) == 0)
+				return IPP2P_XDCC * 100 + 0;
+			++x;
+		}
+	}
+	return 0;
+}
+
+/* search for waste */
+static unsigned int
+search_waste(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen >= 8 && memcmp(payload, "GET.sha1:", 9) == 0)
+		return IPP2P_WASTE * 100 + 0;
+
+	return 0;
+}
+
+/*
+ * @function_name:	called with the payload, its real length and the number
+ * 			of bytes readable at the payload pointer; the latter is
+ * 			smaller when only a window of a nonlinear skb was copied
+ * 			(see ipp2p_payload), in which case matchers that need
+ * 			the end of the payload do not match
+ * @first:	bytes a matching payload can start with, NULL if any
+ */
+struct ipp2p_search {
+	unsigned int command;
+	unsigned int packet_len;
+	unsigned int (*function_name)(const unsigned char *, const unsigned int,
+	                              const unsigned int);
+	const char *first;
+	unsigned int first_len;
+};
+
+#define FIRST(s)  (s), sizeof(s) - 1
+#define ANY_FIRST NULL, 0
+
+static const struct ipp2p_search matchlist[] = {
+	{IPP2P_EDK,         20, search_all_edk,    FIRST("\xe3")},
+	{IPP2P_DATA_KAZAA, 200, search_kazaa,      FIRST("G")}, /* exp */
+	{IPP2P_DATA_EDK,    60, search_edk,        FIRST("\xe3")}, /* exp */
+	{IPP2P_DATA_DC,     26, search_dc,         FIRST("$")}, /* exp */
+	{IPP2P_DC,           5, search_all_dc,     FIRST("$")},
+	{IPP2P_DATA_GNU,    40, search_gnu,        FIRST("G")}, /* exp */
+	{IPP2P_GNU,          5, search_all_gnu,    FIRST("G")},
+	{IPP2P_KAZAA,        5, search_all_kazaa,  FIRST("G")},
+	{IPP2P_BIT,         20, search_bittorrent, FIRST("\x13G\x00")},
+	{IPP2P_APPLE,        5, search_apple,      FIRST("a")},
+	{IPP2P_SOUL,         5, search_soul,       ANY_FIRST},
+	{IPP2P_WINMX,        2, search_winmx,      FIRST("SG8")},
+	{IPP2P_ARES,         5, search_ares,       ANY_FIRST},
+	{IPP2P_MUTE,       200, search_mute,       FIRST("P")},
+	{IPP2P_WASTE,        5, search_waste,      FIRST("G")},
+	{IPP2P_XDCC,         5, search_xdcc,       FIRST("P")},
+	{0},
+};
+
+static const struct ipp2p_search udp_list[] = {
+	{IPP2P_KAZAA, 14, udp_search_kazaa,         ANY_FIRST},
+	{IPP2P_BIT,   23, udp_search_bit,           ANY_FIRST},
+	{IPP2P_GNU,   11, udp_search_gnu,           FIRST("G")},
+	{IPP2P_EDK,    9, udp_search_edk,           FIRST("\xe3\xe4")},
+	{IPP2P_DC,    12, udp_search_directconnect, FIRST("$")},
+	{0},
+};
+
+/* Set bit i of @dispatch[b] for every entry i of @list that can start with b */
+static void
+ipp2p_build_dispatch(uint32_t *dispatch, const struct ipp2p_search *list)
+{
+	unsigned int i, j;
+
+	for (i = 0; list[i].command != 0; ++i) {
+		if (list[i].first == NULL) {
+			for (j = 0; j < 256; ++j)
+				dispatch[j] |= 1U << i;
+			continue;
+		}
+		for (j = 0; j < list[i].first_len; ++j)
+			dispatch[(unsigned char)list[i].first[j]] |= 1U << i;
+	}
+}
+
+#endif /* _IPP2P_SEARCH_H */
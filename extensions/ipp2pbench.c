@@ -0,0 +1,736 @@
+/*
+ * Replays pcap files through the xt_ipp2p signature matchers and reports,
+ * per search function, the same calls/hits/bytes counters as
+ * /proc/net/xt_ipp2p, optionally with the time spent per payload byte.
+ * With -c, the header-line scanners are also timed against their former
+ * byte-at-a-time versions.
+ *
+ * This program is released under the terms of GNU GPL version 2.
+ */
+#define _GNU_SOURCE 1
+#include <sys/types.h>
+#include <errno.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#if defined(__i386__) || defined(__x86_64__)
+#	include <x86intrin.h>
+#endif
+#include "xt_ipp2p.h"
+
+static inline uint16_t ipp2p_get_u16(const unsigned char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t ipp2p_get_u32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#define get_u8(X,  O)  (*(const uint8_t *)((X) + (O)))
+#define get_u16(X, O)  ipp2p_get_u16((const unsigned char *)(X) + (O))
+#define get_u32(X, O)  ipp2p_get_u32((const unsigned char *)(X) + (O))
+#define __constant_htons(x) htons(x)
+#define __constant_htonl(x) htonl(x)
+#define HX_memmem memmem
+
+#include "ipp2p_search.h"
+
+typedef unsigned int (*ipp2p_search_fn)(const unsigned char *,
+        const unsigned int, const unsigned int);
+
+#define NR_TCP (sizeof(matchlist) / sizeof(*matchlist) - 1)
+#define NR_UDP (sizeof(udp_list) / sizeof(*udp_list) - 1)
+
+#ifndef IPPROTO_UDPLITE
+#	define IPPROTO_UDPLITE 136
+#endif
+
+enum {
+	PCAP_MAGIC       = 0xa1b2c3d4,
+	PCAP_MAGIC_NSEC  = 0xa1b23c4d,
+	LINKTYPE_NULL      = 0,
+	LINKTYPE_ETHERNET  = 1,
+	LINKTYPE_RAW       = 101,
+	LINKTYPE_LOOP      = 108,
+	LINKTYPE_LINUX_SLL = 113,
+	LINKTYPE_IPV4      = 228,
+	LINKTYPE_IPV6      = 229,
+};
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major, version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_header {
+	uint32_t sec, usec, caplen, len;
+};
+
+/*
+ * A TCP or UDP payload as the kernel would see it: @plen is its real length,
+ * @wlen the bytes captured, like the window of a nonlinear skb.
+ */
+struct ipp2p_packet {
+	uint8_t l4proto;
+	unsigned int plen, wlen;
+	unsigned char *payload;
+};
+
+struct ipp2p_stat {
+	uint64_t calls, hits, bytes;
+	/* indices of the packets handed to the function */
+	unsigned int *pkts;
+	unsigned int nr_pkts, max_pkts;
+};
+
+static struct ipp2p_packet *packets;
+static unsigned int nr_packets, max_packets, nr_truncated;
+static struct ipp2p_stat tcp_stats[NR_TCP], udp_stats[NR_UDP];
+static uint32_t tcp_dispatch[256], udp_dispatch[256];
+/* keeps the benchmarked calls from being optimized away */
+static volatile unsigned int bench_sink;
+
+static const struct {
+	const char *name;
+	unsigned int command;
+} ipp2p_protos[] = {
+	{"edk",   IPP2P_EDK},
+	{"dc",    IPP2P_DC},
+	{"gnu",   IPP2P_GNU},
+	{"kazaa", IPP2P_KAZAA},
+	{"bit",   IPP2P_BIT},
+	{"apple", IPP2P_APPLE},
+	{"soul",  IPP2P_SOUL},
+	{"winmx", IPP2P_WINMX},
+	{"ares",  IPP2P_ARES},
+	{"mute",  IPP2P_MUTE},
+	{"waste", IPP2P_WASTE},
+	{"xdcc",  IPP2P_XDCC},
+};
+
+#define FN(f) {f, #f}
+static const struct {
+	ipp2p_search_fn function;
+	const char *name;
+} ipp2p_names[] = {
+	FN(udp_search_edk), FN(udp_search_kazaa), FN(udp_search_directconnect),
+	FN(udp_search_bit), FN(udp_search_gnu), FN(search_ares),
+	FN(search_soul), FN(search_winmx), FN(search_apple),
+	FN(search_bittorrent), FN(search_kazaa), FN(search_gnu),
+	FN(search_all_gnu), FN(search_all_kazaa), FN(search_edk),
+	FN(search_all_edk), FN(search_dc), FN(search_all_dc),
+	FN(search_mute), FN(search_xdcc), FN(search_waste),
+};
+#undef FN
+
+static const char *function_name(ipp2p_search_fn function)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ipp2p_names) / sizeof(*ipp2p_names); ++i)
+		if (ipp2p_names[i].function == function)
+			return ipp2p_names[i].name;
+	return "?";
+}
+
+/*
+ * search_all_gnu, search_all_kazaa and search_xdcc as they were before their
+ * scans for CRLF and ':' went through memchr, unchanged apart from the wlen
+ * parameter. They need the whole payload.
+ */
+static unsigned int
+old_search_all_gnu(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	if (plen < 11)
+		return 0;
+	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
+		if (plen >= 19 && memcmp(payload, "GNUTELLA CONNECT/", 17) == 0)
+			return IPP2P_GNU * 100 + 1;
+		if (memcmp(payload, "GNUTELLA/", 9) == 0)
+			return IPP2P_GNU * 100 + 2;
+
+		if (plen >= 22 && (memcmp(payload, "GET /get/", 9) == 0 ||
+		    memcmp(payload, "GET /uri-res/", 13) == 0))
+		{
+			unsigned int c;
+
+			for (c = 0; c < plen - 22; ++c)
+				if (payload[c] == 0x0d &&
+				    payload[c+1] == 0x0a &&
+				    (memcmp(&payload[c+2], "X-Gnutella-", 11) == 0 ||
+				    memcmp(&payload[c+2], "X-Queue:", 8) == 0))
+					return IPP2P_GNU * 100 + 3;
+		}
+	}
+	return 0;
+}
+
+static unsigned int
+old_search_all_kazaa(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	uint16_t c, end, rem;
+
+	if (plen < 7)
+		/* too short for anything we test for - early bailout */
+		return 0;
+
+	if (payload[plen-2] != 0x0d || payload[plen-1] != 0x0a)
+		return 0;
+
+	if (memcmp(payload, "GIVE ", 5) == 0)
+		return IPP2P_KAZAA * 100 + 1;
+
+	if (memcmp(payload, "GET /", 5) != 0)
+		return 0;
+
+	if (plen < 18)
+		/* The next tests would not succeed anyhow. */
+		return 0;
+
+	end = plen - 18;
+	rem = plen - 5;
+	for (c = 5; c < end; ++c, --rem) {
+		if (payload[c] != 0x0d)
+			continue;
+		if (payload[c+1] != 0x0a)
+			continue;
+		if (rem >= 18 &&
+		    memcmp(&payload[c+2], "X-Kazaa-Username: ", 18) == 0)
+			return IPP2P_KAZAA * 100 + 2;
+		if (rem >= 24 &&
+		    memcmp(&payload[c+2], "User-Agent: PeerEnabler/", 24) == 0)
+			return IPP2P_KAZAA * 100 + 2;
+	}
+
+	return 0;
+}
+
+static unsigned int
+old_search_xdcc(const unsigned char *payload, const unsigned int plen,
+    const unsigned int wlen)
+{
+	/* search in small packets only */
+	if (plen > 20 && plen < 200 && payload[plen-1] == 0x0a &&
+	    payload[plen-2] == 0x0d && memcmp(payload, "PRIVMSG ", 8) == 0)
+	{
+		uint16_t x = 10;
+		const uint16_t end = plen - 13;
+
+		/*
+		 * is seems to be a irc private massage, chedck for
+		 * xdcc command
+		 */
+		while (x < end)	{
+			if (payload[x] == ':')
+				if (memcmp(&payload[x+1], "xdcc send #", 11) == 0)
+					return IPP2P_XDCC * 100 + 0;
+			x++;
+		}
+	}
+	return 0;
+}
+
+static const struct {
+	ipp2p_search_fn function, old;
+} ipp2p_old[] = {
+	{search_all_gnu,   old_search_all_gnu},
+	{search_all_kazaa, old_search_all_kazaa},
+	{search_xdcc,      old_search_xdcc},
+};
+
+static bool stat_record(struct ipp2p_stat *stat, unsigned int idx)
+{
+	if (stat->nr_pkts == stat->max_pkts) {
+		unsigned int max = stat->max_pkts ? stat->max_pkts * 2 : 64;
+		unsigned int *p = realloc(stat->pkts, max * sizeof(*p));
+
+		if (p == NULL)
+			return false;
+		stat->pkts = p;
+		stat->max_pkts = max;
+	}
+	stat->pkts[stat->nr_pkts++] = idx;
+	return true;
+}
+
+static int add_packet(uint8_t l4proto, const unsigned char *payload,
+    unsigned int plen, unsigned int wlen)
+{
+	struct ipp2p_packet *pkt;
+
+	if (nr_packets == max_packets) {
+		unsigned int max = max_packets ? max_packets * 2 : 1024;
+
+		pkt = realloc(packets, max * sizeof(*pkt));
+		if (pkt == NULL)
+			return -1;
+		packets = pkt;
+		max_packets = max;
+	}
+	pkt = &packets[nr_packets];
+	/* old_search_all_kazaa compares up to two bytes past the payload */
+	pkt->payload = calloc(1, wlen + 2);
+	if (pkt->payload == NULL)
+		return -1;
+	memcpy(pkt->payload, payload, wlen);
+	pkt->l4proto = l4proto;
+	pkt->plen    = plen;
+	pkt->wlen    = wlen;
+	++nr_packets;
+	return 0;
+}
+
+/*
+ * Pick the transport payload out of an IP packet, of which @caplen bytes
+ * were captured, applying the same tests as ipp2p_mt4/ipp2p_mt6 and the
+ * header checks of ipp2p_mt_common.
+ */
+static int parse_ip(const unsigned char *ip, unsigned int caplen)
+{
+	unsigned int thoff, hlen, len;
+	uint8_t l4proto;
+
+	if (caplen < 1)
+		return 0;
+	if (ip[0] >> 4 == 4) {
+		if (caplen < 20 || (ip[0] & 0x0f) < 5)
+			return 0;
+		/* must not be a fragment */
+		if ((ipp2p_get_u16(ip + 6) & htons(0x1fff)) != 0)
+			return 0;
+		len     = ntohs(ipp2p_get_u16(ip + 2));
+		thoff   = (ip[0] & 0x0f) * 4;
+		l4proto = ip[9];
+	} else if (ip[0] >> 4 == 6) {
+		if (caplen < 40)
+			return 0;
+		len     = 40 + ntohs(ipp2p_get_u16(ip + 4));
+		thoff   = 40;
+		l4proto = ip[6];
+		for (;;) {
+			if (l4proto == IPPROTO_HOPOPTS ||
+			    l4proto == IPPROTO_ROUTING ||
+			    l4proto == IPPROTO_DSTOPTS) {
+				if (thoff + 8 > caplen)
+					return 0;
+				l4proto = ip[thoff];
+				thoff  += (ip[thoff+1] + 1) * 8;
+			} else if (l4proto == IPPROTO_FRAGMENT) {
+				if (thoff + 8 > caplen)
+					return 0;
+				if ((ipp2p_get_u16(ip + thoff + 2) &
+				    htons(0xfff8)) != 0)
+					return 0;
+				l4proto = ip[thoff];
+				thoff  += 8;
+			} else {
+				break;
+			}
+		}
+	} else {
+		return 0;
+	}
+	if (caplen > len)
+		caplen = len;
+	if (thoff > len || thoff > caplen)
+		return 0;
+	hlen = len - thoff;
+	caplen -= thoff;
+	ip     += thoff;
+
+	switch (l4proto) {
+	case IPPROTO_TCP:
+		if (caplen < 20)
+			return 0;
+		/* FIN, SYN or RST set */
+		if (ip[13] & 0x07)
+			return 0;
+		thoff = (ip[12] >> 4) * 4;
+		break;
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+		if (caplen < 8)
+			return 0;
+		thoff = 8;
+		break;
+	default:
+		return 0;
+	}
+	if (thoff > hlen || thoff >= caplen)
+		return 0;
+	hlen   -= thoff;
+	caplen -= thoff;
+	/* less than the kernel always has at hand */
+	if (caplen < hlen && caplen < IPP2P_PAYLOAD_WINDOW) {
+		++nr_truncated;
+		return 0;
+	}
+	return add_packet(l4proto, ip + thoff, hlen, caplen);
+}
+
+static int parse_frame(uint32_t linktype, const unsigned char *f,
+    unsigned int caplen)
+{
+	unsigned int off;
+	uint16_t proto;
+
+	switch (linktype) {
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		return parse_ip(f, caplen);
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		off = 4;
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (caplen < 16)
+			return 0;
+		off = 14;
+		proto = ipp2p_get_u16(f + off);
+		off += 2;
+		goto ether;
+	case LINKTYPE_ETHERNET:
+		if (caplen < 14)
+			return 0;
+		off = 12;
+		proto = ipp2p_get_u16(f + off);
+		off += 2;
+		/* 802.1Q and 802.1ad tags */
+		while ((proto == htons(0x8100) || proto == htons(0x88a8)) &&
+		       off + 4 <= caplen) {
+			proto = ipp2p_get_u16(f + off + 2);
+			off += 4;
+		}
+ ether:
+		if (proto != htons(0x0800) && proto != htons(0x86dd))
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+	if (off > caplen)
+		return 0;
+	return parse_ip(f + off, caplen - off);
+}
+
+static inline uint32_t swab32_if(uint32_t x, bool swap)
+{
+	return swap ? __builtin_bswap32(x) : x;
+}
+
+static int read_pcap(const char *file)
+{
+	struct pcap_file_header fh;
+	struct pcap_rec_header rh;
+	unsigned char *frame = NULL;
+	uint32_t snaplen, linktype;
+	bool swap;
+	FILE *fp;
+	int ret = -1;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	if (fread(&fh, sizeof(fh), 1, fp) != 1) {
+		fprintf(stderr, "%s: not a pcap file\n", file);
+		goto out;
+	}
+	if (fh.magic == PCAP_MAGIC || fh.magic == PCAP_MAGIC_NSEC) {
+		swap = false;
+	} else if (__builtin_bswap32(fh.magic) == PCAP_MAGIC ||
+	    __builtin_bswap32(fh.magic) == PCAP_MAGIC_NSEC) {
+		swap = true;
+	} else {
+		fprintf(stderr, "%s: not a pcap file (pcapng is not "
+		        "supported)\n", file);
+		goto out;
+	}
+	snaplen  = swab32_if(fh.snaplen, swap);
+	linktype = swab32_if(fh.linktype, swap) & 0x0fffffff;
+	if (snaplen == 0 || snaplen > 0x40000)
+		snaplen = 0x40000;
+	frame = malloc(snaplen);
+	if (frame == NULL) {
+		perror("malloc()");
+		goto out;
+	}
+	while (fread(&rh, sizeof(rh), 1, fp) == 1) {
+		uint32_t caplen = swab32_if(rh.caplen, swap);
+		uint32_t len    = swab32_if(rh.len, swap);
+
+		if (caplen > snaplen || caplen > len) {
+			fprintf(stderr, "%s: bad record length\n", file);
+			goto out;
+		}
+		if (fread(frame, 1, caplen, fp) != caplen)
+			break;
+		if (parse_frame(linktype, frame, caplen) < 0) {
+			perror("malloc()");
+			goto out;
+		}
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "read %s: %s\n", file, strerror(errno));
+		goto out;
+	}
+	ret = 0;
+ out:
+	free(frame);
+	fclose(fp);
+	return ret;
+}
+
+/* Same selection of candidates as ipp2p_mt_common */
+static int classify(unsigned int cmd, unsigned int *matched)
+{
+	unsigned int n, i;
+
+	for (n = 0; n < nr_packets; ++n) {
+		const struct ipp2p_packet *pkt = &packets[n];
+		bool tcp = pkt->l4proto == IPPROTO_TCP;
+		const struct ipp2p_search *list = tcp ? matchlist : udp_list;
+		struct ipp2p_stat *stats = tcp ? tcp_stats : udp_stats;
+		uint32_t cand = (tcp ? tcp_dispatch : udp_dispatch)[pkt->payload[0]];
+
+		for (; cand != 0; cand &= cand - 1) {
+			unsigned int ret;
+
+			i = __builtin_ctz(cand);
+			if ((cmd & list[i].command) != list[i].command ||
+			    pkt->plen <= list[i].packet_len)
+				continue;
+			ret = list[i].function_name(pkt->payload, pkt->plen,
+			      pkt->wlen);
+			++stats[i].calls;
+			stats[i].bytes += pkt->wlen;
+			if (!stat_record(&stats[i], n))
+				return -1;
+			if (ret != 0) {
+				++stats[i].hits;
+				++*matched;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+static inline uint64_t bench_clock(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+#	define BENCH_UNIT "cycles/byte"
+#else
+#	define BENCH_UNIT "ns/byte"
+#endif
+
+/* Runs @s over the packets it was handed during classification. */
+static double bench(ipp2p_search_fn function,
+    const struct ipp2p_stat *stat, unsigned int rounds)
+{
+	unsigned int r, i, acc = 0;
+	uint64_t start;
+
+	if (stat->bytes == 0)
+		return 0;
+	start = bench_clock();
+	for (r = 0; r < rounds; ++r)
+		for (i = 0; i < stat->nr_pkts; ++i) {
+			const struct ipp2p_packet *pkt = &packets[stat->pkts[i]];
+
+			acc += function(pkt->payload, pkt->plen, pkt->wlen);
+		}
+	bench_sink = acc;
+	return (double)(bench_clock() - start) / ((double)stat->bytes * rounds);
+}
+
+static void show(const char *proto, const struct ipp2p_search *list,
+    const struct ipp2p_stat *stats, unsigned int rounds)
+{
+	unsigned int i;
+
+	for (i = 0; list[i].command != 0; ++i) {
+		printf("%s %s %llu %llu %llu", proto,
+		       function_name(list[i].function_name),
+		       (unsigned long long)stats[i].calls,
+		       (unsigned long long)stats[i].hits,
+		       (unsigned long long)stats[i].bytes);
+		if (rounds > 0)
+			printf(" %.3f", bench(list[i].function_name,
+			       &stats[i], rounds));
+		printf("\n");
+	}
+}
+
+/*
+ * Runs the old and the current version of each scanner in ipp2p_old over
+ * the payloads it was handed, leaving out those not captured whole since the
+ * old code needs all of them. Returns the number of payloads for which they
+ * disagree.
+ */
+static int compare(unsigned int rounds, unsigned int *total)
+{
+	struct ipp2p_stat whole = {0};
+	unsigned int i, j, k, differ;
+
+	printf("function payloads bytes differ old-%s new-%s\n",
+	       BENCH_UNIT, BENCH_UNIT);
+	for (i = 0; i < sizeof(ipp2p_old) / sizeof(*ipp2p_old); ++i) {
+		const struct ipp2p_stat *stat;
+
+		for (j = 0; matchlist[j].command != 0; ++j)
+			if (matchlist[j].function_name == ipp2p_old[i].function)
+				break;
+		if (matchlist[j].command == 0)
+			continue;
+		stat = &tcp_stats[j];
+		whole.nr_pkts = 0;
+		whole.bytes   = 0;
+		differ = 0;
+		for (k = 0; k < stat->nr_pkts; ++k) {
+			const struct ipp2p_packet *pkt = &packets[stat->pkts[k]];
+
+			if (pkt->wlen != pkt->plen)
+				continue;
+			if (!stat_record(&whole, stat->pkts[k])) {
+				free(whole.pkts);
+				return -1;
+			}
+			whole.bytes += pkt->wlen;
+			if (ipp2p_old[i].function(pkt->payload, pkt->plen,
+			    pkt->wlen) != ipp2p_old[i].old(pkt->payload,
+			    pkt->plen, pkt->wlen))
+				++differ;
+		}
+		printf("%s %u %llu %u %.3f %.3f\n",
+		       function_name(ipp2p_old[i].function), whole.nr_pkts,
+		       (unsigned long long)whole.bytes, differ,
+		       bench(ipp2p_old[i].old, &whole, rounds),
+		       bench(ipp2p_old[i].function, &whole, rounds));
+		*total += differ;
+	}
+	free(whole.pkts);
+	return 0;
+}
+
+static int parse_protos(char *arg, unsigned int *cmd)
+{
+	char *tok, *save = NULL;
+	unsigned int i;
+
+	*cmd = 0;
+	for (tok = strtok_r(arg, ",", &save); tok != NULL;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(ipp2p_protos) / sizeof(*ipp2p_protos); ++i)
+			if (strcmp(tok, ipp2p_protos[i].name) == 0)
+				break;
+		if (i == sizeof(ipp2p_protos) / sizeof(*ipp2p_protos)) {
+			fprintf(stderr, "Unknown protocol: %s\n", tok);
+			return -1;
+		}
+		*cmd |= ipp2p_protos[i].command;
+	}
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	char *prog = strdup(argv0);
+
+	if (prog == NULL) {
+		perror("strdup()");
+		return;
+	}
+	fprintf(stderr, "%s [-c] [-p proto[,proto...]] [-n rounds] "
+	        "file.pcap...\n", basename(prog));
+	free(prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int cmd = 0, rounds = 0, matched = 0, differ = 0, i;
+	bool old = false;
+	int c;
+
+	for (i = 0; i < sizeof(ipp2p_protos) / sizeof(*ipp2p_protos); ++i)
+		cmd |= ipp2p_protos[i].command;
+	while ((c = getopt(argc, argv, "cn:p:")) != -1) {
+		switch (c) {
+		case 'c':
+			old = true;
+			break;
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			if (parse_protos(optarg, &cmd) < 0)
+				exit(EXIT_FAILURE);
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	for (i = optind; i < argc; ++i)
+		if (read_pcap(argv[i]) < 0)
+			exit(EXIT_FAILURE);
+
+	ipp2p_build_dispatch(tcp_dispatch, matchlist);
+	ipp2p_build_dispatch(udp_dispatch, udp_list);
+	if (classify(cmd, &matched) < 0) {
+		perror("malloc()");
+		exit(EXIT_FAILURE);
+	}
+	printf("# %u payloads, %u matched, %u skipped as truncated\n",
+	       nr_packets, matched, nr_truncated);
+	printf("proto function calls hits bytes%s\n",
+	       rounds > 0 ? " " BENCH_UNIT : "");
+	show("tcp", matchlist, tcp_stats, rounds);
+	show("udp", udp_list, udp_stats, rounds);
+	if (old) {
+		printf("\n");
+		if (compare(rounds > 0 ? rounds : 10, &differ) < 0) {
+			perror("malloc()");
+			exit(EXIT_FAILURE);
+		}
+		if (differ != 0)
+			printf("# %u payloads on which old and new disagree\n",
+			       differ);
+	}
+	exit(EXIT_SUCCESS);
+}
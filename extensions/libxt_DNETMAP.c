@@ -121,8 +121,44 @@ static void parse_prefix(char *arg, struct nf_nat_range *range)
 	range->max_addr.ip = range->min_addr.ip | ~netmask;
 }
 
+/* Parses IPv6 network address; only prefix lengths are accepted */
+static void parse_prefix6(char *arg, struct nf_nat_range *range)
+{
+	const struct in6_addr *ip;
+	struct in6_addr mask;
+	unsigned int bits = 128, i;
+	char *slash;
+
+	range->flags |= NF_NAT_RANGE_MAP_IPS;
+	slash = strchr(arg, '/');
+	if (slash)
+		*slash = '\0';
+
+	ip = xtables_numeric_to_ip6addr(arg);
+	if (ip == NULL)
+		xtables_error(PARAMETER_PROBLEM, "Bad IPv6 address \"%s\"\n",
+			      arg);
+	range->min_addr.in6 = *ip;
+	if (slash == NULL || !xtables_strtoui(slash + 1, NULL, &bits, 1, 127))
+		xtables_error(PARAMETER_PROBLEM,
+			      "Need an IPv6 prefix length between 1 and 127\n");
+
+	memset(&mask, 0, sizeof(mask));
+	for (i = 0; i < bits; ++i)
+		mask.s6_addr[i / 8] |= 0x80 >> (i % 8);
+	for (i = 0; i < 4; ++i) {
+		if (range->min_addr.ip6[i] & ~mask.s6_addr32[i]) {
+			*slash = '/';
+			xtables_error(PARAMETER_PROBLEM,
+				      "Bad network address \"%s\"\n", arg);
+		}
+		range->max_addr.ip6[i] = range->min_addr.ip6[i] |
+					 ~mask.s6_addr32[i];
+	}
+}
+
 static int DNETMAP_parse(int c, char **argv, int invert, unsigned int *flags,
-			 const void *entry, struct xt_entry_target **target)
+			 struct xt_entry_target **target, uint8_t nfproto)
 {
 	struct xt_DNETMAP_tginfo *tginfo = (void *)(*target)->data;
 	struct nf_nat_range *mr = &tginfo->prefix;
@@ -136,7 +172,10 @@ static int DNETMAP_parse(int c, char **argv, int invert, unsigned int *flags,
 				  invert);
 
 		/* TO-DO use xtables_ipparse_any instead? */
-		parse_prefix(optarg, mr);
+		if (nfproto == NFPROTO_IPV6)
+			parse_prefix6(optarg, mr);
+		else
+			parse_prefix(optarg, mr);
 		*flags |= XT_DNETMAP_PREFIX;
 		tginfo->flags |= XT_DNETMAP_PREFIX;
 		return 1;
@@ -176,15 +215,36 @@ static int DNETMAP_parse(int c, char **argv, int invert, unsigned int *flags,
 	}
 }
 
-static void DNETMAP_print_addr(const void *ip,
-			       const struct xt_entry_target *target,
-			       int numeric)
+static int DNETMAP_parse4(int c, char **argv, int invert, unsigned int *flags,
+			  const void *entry, struct xt_entry_target **target)
+{
+	return DNETMAP_parse(c, argv, invert, flags, target, NFPROTO_IPV4);
+}
+
+static int DNETMAP_parse6(int c, char **argv, int invert, unsigned int *flags,
+			  const void *entry, struct xt_entry_target **target)
+{
+	return DNETMAP_parse(c, argv, invert, flags, target, NFPROTO_IPV6);
+}
+
+static void DNETMAP_print_addr(const struct xt_entry_target *target,
+			       uint8_t nfproto)
 {
 	struct xt_DNETMAP_tginfo *tginfo = (void *)&target->data;
 	const struct nf_nat_range *r = &tginfo->prefix;
+	struct in6_addr mask;
 	struct in_addr a;
+	unsigned int i;
 	int bits;
 
+	if (nfproto == NFPROTO_IPV6) {
+		for (i = 0; i < 4; ++i)
+			mask.s6_addr32[i] = ~(r->min_addr.ip6[i] ^
+					      r->max_addr.ip6[i]);
+		printf("%s/%d", xtables_ip6addr_to_numeric(&r->min_addr.in6),
+		       xtables_ip6mask_to_cidr(&mask));
+		return;
+	}
 	a = r->min_addr.in;
 	printf("%s", xtables_ipaddr_to_numeric(&a));
 	a.s_addr = ~(r->min_addr.ip ^ r->max_addr.ip);
@@ -195,14 +255,15 @@ static void DNETMAP_print_addr(const void *ip,
 		printf("/%d", bits);
 }
 
-static void DNETMAP_save(const void *ip, const struct xt_entry_target *target)
+static void DNETMAP_save(const struct xt_entry_target *target,
+			 uint8_t nfproto)
 {
 	struct xt_DNETMAP_tginfo *tginfo = (void *)&target->data;
 	const __u8 *flags = &tginfo->flags;
 
 	if (*flags & XT_DNETMAP_PREFIX) {
 		printf(" --%s ", DNETMAP_opts[0].name);
-		DNETMAP_print_addr(ip, target, 0);
+		DNETMAP_print_addr(target, nfproto);
 	}
 
 	if (*flags & XT_DNETMAP_REUSE)
@@ -219,27 +280,59 @@ static void DNETMAP_save(const void *ip, const struct xt_entry_target *target)
 		printf(" --ttl %i ", tginfo->ttl);
 }
 
-static void DNETMAP_print(const void *ip, const struct xt_entry_target *target,
-			  int numeric)
+static void DNETMAP_save4(const void *ip, const struct xt_entry_target *target)
+{
+	DNETMAP_save(target, NFPROTO_IPV4);
+}
+
+static void DNETMAP_save6(const void *ip, const struct xt_entry_target *target)
+{
+	DNETMAP_save(target, NFPROTO_IPV6);
+}
+
+static void DNETMAP_print4(const void *ip, const struct xt_entry_target *target,
+			   int numeric)
+{
+	printf(" -j DNETMAP");
+	DNETMAP_save(target, NFPROTO_IPV4);
+}
+
+static void DNETMAP_print6(const void *ip, const struct xt_entry_target *target,
+			   int numeric)
 {
 	printf(" -j DNETMAP");
-	DNETMAP_save(ip, target);
+	DNETMAP_save(target, NFPROTO_IPV6);
 }
 
-static struct xtables_target dnetmap_tg_reg = {
-	.name          = MODULENAME,
-	.version       = XTABLES_VERSION,
-	.family        = NFPROTO_IPV4,
-	.size          = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
-	.userspacesize = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
-	.help          = DNETMAP_help,
-	.parse         = DNETMAP_parse,
-	.print         = DNETMAP_print,
-	.save          = DNETMAP_save,
-	.extra_opts    = DNETMAP_opts,
+static struct xtables_target dnetmap_tg_reg[] = {
+	{
+		.name          = MODULENAME,
+		.version       = XTABLES_VERSION,
+		.family        = NFPROTO_IPV4,
+		.size          = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
+		.userspacesize = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
+		.help          = DNETMAP_help,
+		.parse         = DNETMAP_parse4,
+		.print         = DNETMAP_print4,
+		.save          = DNETMAP_save4,
+		.extra_opts    = DNETMAP_opts,
+	},
+	{
+		.name          = MODULENAME,
+		.version       = XTABLES_VERSION,
+		.family        = NFPROTO_IPV6,
+		.size          = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
+		.userspacesize = XT_ALIGN(sizeof(struct xt_DNETMAP_tginfo)),
+		.help          = DNETMAP_help,
+		.parse         = DNETMAP_parse6,
+		.print         = DNETMAP_print6,
+		.save          = DNETMAP_save6,
+		.extra_opts    = DNETMAP_opts,
+	},
 };
 
 static void _init(void)
 {
-	xtables_register_target(&dnetmap_tg_reg);
+	xtables_register_targets(dnetmap_tg_reg,
+		sizeof(dnetmap_tg_reg) / sizeof(*dnetmap_tg_reg));
 }
@@ -7,6 +7,7 @@
  *	Free Software Foundation.
  */
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <getopt.h>
@@ -20,6 +21,11 @@ enum {
 	F_TARPIT   = 1 << 0,
 	F_HONEYPOT = 1 << 1,
 	F_RESET    = 1 << 2,
+	F_SRC_RATE    = 1 << 3,
+	F_SRC_BURST   = 1 << 4,
+	F_TOTAL_RATE  = 1 << 5,
+	F_TOTAL_BURST = 1 << 6,
+	F_LIMIT_NAME  = 1 << 7,
 };
 
 static const struct option tarpit_tg_opts[] = {
@@ -29,6 +35,18 @@ static const struct option tarpit_tg_opts[] = {
 	{NULL},
 };
 
+static const struct option tarpit_tg_opts1[] = {
+	{.name = "tarpit",       .has_arg = false, .val = 't'},
+	{.name = "honeypot",     .has_arg = false, .val = 'h'},
+	{.name = "reset",        .has_arg = false, .val = 'r'},
+	{.name = "source-rate",  .has_arg = true,  .val = 's'},
+	{.name = "source-burst", .has_arg = true,  .val = 'S'},
+	{.name = "total-rate",   .has_arg = true,  .val = 'a'},
+	{.name = "total-burst",  .has_arg = true,  .val = 'A'},
+	{.name = "limit-name",   .has_arg = true,  .val = 'n'},
+	{NULL},
+};
+
 static void tarpit_tg_help(void)
 {
 	printf(
@@ -38,6 +56,25 @@ static void tarpit_tg_help(void)
 		"  --reset       Enable inline resets\n");
 }
 
+static void tarpit_tg_help1(void)
+{
+	tarpit_tg_help();
+	printf(
+		"  --source-rate n    Send at most n replies per second to each source\n"
+		"  --source-burst n   ... allowing bursts of n replies (default 5)\n"
+		"  --total-rate n     Send at most n replies per second in total\n"
+		"  --total-burst n    ... allowing bursts of n replies (default 5)\n"
+		"  --limit-name name  Name of the limiter, required with a rate\n");
+}
+
+static void tarpit_tg_init1(struct xt_entry_target *target)
+{
+	struct xt_tarpit_tginfo1 *info = (void *)target->data;
+
+	info->src_burst   = 5;
+	info->total_burst = 5;
+}
+
 static int tarpit_tg_parse(int c, char **argv, int invert, unsigned int *flags,
                            const void *entry, struct xt_entry_target **target)
 {
@@ -60,6 +97,60 @@ static int tarpit_tg_parse(int c, char **argv, int invert, unsigned int *flags,
 	return false;
 }
 
+static uint32_t tarpit_parse_uint(const char *option, const char *arg,
+    unsigned int min)
+{
+	unsigned int value;
+
+	if (!xtables_strtoui(arg, NULL, &value, min, UINT32_MAX))
+		xtables_param_act(XTF_BAD_VALUE, "TARPIT", option, arg);
+	return value;
+}
+
+static int tarpit_tg_parse1(int c, char **argv, int invert, unsigned int *flags,
+                            const void *entry, struct xt_entry_target **target)
+{
+	struct xt_tarpit_tginfo1 *info = (void *)(*target)->data;
+
+	switch (c) {
+	case 's':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--source-rate",
+			*flags & F_SRC_RATE);
+		info->src_rate = tarpit_parse_uint("--source-rate", optarg, 1);
+		*flags |= F_SRC_RATE;
+		return true;
+	case 'S':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--source-burst",
+			*flags & F_SRC_BURST);
+		info->src_burst = tarpit_parse_uint("--source-burst", optarg, 1);
+		*flags |= F_SRC_BURST;
+		return true;
+	case 'a':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--total-rate",
+			*flags & F_TOTAL_RATE);
+		info->total_rate = tarpit_parse_uint("--total-rate", optarg, 1);
+		*flags |= F_TOTAL_RATE;
+		return true;
+	case 'A':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--total-burst",
+			*flags & F_TOTAL_BURST);
+		info->total_burst = tarpit_parse_uint("--total-burst", optarg, 1);
+		*flags |= F_TOTAL_BURST;
+		return true;
+	case 'n':
+		xtables_param_act(XTF_ONLY_ONCE, "TARPIT", "--limit-name",
+			*flags & F_LIMIT_NAME);
+		if (*optarg == '\0' || strlen(optarg) >= sizeof(info->name))
+			xtables_param_act(XTF_BAD_VALUE, "TARPIT",
+				"--limit-name", optarg);
+		strcpy(info->name, optarg);
+		*flags |= F_LIMIT_NAME;
+		return true;
+	}
+	/* variant is the first member in both revisions */
+	return tarpit_tg_parse(c, argv, invert, flags, entry, target);
+}
+
 static void tarpit_tg_check(unsigned int flags)
 {
 	if (flags == (F_TARPIT | F_HONEYPOT | F_RESET))
@@ -92,7 +183,45 @@ static void tarpit_tg_print(const void *ip,
 	tarpit_tg_save(ip, target);
 }
 
-static struct xtables_target tarpit_tg_reg = {
+static void tarpit_tg_check1(unsigned int flags)
+{
+	tarpit_tg_check(flags);
+	if ((flags & F_SRC_BURST) && !(flags & F_SRC_RATE))
+		xtables_error(PARAMETER_PROBLEM,
+			"TARPIT: --source-burst requires --source-rate");
+	if ((flags & F_TOTAL_BURST) && !(flags & F_TOTAL_RATE))
+		xtables_error(PARAMETER_PROBLEM,
+			"TARPIT: --total-burst requires --total-rate");
+	if (!(flags & F_LIMIT_NAME) != !(flags & (F_SRC_RATE | F_TOTAL_RATE)))
+		xtables_error(PARAMETER_PROBLEM,
+			"TARPIT: --limit-name and a rate must be used together");
+}
+
+static void tarpit_tg_save1(const void *ip,
+    const struct xt_entry_target *target)
+{
+	const struct xt_tarpit_tginfo1 *info = (const void *)target->data;
+
+	tarpit_tg_save(ip, target);
+	if (info->src_rate != 0)
+		printf("--source-rate %u --source-burst %u ",
+		       info->src_rate, info->src_burst);
+	if (info->total_rate != 0)
+		printf("--total-rate %u --total-burst %u ",
+		       info->total_rate, info->total_burst);
+	if (info->src_rate != 0 || info->total_rate != 0)
+		printf("--limit-name %s ", info->name);
+}
+
+static void tarpit_tg_print1(const void *ip,
+    const struct xt_entry_target *target, int numeric)
+{
+	printf(" -j TARPIT");
+	tarpit_tg_save1(ip, target);
+}
+
+static struct xtables_target tarpit_tg_reg[] = {
+	{
 	.version       = XTABLES_VERSION,
 	.name          = "TARPIT",
 	.family        = NFPROTO_UNSPEC,
@@ -104,9 +233,26 @@ static struct xtables_target tarpit_tg_reg = {
 	.print         = tarpit_tg_print,
 	.save          = tarpit_tg_save,
 	.extra_opts    = tarpit_tg_opts,
+	},
+	{
+	.version       = XTABLES_VERSION,
+	.name          = "TARPIT",
+	.revision      = 1,
+	.family        = NFPROTO_UNSPEC,
+	.size          = XT_ALIGN(sizeof(struct xt_tarpit_tginfo1)),
+	.userspacesize = offsetof(struct xt_tarpit_tginfo1, limit),
+	.help          = tarpit_tg_help1,
+	.init          = tarpit_tg_init1,
+	.parse         = tarpit_tg_parse1,
+	.final_check   = tarpit_tg_check1,
+	.print         = tarpit_tg_print1,
+	.save          = tarpit_tg_save1,
+	.extra_opts    = tarpit_tg_opts1,
+	},
 };
 
 static __attribute__((constructor)) void tarpit_tg_ldr(void)
 {
-	xtables_register_target(&tarpit_tg_reg);
+	xtables_register_targets(tarpit_tg_reg,
+		sizeof(tarpit_tg_reg) / sizeof(*tarpit_tg_reg));
 }
@@ -10,6 +10,7 @@
  */
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,11 +27,36 @@ static void condition_help(void)
 );
 }
 
+static void condition_help2(void)
+{
+	printf(
+"condition match options:\n"
+"[!] --condition name    Match on value stored in procfs file\n"
+"                        (by default, if it is not zero)\n"
+"    --condition-value value[/mask]\n"
+"                        ... if (value of file & mask) == value\n"
+"    --condition-range min[:max]\n"
+"                        ... if min <= value of file <= max\n"
+);
+}
+
 static const struct option condition_opts[] = {
 	{.name = "condition", .has_arg = true, .val = 'X'},
 	{NULL},
 };
 
+enum {
+	F_CONDITION = 1 << 0,
+	F_TEST      = 1 << 1,
+};
+
+static const struct option condition_opts2[] = {
+	{.name = "condition",       .has_arg = true, .val = 'X'},
+	{.name = "condition-value", .has_arg = true, .val = 'v'},
+	{.name = "condition-range", .has_arg = true, .val = 'r'},
+	{NULL},
+};
+
 static int condition_parse(int c, char **argv, int invert, unsigned int *flags,
                            const void *entry, struct xt_entry_match **match)
 {
@@ -55,6 +81,75 @@ static int condition_parse(int c, char **argv, int invert, unsigned int *flags,
 	return false;
 }
 
+static unsigned int condition_parse_uint(const char *s, char **end,
+    const char *option)
+{
+	unsigned int value;
+
+	if (!xtables_strtoui(s, end, &value, 0, UINT32_MAX))
+		xtables_param_act(XTF_BAD_VALUE, "condition", option, s);
+	return value;
+}
+
+static int condition_parse2(int c, char **argv, int invert, unsigned int *flags,
+                            const void *entry, struct xt_entry_match **match)
+{
+	struct xt_condition_mtinfo2 *info = (void *)(*match)->data;
+	char *end;
+
+	switch (c) {
+	case 'X':
+		if (*flags & F_CONDITION)
+			xtables_error(PARAMETER_PROBLEM,
+				   "Can't specify multiple conditions");
+
+		if (strlen(optarg) < sizeof(info->name))
+			strcpy(info->name, optarg);
+		else
+			xtables_error(PARAMETER_PROBLEM,
+				   "File name too long");
+
+		info->invert = invert;
+		*flags |= F_CONDITION;
+		return true;
+	case 'v':
+		xtables_param_act(XTF_NO_INVERT, "condition", "--condition-value", invert);
+		if (*flags & F_TEST)
+			xtables_error(PARAMETER_PROBLEM, "condition: Only one of "
+				   "--condition-value or --condition-range allowed");
+		info->op    = XT_CONDITION_VALUE;
+		info->value = condition_parse_uint(optarg, &end,
+		              "--condition-value");
+		info->mask  = UINT32_MAX;
+		if (*end == '/')
+			info->mask = condition_parse_uint(end + 1, &end,
+			             "--condition-value");
+		if (*end != '\0')
+			xtables_param_act(XTF_BAD_VALUE, "condition",
+				"--condition-value", optarg);
+		*flags |= F_TEST;
+		return true;
+	case 'r':
+		xtables_param_act(XTF_NO_INVERT, "condition", "--condition-range", invert);
+		if (*flags & F_TEST)
+			xtables_error(PARAMETER_PROBLEM, "condition: Only one of "
+				   "--condition-value or --condition-range allowed");
+		info->op  = XT_CONDITION_RANGE;
+		info->min = condition_parse_uint(optarg, &end,
+		            "--condition-range");
+		info->max = UINT32_MAX;
+		if (*end == ':')
+			info->max = condition_parse_uint(end + 1, &end,
+			            "--condition-range");
+		if (*end != '\0' || info->min > info->max)
+			xtables_param_act(XTF_BAD_VALUE, "condition",
+				"--condition-range", optarg);
+		*flags |= F_TEST;
+		return true;
+	}
+	return false;
+}
+
 static void condition_check(unsigned int flags)
 {
 	if (flags == 0)
@@ -62,6 +157,13 @@ static void condition_check(unsigned int flags)
 			   "Condition match: must specify --condition");
 }
 
+static void condition_check2(unsigned int flags)
+{
+	if (!(flags & F_CONDITION))
+		xtables_error(PARAMETER_PROBLEM,
+			   "Condition match: must specify --condition");
+}
+
 static void condition_save(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_condition_mtinfo *info = (const void *)match->data;
@@ -76,7 +178,33 @@ static void condition_print(const void *ip, const struct xt_entry_match *match,
 	condition_save(ip, match);
 }
 
-static struct xtables_match condition_mt_reg = {
+static void condition_save2(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_condition_mtinfo2 *info = (const void *)match->data;
+
+	printf("%s --condition \"%s\"", info->invert ? " !" : "", info->name);
+	switch (info->op) {
+	case XT_CONDITION_VALUE:
+		printf(" --condition-value 0x%x", info->value);
+		if (info->mask != UINT32_MAX)
+			printf("/0x%x", info->mask);
+		break;
+	case XT_CONDITION_RANGE:
+		printf(" --condition-range %u:%u", info->min, info->max);
+		break;
+	}
+	printf(" ");
+}
+
+static void condition_print2(const void *ip, const struct xt_entry_match *match,
+                             int numeric)
+{
+	printf(" -m condition");
+	condition_save2(ip, match);
+}
+
+static struct xtables_match condition_mt_reg[] = {
+	{
 	.name 		= "condition",
 	.revision	= 1,
 	.family		= NFPROTO_UNSPEC,
@@ -89,9 +217,25 @@ static struct xtables_match condition_mt_reg = {
 	.print 		= condition_print,
 	.save 		= condition_save,
 	.extra_opts 	= condition_opts,
+	},
+	{
+	.name 		= "condition",
+	.revision	= 2,
+	.family		= NFPROTO_UNSPEC,
+	.version 	= XTABLES_VERSION,
+	.size 		= XT_ALIGN(sizeof(struct xt_condition_mtinfo2)),
+	.userspacesize 	= offsetof(struct xt_condition_mtinfo2, condvar),
+	.help 		= condition_help2,
+	.parse 		= condition_parse2,
+	.final_check	= condition_check2,
+	.print 		= condition_print2,
+	.save 		= condition_save2,
+	.extra_opts 	= condition_opts2,
+	},
 };
 
 static __attribute__((constructor)) void condition_mt_ldr(void)
 {
-	xtables_register_match(&condition_mt_reg);
+	xtables_register_matches(condition_mt_reg,
+		sizeof(condition_mt_reg) / sizeof(*condition_mt_reg));
 }
@@ -42,6 +42,15 @@ static void psd_mt_help(void) {
 		" --psd-hi-ports-weight  hi          High ports weight\n\n");
 }
 
+static void psd_mt_help2(void)
+{
+	psd_mt_help();
+	printf(
+		" --psd-dst-threshold    count       Distinct destinations from a source /24 (/64)\n"
+		" --psd-src-threshold    count       Distinct sources on a destination port\n"
+		"A --psd-weight-threshold of 0 disables per-source port counting.\n\n");
+}
+
 static const struct option psd_mt_opts[] = {
 	{.name = "psd-weight-threshold", .has_arg = true, .val = '1'},
 	{.name = "psd-delay-threshold", .has_arg = true, .val = '2'},
@@ -50,6 +59,16 @@ static const struct option psd_mt_opts[] = {
 	{NULL}
 };
 
+static const struct option psd_mt_opts2[] = {
+	{.name = "psd-weight-threshold", .has_arg = true, .val = '1'},
+	{.name = "psd-delay-threshold", .has_arg = true, .val = '2'},
+	{.name = "psd-lo-ports-weight", .has_arg = true, .val = '3'},
+	{.name = "psd-hi-ports-weight", .has_arg = true, .val = '4'},
+	{.name = "psd-dst-threshold", .has_arg = true, .val = '5'},
+	{.name = "psd-src-threshold", .has_arg = true, .val = '6'},
+	{NULL}
+};
+
 /* Initialize the target. */
 static void psd_mt_init(struct xt_entry_match *match) {
 	struct xt_psd_info *psdinfo = (struct xt_psd_info *)match->data;
@@ -63,6 +82,9 @@ static void psd_mt_init(struct xt_entry_match *match) {
 #define XT_PSD_OPT_DTRESH 0x02
 #define XT_PSD_OPT_LPWEIGHT 0x04
 #define XT_PSD_OPT_HPWEIGHT 0x08
+#define XT_PSD_OPT_DSTTRESH 0x10
+#define XT_PSD_OPT_SRCTRESH 0x20
+#define XT_PSD_OPT_NOWEIGHT 0x40
 
 static int psd_mt_parse(int c, char **argv, int invert, unsigned int *flags,
                      const void *entry, struct xt_entry_match **match)
@@ -114,9 +136,54 @@ static int psd_mt_parse(int c, char **argv, int invert, unsigned int *flags,
 	return false;
 }
 
+static int psd_mt_parse2(int c, char **argv, int invert, unsigned int *flags,
+                         const void *entry, struct xt_entry_match **match)
+{
+	struct xt_psd_mtinfo2 *info = (void *)(*match)->data;
+	unsigned int num;
+
+	switch (c) {
+	case '1':
+		if (*flags & XT_PSD_OPT_CTRESH)
+			xtables_error(PARAMETER_PROBLEM, "Can't specify --psd-weight-threshold twice");
+		if (!xtables_strtoui(optarg, NULL, &num, 0, PSD_MAX_RATE))
+			xtables_error(PARAMETER_PROBLEM, "bad --psd-weight-threshold '%s'", optarg);
+		info->psd.weight_threshold = num;
+		*flags |= XT_PSD_OPT_CTRESH;
+		if (num == 0)
+			*flags |= XT_PSD_OPT_NOWEIGHT;
+		return true;
+	case '5':
+		if (*flags & XT_PSD_OPT_DSTTRESH)
+			xtables_error(PARAMETER_PROBLEM, "Can't specify --psd-dst-threshold twice");
+		if (!xtables_strtoui(optarg, NULL, &num, 1, UINT32_MAX))
+			xtables_error(PARAMETER_PROBLEM, "bad --psd-dst-threshold '%s'", optarg);
+		info->dst_threshold = num;
+		*flags |= XT_PSD_OPT_DSTTRESH;
+		return true;
+	case '6':
+		if (*flags & XT_PSD_OPT_SRCTRESH)
+			xtables_error(PARAMETER_PROBLEM, "Can't specify --psd-src-threshold twice");
+		if (!xtables_strtoui(optarg, NULL, &num, 1, UINT32_MAX))
+			xtables_error(PARAMETER_PROBLEM, "bad --psd-src-threshold '%s'", optarg);
+		info->src_threshold = num;
+		*flags |= XT_PSD_OPT_SRCTRESH;
+		return true;
+	}
+	return psd_mt_parse(c, argv, invert, flags, entry, match);
+}
+
 /* Final check; nothing. */
 static void psd_mt_final_check(unsigned int flags) {}
 
+static void psd_mt_final_check2(unsigned int flags)
+{
+	if ((flags & XT_PSD_OPT_NOWEIGHT) &&
+	    !(flags & (XT_PSD_OPT_DSTTRESH | XT_PSD_OPT_SRCTRESH)))
+		xtables_error(PARAMETER_PROBLEM, "psd: --psd-weight-threshold 0 "
+		              "needs --psd-dst-threshold or --psd-src-threshold");
+}
+
 static void psd_mt_save(const void *ip, const struct xt_entry_match *match)
 {
 	const struct xt_psd_info *psdinfo = (const struct xt_psd_info *)match->data;
@@ -132,24 +199,59 @@ static void psd_mt_print(const void *ip, const struct xt_entry_match *match, int
 	psd_mt_save(ip, match);
 }
 
-static struct xtables_match psd_mt_reg = {
-	.name           = "psd",
-	.version        = XTABLES_VERSION,
-	.revision       = 1,
-	.family         = NFPROTO_UNSPEC,
-	.size           = XT_ALIGN(sizeof(struct xt_psd_info)),
-	.userspacesize	= XT_ALIGN(sizeof(struct xt_psd_info)),
-	.help           = psd_mt_help,
-	.init           = psd_mt_init,
-	.parse          = psd_mt_parse,
-	.final_check    = psd_mt_final_check,
-	.print          = psd_mt_print,
-	.save           = psd_mt_save,
-	.extra_opts     = psd_mt_opts,
+static void psd_mt_save2(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_psd_mtinfo2 *info = (const void *)match->data;
+
+	psd_mt_save(ip, match);
+	if (info->dst_threshold != 0)
+		printf("--psd-dst-threshold %u ", info->dst_threshold);
+	if (info->src_threshold != 0)
+		printf("--psd-src-threshold %u ", info->src_threshold);
+}
+
+static void psd_mt_print2(const void *ip, const struct xt_entry_match *match, int numeric)
+{
+	printf(" -m psd");
+	psd_mt_save2(ip, match);
+}
+
+static struct xtables_match psd_mt_reg[] = {
+	{
+		.name           = "psd",
+		.version        = XTABLES_VERSION,
+		.revision       = 1,
+		.family         = NFPROTO_UNSPEC,
+		.size           = XT_ALIGN(sizeof(struct xt_psd_info)),
+		.userspacesize	= XT_ALIGN(sizeof(struct xt_psd_info)),
+		.help           = psd_mt_help,
+		.init           = psd_mt_init,
+		.parse          = psd_mt_parse,
+		.final_check    = psd_mt_final_check,
+		.print          = psd_mt_print,
+		.save           = psd_mt_save,
+		.extra_opts     = psd_mt_opts,
+	},
+	{
+		.name           = "psd",
+		.version        = XTABLES_VERSION,
+		.revision       = 2,
+		.family         = NFPROTO_UNSPEC,
+		.size           = XT_ALIGN(sizeof(struct xt_psd_mtinfo2)),
+		.userspacesize	= XT_ALIGN(sizeof(struct xt_psd_mtinfo2)),
+		.help           = psd_mt_help2,
+		.init           = psd_mt_init,
+		.parse          = psd_mt_parse2,
+		.final_check    = psd_mt_final_check2,
+		.print          = psd_mt_print2,
+		.save           = psd_mt_save2,
+		.extra_opts     = psd_mt_opts2,
+	},
 };
 
 static __attribute__((constructor)) void psd_mt_ldr(void)
 {
-	xtables_register_match(&psd_mt_reg);
+	xtables_register_matches(psd_mt_reg,
+		sizeof(psd_mt_reg) / sizeof(*psd_mt_reg));
 }
 
@@ -23,6 +23,9 @@ enum {
 	FL_GROW      = 1 << 2,
 	FL_PACKET    = 1 << 3,
 	FL_NO_CHANGE = 1 << 4,
+	FL_REFILL    = 1 << 5,
+	FL_PERIOD    = 1 << 6,
+	FL_REFILL_MAX = 1 << 7,
 };
 
 static const struct option quota_mt2_opts[] = {
@@ -34,6 +37,18 @@ static const struct option quota_mt2_opts[] = {
 	{NULL},
 };
 
+static const struct option quota_mt3_opts[] = {
+	{.name = "grow",          .has_arg = false, .val = 'g'},
+	{.name = "no-change",     .has_arg = false, .val = 'c'},
+	{.name = "name",          .has_arg = true,  .val = 'n'},
+	{.name = "quota",         .has_arg = true,  .val = 'q'},
+	{.name = "packets",       .has_arg = false, .val = 'p'},
+	{.name = "refill",        .has_arg = true,  .val = 'r'},
+	{.name = "refill-period", .has_arg = true,  .val = 'P'},
+	{.name = "refill-max",    .has_arg = true,  .val = 'm'},
+	{NULL},
+};
+
 static void quota_mt2_help(void)
 {
 	printf(
@@ -46,6 +61,17 @@ static void quota_mt2_help(void)
 	);
 }
 
+static void quota_mt3_help(void)
+{
+	quota_mt2_help();
+	printf(
+	"    --refill amount  add amount to the counter every period\n"
+	"    --refill-period seconds\n"
+	"                     length of a period, counted from the epoch\n"
+	"    --refill-max max refill no further than max (default: amount)\n"
+	);
+}
+
 static int
 quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
 	        const void *entry, struct xt_entry_match **match)
@@ -93,6 +119,61 @@ quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
 	return false;
 }
 
+static int
+quota_mt3_parse(int c, char **argv, int invert, unsigned int *flags,
+	        const void *entry, struct xt_entry_match **match)
+{
+	struct xt_quota_mtinfo3 *info = (void *)(*match)->data;
+	unsigned int num;
+	char *end;
+
+	switch (c) {
+	case 'r':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--refill", *flags & FL_REFILL);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--refill", invert);
+		info->refill = strtoull(optarg, &end, 0);
+		if (*end != '\0' || info->refill == 0)
+			xtables_error(PARAMETER_PROBLEM, "quota match: "
+			           "invalid value for --refill");
+		if (!(*flags & FL_REFILL_MAX))
+			info->refill_max = info->refill;
+		*flags |= FL_REFILL;
+		return true;
+	case 'P':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--refill-period", *flags & FL_PERIOD);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--refill-period", invert);
+		if (!xtables_strtoui(optarg, NULL, &num, 1, UINT32_MAX))
+			xtables_error(PARAMETER_PROBLEM, "quota match: "
+			           "invalid value for --refill-period");
+		info->refill_period = num;
+		*flags |= FL_PERIOD;
+		return true;
+	case 'm':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--refill-max", *flags & FL_REFILL_MAX);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--refill-max", invert);
+		info->refill_max = strtoull(optarg, &end, 0);
+		if (*end != '\0')
+			xtables_error(PARAMETER_PROBLEM, "quota match: "
+			           "invalid value for --refill-max");
+		*flags |= FL_REFILL_MAX;
+		return true;
+	}
+	return quota_mt2_parse(c, argv, invert, flags, entry, match);
+}
+
+static void quota_mt3_check(unsigned int flags)
+{
+	if (!(flags & FL_REFILL) != !(flags & FL_PERIOD))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--refill and --refill-period go together");
+	if ((flags & FL_REFILL_MAX) && !(flags & FL_REFILL))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--refill-max needs --refill");
+	if ((flags & FL_REFILL) && (flags & FL_GROW))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--refill cannot be used with --grow");
+}
+
 static void
 quota_mt2_save(const void *ip, const struct xt_entry_match *match)
 {
@@ -118,21 +199,64 @@ static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
 	quota_mt2_save(ip, match);
 }
 
-static struct xtables_match quota_mt2_reg = {
-	.family        = NFPROTO_UNSPEC,
-	.revision      = 3,
-	.name          = "quota2",
-	.version       = XTABLES_VERSION,
-	.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2)),
-	.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
-	.help          = quota_mt2_help,
-	.parse         = quota_mt2_parse,
-	.print         = quota_mt2_print,
-	.save          = quota_mt2_save,
-	.extra_opts    = quota_mt2_opts,
+static void
+quota_mt3_save(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_quota_mtinfo3 *q = (void *)match->data;
+
+	quota_mt2_save(ip, match);
+	if (q->refill_period == 0)
+		return;
+	printf(" --refill %llu --refill-period %u ",
+	       (unsigned long long)q->refill, q->refill_period);
+	if (q->refill_max != q->refill)
+		printf(" --refill-max %llu ",
+		       (unsigned long long)q->refill_max);
+}
+
+static void quota_mt3_print(const void *ip, const struct xt_entry_match *match,
+                            int numeric)
+{
+	printf(" -m quota");
+	quota_mt3_save(ip, match);
+}
+
+static struct xtables_match quota_mt2_reg[] = {
+	{
+		.family        = NFPROTO_UNSPEC,
+		.revision      = 3,
+		.name          = "quota2",
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2)),
+		.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
+		.help          = quota_mt2_help,
+		.parse         = quota_mt2_parse,
+		.print         = quota_mt2_print,
+		.save          = quota_mt2_save,
+		.extra_opts    = quota_mt2_opts,
+	},
+	{
+		/*
+		 * The refill parameters come after the kernel's master
+		 * pointer, so they are not compared either.
+		 */
+		.family        = NFPROTO_UNSPEC,
+		.revision      = 4,
+		.name          = "quota2",
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo3)),
+		.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
+		.help          = quota_mt3_help,
+		.parse         = quota_mt3_parse,
+		.final_check   = quota_mt3_check,
+		.print         = quota_mt3_print,
+		.save          = quota_mt3_save,
+		.extra_opts    = quota_mt3_opts,
+	},
 };
 
 static __attribute__((constructor)) void quota2_mt_ldr(void)
 {
-	xtables_register_match(&quota_mt2_reg);
+	xtables_register_matches(quota_mt2_reg,
+		sizeof(quota_mt2_reg) / sizeof(*quota_mt2_reg));
 }
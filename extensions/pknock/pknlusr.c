@@ -1,4 +1,6 @@
+#define _GNU_SOURCE 1
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,6 +20,40 @@
 #define MAX_GROUP_ID \
 	(sizeof((struct sockaddr_nl){0}.nl_groups) * CHAR_BIT)
 
+/* Number of datagrams fetched per recvmmsg() call */
+#define RECV_BATCH 16
+
+/*
+ * Prints every notification in a datagram. The kernel module packs up to
+ * XT_PKNOCK_NL_BATCH_MAX records into one message when batching is enabled.
+ */
+static void print_msgs(struct nlmsghdr *nlmsg, int len)
+{
+	for (; NLMSG_OK(nlmsg, len); nlmsg = NLMSG_NEXT(nlmsg, len)) {
+		const struct cn_msg *cn_msg = NLMSG_DATA(nlmsg);
+		const struct xt_pknock_nl_msg *pknock_msg;
+		size_t avail, count, i;
+
+		if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*cn_msg)))
+			continue;
+		avail = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*cn_msg));
+		if (cn_msg->len < avail)
+			avail = cn_msg->len;
+		count = avail / sizeof(*pknock_msg);
+		pknock_msg = (const struct xt_pknock_nl_msg *)cn_msg->data;
+
+		for (i = 0; i < count; ++i, ++pknock_msg) {
+			const char *ip;
+			char ipbuf[INET_ADDRSTRLEN];
+
+			ip = inet_ntop(AF_INET, &pknock_msg->peer_ip, ipbuf, sizeof(ipbuf));
+			printf("rule_name: %.*s - ip %s\n",
+			       (int)sizeof(pknock_msg->rule_name),
+			       pknock_msg->rule_name, ip);
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int status;
@@ -25,9 +61,10 @@ int main(int argc, char **argv)
 	struct sockaddr_nl local_addr = {.nl_family = AF_NETLINK};
 	int sock_fd;
 	size_t nlmsg_size;
-	struct nlmgrhdr *nlmsg;
-	struct cn_msg *cn_msg;
-	struct xt_pknock_nl_msg *pknock_msg;
+	char *bufs;
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	unsigned int i;
 
 	if (argc > 2) {
 		char *prog = strdup(argv[0]);
@@ -67,33 +104,39 @@ int main(int argc, char **argv)
 		goto err_close_sock;
 	}
 
-	nlmsg_size = NLMSG_SPACE(sizeof(*cn_msg) + sizeof(*pknock_msg));
-	nlmsg = malloc(nlmsg_size);
-	if (!nlmsg) {
+	nlmsg_size = NLMSG_SPACE(sizeof(struct cn_msg) +
+	             XT_PKNOCK_NL_BATCH_MAX * sizeof(struct xt_pknock_nl_msg));
+	bufs = malloc(RECV_BATCH * nlmsg_size);
+	if (!bufs) {
+		status = -1;
 		perror("malloc()");
 		goto err_close_sock;
 	}
 
-	while(1) {
-		const char *ip;
-		char ipbuf[INET_ADDRSTRLEN];
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RECV_BATCH; ++i) {
+		iov[i].iov_base = bufs + i * nlmsg_size;
+		iov[i].iov_len  = nlmsg_size;
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-		memset(nlmsg, 0, nlmsg_size);
-		status = recv(sock_fd, nlmsg, nlmsg_size, 0);
+	while(1) {
+		/* Block for the first datagram, then take whatever is queued. */
+		status = recvmmsg(sock_fd, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
 		if (status < 0) {
-			perror("recv()");
+			perror("recvmmsg()");
 			goto err_free_msg;
 		}
 		if (status == 0)
 			break;
-		cn_msg = NLMSG_DATA(nlmsg);
-		pknock_msg = (struct xt_pknock_nl_msg *)(cn_msg->data);
-		ip = inet_ntop(AF_INET, &pknock_msg->peer_ip, ipbuf, sizeof(ipbuf));
-		printf("rule_name: %s - ip %s\n", pknock_msg->rule_name, ip);
+		for (i = 0; i < (unsigned int)status; ++i)
+			print_msgs(iov[i].iov_base, msgs[i].msg_len);
+		fflush(stdout);
 	}
 
 err_free_msg:
-	free(nlmsg);
+	free(bufs);
 err_close_sock:
 	close(sock_fd);
 	exit(status == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
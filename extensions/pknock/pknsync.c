@@ -0,0 +1,237 @@
+/*
+ * Export and import of xt_pknock peer state, e.g. to pre-sync the standby
+ * node of a firewall pair.
+ *
+ * This program is released under the terms of GNU GPL version 2.
+ */
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/types.h>
+#include <errno.h>
+#include <libgen.h>
+
+#include "xt_pknock.h"
+
+#define STATE_DIR "/proc/net/xt_pknock_state/"
+#define STATE_MAGIC "PKNSTAT1"
+
+/* Records moved per read()/write() */
+#define IO_BATCH 256
+
+struct state_header {
+	char magic[8];
+	uint32_t rec_size;
+	uint32_t __pad;
+};
+
+static int full_write(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+/* Reads up to @size bytes; short only at end of file. */
+static ssize_t full_read(int fd, void *buf, size_t size)
+{
+	char *p = buf;
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < size) {
+		ret = read(fd, p + done, size - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int open_rule(const char *rule, int flags)
+{
+	char path[sizeof(STATE_DIR) + XT_PKNOCK_MAX_BUF_LEN + 1];
+	int fd;
+
+	if (strlen(rule) > XT_PKNOCK_MAX_BUF_LEN || strchr(rule, '/') != NULL) {
+		fprintf(stderr, "Rule name invalid: %s\n", rule);
+		return -1;
+	}
+	snprintf(path, sizeof(path), STATE_DIR "%s", rule);
+	fd = open(path, flags);
+	if (fd < 0)
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+	return fd;
+}
+
+static int read_header(int fd)
+{
+	struct state_header hdr;
+
+	if (full_read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) != 0) {
+		fputs("Input is not a pknock state dump.\n", stderr);
+		return -1;
+	}
+	if (hdr.rec_size != sizeof(struct xt_pknock_peer_state)) {
+		fputs("Record size or byte order of the dump does not match.\n",
+		      stderr);
+		return -1;
+	}
+	return 0;
+}
+
+/* Copies records from @in to @out, both positioned at the first record. */
+static int copy_records(int in, int out)
+{
+	struct xt_pknock_peer_state buf[IO_BATCH];
+	ssize_t ret;
+
+	while ((ret = full_read(in, buf, sizeof(buf))) > 0) {
+		if (ret % sizeof(*buf) != 0) {
+			fputs("Truncated record.\n", stderr);
+			return -1;
+		}
+		if (full_write(out, buf, ret) < 0) {
+			perror("write()");
+			return -1;
+		}
+	}
+	if (ret < 0) {
+		perror("read()");
+		return -1;
+	}
+	return 0;
+}
+
+static int do_dump(const char *rule)
+{
+	struct state_header hdr = {.rec_size = sizeof(struct xt_pknock_peer_state)};
+	int fd, ret;
+
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+	fd = open_rule(rule, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (full_write(STDOUT_FILENO, &hdr, sizeof(hdr)) < 0) {
+		perror("write()");
+		close(fd);
+		return -1;
+	}
+	ret = copy_records(fd, STDOUT_FILENO);
+	close(fd);
+	return ret;
+}
+
+static int do_restore(const char *rule)
+{
+	int fd, ret;
+
+	if (read_header(STDIN_FILENO) < 0)
+		return -1;
+	fd = open_rule(rule, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = copy_records(STDIN_FILENO, fd);
+	if (close(fd) < 0 && ret == 0) {
+		perror("close()");
+		ret = -1;
+	}
+	return ret;
+}
+
+static const char *status_name(uint8_t status)
+{
+	switch (status) {
+	case XT_PKNOCK_PEER_INIT:     return "INIT";
+	case XT_PKNOCK_PEER_MATCHING: return "MATCHING";
+	case XT_PKNOCK_PEER_ALLOWED:  return "ALLOWED";
+	default:                      return "UNKNOWN";
+	}
+}
+
+static int do_show(void)
+{
+	struct xt_pknock_peer_state buf[IO_BATCH];
+	char ipbuf[INET_ADDRSTRLEN];
+	ssize_t ret;
+	size_t i;
+
+	if (read_header(STDIN_FILENO) < 0)
+		return -1;
+	while ((ret = full_read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < ret / sizeof(*buf); ++i) {
+			const struct xt_pknock_peer_state *st = &buf[i];
+
+			inet_ntop(AF_INET, &st->peer_ip, ipbuf, sizeof(ipbuf));
+			printf("src=%s proto=%s status=%s "
+			       "accepted_knock_count=%u age=%u [secs]",
+			       ipbuf, st->proto == IPPROTO_TCP ? "TCP" : "UDP",
+			       status_name(st->status),
+			       st->accepted_knock_count, st->age);
+			if (st->status == XT_PKNOCK_PEER_ALLOWED)
+				printf(" login=%llu",
+				       (unsigned long long)st->login_sec);
+			printf("\n");
+		}
+	}
+	if (ret < 0) {
+		perror("read()");
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	char *prog = strdup(argv0);
+
+	if (prog == NULL) {
+		perror("strdup()");
+		return;
+	}
+	fprintf(stderr, "%s dump rule-name > file\n"
+	        "%s restore rule-name < file\n"
+	        "%s show < file\n",
+	        basename(prog), basename(prog), basename(prog));
+	free(prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+		ret = do_dump(argv[2]);
+	} else if (argc == 3 && strcmp(argv[1], "restore") == 0) {
+		ret = do_restore(argv[2]);
+	} else if (argc == 2 && strcmp(argv[1], "show") == 0) {
+		ret = do_show();
+	} else {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -22,48 +22,98 @@
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
 #include <linux/jiffies.h>
-#include <linux/timer.h>
+#include <linux/workqueue.h>
 #include <linux/seq_file.h>
 #include <linux/connector.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
 #include <linux/netfilter/x_tables.h>
+#include <crypto/algapi.h>
 #include <crypto/hash.h>
 #include "xt_pknock.h"
 #include "compat_xtables.h"
 
 enum status {
-	ST_INIT = 1,
-	ST_MATCHING,
-	ST_ALLOWED,
+	ST_INIT     = XT_PKNOCK_PEER_INIT,
+	ST_MATCHING = XT_PKNOCK_PEER_MATCHING,
+	ST_ALLOWED  = XT_PKNOCK_PEER_ALLOWED,
+};
+
+enum {
+	HMAC_OPEN = 0,
+	HMAC_CLOSE,
+	HMAC_MAX,
+
+	PKNOCK_HMAC_SIZE = 32, /* hmac(sha256) */
+};
+
+/**
+ * Expected knock digest, valid as long as all of @info, @gen and @epoch_min
+ * still match the knock being verified.
+ *
+ * @info:	match the digest was computed for (identifies the secret)
+ * @gen:	rule->hmac_gen at computation time
+ */
+struct peer_hmac {
+	const struct xt_pknock_mtinfo *info;
+	unsigned int gen;
+	unsigned int epoch_min;
+	uint8_t digest[PKNOCK_HMAC_SIZE];
 };
 
 /**
+ * @gc_list:	position in rule->gc_matching or rule->gc_allowed
  * @timestamp:	seconds, but not since epoch (uses jiffies/HZ)
  * @login_sec: seconds at login since the epoch
+ * @hmac:	cached open/close secret digests for the current minute
  */
 struct peer {
 	struct list_head head;
+	struct list_head gc_list;
 	__be32 ip;
 	uint32_t accepted_knock_count;
 	unsigned long timestamp;
 	unsigned long login_sec;
 	enum status status;
 	uint8_t proto;
+	struct peer_hmac hmac[HMAC_MAX];
 };
 
 /**
- * @timer:	garbage collector timer
+ * @gc_work:	deferred garbage collector
+ * @gc_matching:	peers not ALLOWED, ordered by @timestamp (oldest first)
+ * @gc_allowed:	ALLOWED peers, ordered by @login_sec (oldest first)
  * @max_time:	max matching time between ports
+ * @ports_count:	length of the knock sequence, 0 until a --knockports
+ * 		rule was added
+ * @hmac_gen:	bumped whenever the secrets may have changed
+ * @hmac_rejected:	knocks that failed the open secret check
  */
 struct xt_pknock_rule {
 	struct list_head head;
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	int rule_name_len;
 	unsigned int ref_count;
-	struct timer_list timer;
+	struct delayed_work gc_work;
+	struct list_head gc_matching, gc_allowed;
 	struct list_head *peer_head;
-	struct proc_dir_entry *status_proc;
+	struct proc_dir_entry *status_proc, *state_proc, *stats_proc;
 	unsigned long max_time;
 	unsigned long autoclose_time;
+	unsigned int ports_count;
+	unsigned int hmac_gen;
+	unsigned long hmac_rejected;
+};
+
+/**
+ * Per-CPU buffer of pending netlink messages.
+ *
+ * @count:	messages in @msg
+ */
+struct pknock_nl_batch {
+	spinlock_t lock;
+	unsigned int count;
+	struct xt_pknock_nl_msg msg[XT_PKNOCK_NL_BATCH_MAX];
 };
 
 /**
@@ -85,6 +135,10 @@ enum {
 	DEFAULT_GC_EXPIRATION_TIME = 65000, /* in msecs */
 	DEFAULT_RULE_HASH_SIZE  = 8,
 	DEFAULT_PEER_HASH_SIZE  = 16,
+	/* peer state records imported per lock hold */
+	PEER_IMPORT_BATCH       = 64,
+	/* peers examined per garbage collector run */
+	PEER_GC_BATCH           = 64,
 };
 
 #define hashtable_for_each_safe(pos, n, head, size, i)	\
@@ -97,9 +151,16 @@ static unsigned int rule_hashsize	= DEFAULT_RULE_HASH_SIZE;
 static unsigned int peer_hashsize	= DEFAULT_PEER_HASH_SIZE;
 static unsigned int gc_expir_time = DEFAULT_GC_EXPIRATION_TIME;
 static int nl_multicast_group		= -1;
+static unsigned int nl_batch_ms;
 static struct list_head *rule_hashtable;
-static struct proc_dir_entry *pde;
+static struct proc_dir_entry *pde, *pde_state, *pde_stats;
 static DEFINE_SPINLOCK(list_lock);
+#if IS_ENABLED(CONFIG_CONNECTOR)
+static struct pknock_nl_batch __percpu *nl_batch;
+static struct cn_msg *nl_batch_msg;
+static void pknock_nl_flush(struct work_struct *);
+static DECLARE_DELAYED_WORK(nl_flush_work, pknock_nl_flush);
+#endif
 
 static struct {
 	const char *algo;
@@ -120,6 +181,8 @@ module_param(gc_expir_time, int, S_IRUGO);
 MODULE_PARM_DESC(gc_expir_time, "Time until garbage collection after valid knock packet (default: 65000 msec)");
 module_param(nl_multicast_group, int, S_IRUGO);
 MODULE_PARM_DESC(nl_multicast_group, "Netlink multicast group number for pknock messages");
+module_param(nl_batch_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(nl_batch_ms, "Batch netlink messages and send them every N msecs (default: 0, send each at once)");
 
 /**
  * Calculates a value from 0 to max from a hash of the arguments.
@@ -268,6 +331,40 @@ static const struct seq_operations pknock_seq_ops = {
 	.show = pknock_seq_show
 };
 
+/**
+ * Emits the peers of one bucket as binary struct xt_pknock_peer_state.
+ *
+ * @s
+ * @v
+ * @return: 0 if OK
+ */
+static int
+pknock_state_seq_show(struct seq_file *s, void *v)
+{
+	const struct list_head *peer_head = v;
+	const struct peer *peer;
+	struct xt_pknock_peer_state st;
+
+	list_for_each_entry(peer, peer_head, head) {
+		memset(&st, 0, sizeof(st));
+		st.peer_ip   = peer->ip;
+		st.accepted_knock_count = peer->accepted_knock_count;
+		st.age       = jiffies / HZ - peer->timestamp;
+		st.status    = peer->status;
+		st.proto     = peer->proto;
+		st.login_sec = peer->login_sec;
+		seq_write(s, &st, sizeof(st));
+	}
+	return 0;
+}
+
+static const struct seq_operations pknock_state_seq_ops = {
+	.start = pknock_seq_start,
+	.next = pknock_seq_next,
+	.stop = pknock_seq_stop,
+	.show = pknock_state_seq_show
+};
+
 /**
  * @inode
  * @file
@@ -290,17 +387,48 @@ static const struct proc_ops pknock_proc_ops = {
 	.proc_release = seq_release,
 };
 
+static const struct proc_ops pknock_state_proc_ops;
+
+/*
+ * /proc/net/xt_pknock_stats/<rule>: counters of the rule, kept apart from
+ * the status file so that its per-peer line format stays as it is.
+ */
+static int pknock_stats_show(struct seq_file *s, void *v)
+{
+	const struct xt_pknock_rule *rule = s->private;
+
+	seq_printf(s, "hmac_rejected=%lu\n", READ_ONCE(rule->hmac_rejected));
+	return 0;
+}
+
+static int pknock_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pknock_stats_show, PDE_DATA(inode));
+}
+
+static const struct proc_ops pknock_stats_proc_ops = {
+	.proc_open    = pknock_stats_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
+
 /**
- * It updates the rule timer to execute garbage collector.
+ * Puts the peer at the tail of the garbage collector list matching its
+ * status and makes sure a collection is scheduled. Must be called whenever
+ * peer->timestamp or peer->login_sec is set, so that both lists stay
+ * ordered by expiry.
  *
  * @rule
+ * @peer
  */
-static void update_rule_gc_timer(struct xt_pknock_rule *rule)
+static void peer_gc_queue(struct xt_pknock_rule *rule, struct peer *peer)
 {
-	if (timer_pending(&rule->timer))
-		del_timer(&rule->timer);
-	rule->timer.expires = jiffies + msecs_to_jiffies(gc_expir_time);
-	add_timer(&rule->timer);
+	list_move_tail(&peer->gc_list, peer->status == ST_ALLOWED ?
+	               &rule->gc_allowed : &rule->gc_matching);
+	/* No-op while already pending, so this does not re-arm anything. */
+	schedule_delayed_work(&rule->gc_work,
+	                      msecs_to_jiffies(gc_expir_time));
 }
 
 /**
@@ -339,35 +467,55 @@ has_logged_during_this_minute(const struct peer *peer)
 }
 
 /**
- * Garbage collector. It removes the old entries after tis timers have expired.
+ * Garbage collector. It removes the old entries after their timers have
+ * expired. Since both gc lists are ordered by expiry, it stops at the first
+ * live peer, and it handles at most PEER_GC_BATCH peers per run so that the
+ * lock is never held for long, no matter how many peers the rule has.
  *
- * @r: rule
+ * @work
  */
-static void peer_gc(struct timer_list *tl)
+static void peer_gc(struct work_struct *work)
 {
-	unsigned int i;
-	struct xt_pknock_rule *rule = from_timer(rule, tl, timer);
-	struct peer *peer;
-	struct list_head *pos, *n;
+	struct xt_pknock_rule *rule = container_of(to_delayed_work(work),
+	                              struct xt_pknock_rule, gc_work);
+	unsigned int budget = PEER_GC_BATCH;
+	struct peer *peer, *n;
+	bool pending;
 
 	pr_debug("(S) running %s\n", __func__);
-	hashtable_for_each_safe(pos, n, rule->peer_head, peer_hashsize, i) {
-		peer = list_entry(pos, struct peer, head);
-
-		/*
-		 * Remove any peer whose (inter-knock) max_time
-		 * or autoclose_time passed.
-		 */
-		if ((peer->status != ST_ALLOWED &&
-		    is_interknock_time_exceeded(peer, rule->max_time)) ||
-		    (peer->status == ST_ALLOWED &&
-		    autoclose_time_passed(peer, rule->autoclose_time)))
-		{
-			pk_debug("GC-DELETED", peer);
-			list_del(pos);
-			kfree(peer);
-		}
+	spin_lock_bh(&list_lock);
+	/* Remove any peer whose (inter-knock) max_time passed. */
+	list_for_each_entry_safe(peer, n, &rule->gc_matching, gc_list) {
+		if (budget == 0 ||
+		    !is_interknock_time_exceeded(peer, rule->max_time))
+			break;
+		pk_debug("GC-DELETED", peer);
+		list_del(&peer->head);
+		list_del(&peer->gc_list);
+		kfree(peer);
+		--budget;
+	}
+	/* Remove any peer whose autoclose_time passed. */
+	list_for_each_entry_safe(peer, n, &rule->gc_allowed, gc_list) {
+		if (budget == 0 ||
+		    !autoclose_time_passed(peer, rule->autoclose_time))
+			break;
+		pk_debug("GC-DELETED", peer);
+		list_del(&peer->head);
+		list_del(&peer->gc_list);
+		kfree(peer);
+		--budget;
 	}
+	pending = !list_empty(&rule->gc_matching) ||
+	          (rule->autoclose_time != 0 && !list_empty(&rule->gc_allowed));
+	spin_unlock_bh(&list_lock);
+
+	if (budget == 0)
+		/* More may be due; continue after letting others run. */
+		schedule_delayed_work(&rule->gc_work, 1);
+	else if (pending)
+		schedule_delayed_work(&rule->gc_work,
+		                      msecs_to_jiffies(gc_expir_time));
 }
 
 /**
@@ -424,9 +572,13 @@ add_rule(struct xt_pknock_mtinfo *info)
 			continue;
 		++rule->ref_count;
 
+		if (info->option & XT_PKNOCK_KNOCKPORT)
+			rule->ports_count = info->ports_count;
 		if (info->option & XT_PKNOCK_OPENSECRET) {
 			rule->max_time       = info->max_time;
 			rule->autoclose_time = info->autoclose_time;
+			/* Secrets may differ now; drop cached digests. */
+			++rule->hmac_gen;
 		}
 		if (info->option & XT_PKNOCK_CHECKIP)
 			pr_debug("add_rule() (AC) rule found: %s - "
@@ -445,14 +597,31 @@ add_rule(struct xt_pknock_mtinfo *info)
 	rule->ref_count      = 1;
 	rule->max_time       = info->max_time;
 	rule->autoclose_time = info->autoclose_time;
+	if (info->option & XT_PKNOCK_KNOCKPORT)
+		rule->ports_count = info->ports_count;
 	rule->peer_head      = alloc_hashtable(peer_hashsize);
 	if (rule->peer_head == NULL)
 		goto out;
-	timer_setup(&rule->timer, peer_gc, 0);
+	INIT_DELAYED_WORK(&rule->gc_work, peer_gc);
+	INIT_LIST_HEAD(&rule->gc_matching);
+	INIT_LIST_HEAD(&rule->gc_allowed);
 	rule->status_proc = proc_create_data(info->rule_name, 0, pde,
 	                    &pknock_proc_ops, rule);
 	if (rule->status_proc == NULL)
 		goto out;
+	rule->state_proc = proc_create_data(info->rule_name, S_IRUSR | S_IWUSR,
+	                   pde_state, &pknock_state_proc_ops, rule);
+	if (rule->state_proc == NULL) {
+		remove_proc_entry(info->rule_name, pde);
+		goto out;
+	}
+	rule->stats_proc = proc_create_data(info->rule_name, 0, pde_stats,
+	                   &pknock_stats_proc_ops, rule);
+	if (rule->stats_proc == NULL) {
+		remove_proc_entry(info->rule_name, pde_state);
+		remove_proc_entry(info->rule_name, pde);
+		goto out;
+	}
 
 	list_add(&rule->head, &rule_hashtable[hash]);
 	pr_debug("(A) rule_name: %s - created.\n", rule->rule_name);
@@ -497,6 +666,14 @@ remove_rule(struct xt_pknock_mtinfo *info)
 	if (rule == NULL || rule->ref_count != 0)
 		return;
 
+	/* No more imports once the state file is gone. */
+	if (rule->state_proc != NULL)
+		remove_proc_entry(info->rule_name, pde_state);
+	if (rule->status_proc != NULL)
+		remove_proc_entry(info->rule_name, pde);
+	if (rule->stats_proc != NULL)
+		remove_proc_entry(info->rule_name, pde_stats);
+	cancel_delayed_work_sync(&rule->gc_work);
 	hashtable_for_each_safe(pos, n, rule->peer_head, peer_hashsize, i) {
 		peer = list_entry(pos, struct peer, head);
 		pk_debug("DELETED", peer);
@@ -504,11 +681,7 @@ remove_rule(struct xt_pknock_mtinfo *info)
 		kfree(peer);
 	}
 
-	if (rule->status_proc != NULL)
-		remove_proc_entry(info->rule_name, pde);
 	pr_debug("(D) rule deleted: %s.\n", rule->rule_name);
-	if (timer_pending(&rule->timer))
-		del_timer(&rule->timer);
 	list_del(&rule->head);
 	kfree(rule->peer_head);
 	kfree(rule);
@@ -557,11 +730,12 @@ static void reset_knock_status(struct peer *peer)
  */
 static struct peer *new_peer(__be32 ip, uint8_t proto)
 {
-	struct peer *peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
+	struct peer *peer = kzalloc(sizeof(*peer), GFP_ATOMIC);
 
 	if (peer == NULL)
 		return NULL;
 	INIT_LIST_HEAD(&peer->head);
+	INIT_LIST_HEAD(&peer->gc_list);
 	peer->ip	= ip;
 	peer->proto	= proto;
 	peer->timestamp = jiffies/HZ;
@@ -578,9 +752,14 @@ static struct peer *new_peer(__be32 ip, uint8_t proto)
  */
 static void add_peer(struct peer *peer, struct xt_pknock_rule *rule)
 {
-	unsigned int hash = pknock_hash(&peer->ip, sizeof(peer->ip),
-                                ipt_pknock_hash_rnd, peer_hashsize);
+	unsigned int hash;
+
+	if (peer == NULL)
+		return;
+	hash = pknock_hash(&peer->ip, sizeof(peer->ip),
+	                   ipt_pknock_hash_rnd, peer_hashsize);
 	list_add(&peer->head, &rule->peer_head[hash]);
+	peer_gc_queue(rule, peer);
 }
 
 /**
@@ -593,9 +772,148 @@ static void remove_peer(struct peer *peer)
 	if (peer == NULL)
 		return;
 	list_del(&peer->head);
+	list_del(&peer->gc_list);
 	kfree(peer);
 }
 
+/**
+ * Takes over an exported peer state into @peer. Expired entries are refused.
+ *
+ * @rule
+ * @peer
+ * @st
+ * @return: 1 success, 0 failure
+ */
+static bool
+import_peer(const struct xt_pknock_rule *rule, struct peer *peer,
+    const struct xt_pknock_peer_state *st)
+{
+	if (st->accepted_knock_count >= XT_PKNOCK_MAX_PORTS)
+		return false;
+	switch (st->status) {
+	case ST_INIT:
+	case ST_MATCHING:
+		/* the next knock is checked against port[count] */
+		if (st->accepted_knock_count >= rule->ports_count)
+			return false;
+		break;
+	case ST_ALLOWED:
+		break;
+	default:
+		return false;
+	}
+
+	peer->ip        = st->peer_ip;
+	peer->proto     = st->proto;
+	peer->status    = st->status;
+	peer->accepted_knock_count = st->accepted_knock_count;
+	peer->timestamp = jiffies / HZ - st->age;
+	peer->login_sec = st->login_sec;
+
+	if (peer->status == ST_ALLOWED)
+		return !autoclose_time_passed(peer, rule->autoclose_time);
+	return !is_interknock_time_exceeded(peer, rule->max_time);
+}
+
+/**
+ * Imports binary struct xt_pknock_peer_state records, replacing the state of
+ * peers that already exist. Only whole records are consumed. Imported peers
+ * are queued at the tail of the gc lists, so they may be collected somewhat
+ * late if they are older than the peers already present.
+ */
+static ssize_t
+pknock_state_write(struct file *file, const char __user *input,
+    size_t size, loff_t *loff)
+{
+	struct xt_pknock_rule *rule = PDE_DATA(file_inode(file));
+	struct xt_pknock_peer_state *buf;
+	struct peer *prealloc[PEER_IMPORT_BATCH];
+	struct peer *peer, *old;
+	size_t done = 0;
+	unsigned int i, count;
+	ssize_t ret = 0;
+
+	if (size < sizeof(*buf))
+		return -EINVAL;
+	buf = kmalloc(sizeof(*buf) * PEER_IMPORT_BATCH, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	while (size - done >= sizeof(*buf)) {
+		count = min_t(size_t, (size - done) / sizeof(*buf),
+		        PEER_IMPORT_BATCH);
+		if (copy_from_user(buf, input + done, count * sizeof(*buf))) {
+			ret = -EFAULT;
+			break;
+		}
+		for (i = 0; i < count; ++i) {
+			prealloc[i] = kzalloc(sizeof(*peer), GFP_KERNEL);
+			if (prealloc[i] == NULL)
+				break;
+			INIT_LIST_HEAD(&prealloc[i]->head);
+			INIT_LIST_HEAD(&prealloc[i]->gc_list);
+		}
+		if (i < count) {
+			while (i > 0)
+				kfree(prealloc[--i]);
+			ret = -ENOMEM;
+			break;
+		}
+
+		spin_lock_bh(&list_lock);
+		for (i = 0; i < count; ++i) {
+			peer = prealloc[i];
+			if (!import_peer(rule, peer, &buf[i]))
+				continue;
+			old = get_peer(rule, peer->ip);
+			if (old != NULL) {
+				old->proto     = peer->proto;
+				old->status    = peer->status;
+				old->accepted_knock_count =
+					peer->accepted_knock_count;
+				old->timestamp = peer->timestamp;
+				old->login_sec = peer->login_sec;
+				memset(old->hmac, 0, sizeof(old->hmac));
+				peer_gc_queue(rule, old);
+			} else {
+				add_peer(peer, rule);
+				prealloc[i] = NULL;
+			}
+		}
+		spin_unlock_bh(&list_lock);
+
+		for (i = 0; i < count; ++i)
+			kfree(prealloc[i]);
+		done += count * sizeof(*buf);
+	}
+
+	kfree(buf);
+	return done > 0 ? done : ret;
+}
+
+/**
+ * @inode
+ * @file
+ */
+static int
+pknock_state_proc_open(struct inode *inode, struct file *file)
+{
+	int ret = seq_open(file, &pknock_state_seq_ops);
+	if (ret == 0) {
+		struct seq_file *sf = file->private_data;
+		sf->private = PDE_DATA(inode);
+	}
+	return ret;
+}
+
+static const struct proc_ops pknock_state_proc_ops = {
+	.proc_open    = pknock_state_proc_open,
+	.proc_read    = seq_read,
+	.proc_write   = pknock_state_write,
+	.proc_lseek   = seq_lseek,
+	.proc_release = seq_release,
+};
+
 /**
  * @peer
  * @info
@@ -643,8 +961,61 @@ is_allowed(const struct peer *peer)
 	return peer != NULL && peer->status == ST_ALLOWED;
 }
 
+#if IS_ENABLED(CONFIG_CONNECTOR)
 /**
- * Sends a message to user space through netlink sockets.
+ * Sends all batched messages, one netlink message per CPU buffer.
+ *
+ * @work
+ */
+static void pknock_nl_flush(struct work_struct *work)
+{
+	struct pknock_nl_batch *b;
+	unsigned int cpu, count;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(nl_batch, cpu);
+		spin_lock_bh(&b->lock);
+		count = b->count;
+		memcpy(nl_batch_msg->data, b->msg, count * sizeof(*b->msg));
+		b->count = 0;
+		spin_unlock_bh(&b->lock);
+		if (count == 0)
+			continue;
+		nl_batch_msg->len = count * sizeof(*b->msg);
+		cn_netlink_send(nl_batch_msg, 0, nl_multicast_group, GFP_KERNEL);
+	}
+}
+
+/**
+ * Queues a message in this CPU's batch buffer.
+ *
+ * @msg
+ * @return: 1 queued, 0 buffer full
+ */
+static bool pknock_nl_queue(const struct xt_pknock_nl_msg *msg)
+{
+	struct pknock_nl_batch *b;
+	bool ret = false;
+
+	local_bh_disable();
+	b = this_cpu_ptr(nl_batch);
+	spin_lock(&b->lock);
+	if (b->count < ARRAY_SIZE(b->msg)) {
+		b->msg[b->count++] = *msg;
+		ret = true;
+	}
+	spin_unlock(&b->lock);
+	local_bh_enable();
+	if (ret)
+		schedule_delayed_work(&nl_flush_work,
+		                      msecs_to_jiffies(nl_batch_ms));
+	return ret;
+}
+#endif
+
+/**
+ * Sends a message to user space through netlink sockets. In batch mode, the
+ * message is only queued, unless this CPU's buffer is full.
  *
  * @info
  * @peer
@@ -658,13 +1029,16 @@ msg_to_userspace_nl(const struct xt_pknock_mtinfo *info,
 	struct cn_msg *m;
 	struct xt_pknock_nl_msg msg;
 
+	memset(&msg, 0, sizeof(msg));
+	msg.peer_ip = peer->ip;
+	scnprintf(msg.rule_name, info->rule_name_len + 1, "%s", info->rule_name);
+	if (nl_batch != NULL && pknock_nl_queue(&msg))
+		return true;
+
 	m = kzalloc(sizeof(*m) + sizeof(msg), GFP_ATOMIC);
 	if (m == NULL)
 		return false;
 	m->len = sizeof(msg);
-
-	msg.peer_ip = peer->ip;
-	scnprintf(msg.rule_name, info->rule_name_len + 1, info->rule_name);
 	memcpy(m + 1, &msg, m->len);
 	cn_netlink_send(m, 0, multicast_group, GFP_ATOMIC);
 	kfree(m);
@@ -673,87 +1047,100 @@ msg_to_userspace_nl(const struct xt_pknock_mtinfo *info,
 }
 
 /**
- * Transforms a sequence of characters to hexadecimal.
+ * Computes hmac(secret, ipsrc+epoch_min) into @h.
  *
- * @out: the hexadecimal result
- * @crypt: the original sequence
- * @size
+ * @h
+ * @secret
+ * @secret_len
+ * @ipsrc
+ * @epoch_min
+ * @return: 1 success, 0 failure
  */
-static void
-crypt_to_hex(char *out, const char *crypt, unsigned int size)
+static bool
+peer_hmac_compute(struct peer_hmac *h, const unsigned char *secret,
+    unsigned int secret_len, uint32_t ipsrc, unsigned int epoch_min)
 {
-	unsigned int i;
-	for (i = 0; i < size; ++i) {
-		unsigned char c = crypt[i];
-		*out++ = '0' + ((c&0xf0)>>4) + (c>=0xa0)*('a'-'9'-1);
-		*out++ = '0' + (c&0x0f) + ((c&0x0f)>=0x0a)*('a'-'9'-1);
+	int ret;
+
+	ret = crypto_shash_setkey(crypto.tfm, secret, secret_len);
+	if (ret != 0) {
+		printk("crypto_hash_setkey() failed ret=%d\n", ret);
+		return false;
+	}
+
+	/*
+	 * 4 bytes IP (32 bits) +
+	 * 4 bytes int epoch_min (32 bits)
+	 */
+	if ((ret = crypto_shash_init(&crypto.desc)) != 0 ||
+	    (ret = crypto_shash_update(&crypto.desc, (const void *)&ipsrc, sizeof(ipsrc))) != 0 ||
+	    (ret = crypto_shash_update(&crypto.desc, (const void *)&epoch_min, sizeof(epoch_min))) != 0 ||
+	    (ret = crypto_shash_final(&crypto.desc, h->digest)) != 0) {
+		printk("crypto_shash_update/final() failed ret=%d\n", ret);
+		return false;
 	}
+	h->epoch_min = epoch_min;
+	return true;
 }
 
 /**
  * Checks that the payload has the hmac(secret+ipsrc+epoch_min).
  *
- * @secret
- * @secret_len
- * @ipsrc
+ * The expected digest is cached in the peer, so that repeated (or spoofed)
+ * knocks within the same minute cost a hex decode and a single constant-time
+ * comparison instead of a full HMAC computation.
+ *
+ * @rule
+ * @peer
+ * @info
+ * @which: HMAC_OPEN or HMAC_CLOSE
  * @payload
  * @payload_len
  * @return: 1 success, 0 failure
  */
 static bool
-has_secret(const unsigned char *secret, unsigned int secret_len, uint32_t ipsrc,
+has_secret(const struct xt_pknock_rule *rule, struct peer *peer,
+    const struct xt_pknock_mtinfo *info, unsigned int which,
     const unsigned char *payload, unsigned int payload_len)
 {
-	char result[64] = ""; // 64 bytes * 8 = 512 bits
-	char *hexresult;
-	unsigned int hexa_size;
-	int ret;
-	bool fret = false;
+	struct peer_hmac *h = &peer->hmac[which];
+	uint8_t knock[PKNOCK_HMAC_SIZE];
 	unsigned int epoch_min;
 
-	if (payload_len == 0)
-		return false;
-
 	/*
 	 * hexa:  4bits
 	 * ascii: 8bits
 	 * hexa = ascii * 2
+	 *
+	 * + 1 cause we MUST add NULL in the payload
 	 */
-	hexa_size = crypto.size * 2;
-
-	/* + 1 cause we MUST add NULL in the payload */
-	if (payload_len != hexa_size + 1)
+	if (payload_len != crypto.size * 2 + 1)
 		return false;
-	hexresult = kzalloc(hexa_size, GFP_ATOMIC);
-	if (hexresult == NULL)
+	if (hex2bin(knock, (const char *)payload, crypto.size) != 0)
 		return false;
-	epoch_min = get_seconds() / 60;
 
-	ret = crypto_shash_setkey(crypto.tfm, secret, secret_len);
-	if (ret != 0) {
-		printk("crypto_hash_setkey() failed ret=%d\n", ret);
-		goto out;
+	epoch_min = get_seconds() / 60;
+	if (h->info != info || h->gen != rule->hmac_gen ||
+	    h->epoch_min != epoch_min) {
+		h->info = NULL;
+		if (which == HMAC_OPEN) {
+			if (!peer_hmac_compute(h, info->open_secret,
+			    info->open_secret_len, peer->ip, epoch_min))
+				return false;
+		} else {
+			if (!peer_hmac_compute(h, info->close_secret,
+			    info->close_secret_len, peer->ip, epoch_min))
+				return false;
+		}
+		h->info = info;
+		h->gen  = rule->hmac_gen;
 	}
 
-	/*
-	 * The third parameter is the number of bytes INSIDE the sg!
-	 * 4 bytes IP (32 bits) +
-	 * 4 bytes int epoch_min (32 bits)
-	 */
-	if ((ret = crypto_shash_update(&crypto.desc, (const void *)&ipsrc, sizeof(ipsrc))) != 0 ||
-	    (ret = crypto_shash_update(&crypto.desc, (const void *)&epoch_min, sizeof(epoch_min))) != 0 ||
-	    (ret = crypto_shash_final(&crypto.desc, result)) != 0) {
-		printk("crypto_shash_update/final() failed ret=%d\n", ret);
-		goto out;
-	}
-	crypt_to_hex(hexresult, result, crypto.size);
-	if (memcmp(hexresult, payload, hexa_size) != 0)
+	if (crypto_memneq(h->digest, knock, crypto.size)) {
 		pr_debug("secret match failed\n");
-	else
-		fret = true;
- out:
-	kfree(hexresult);
-	return fret;
+		return false;
+	}
+	return true;
 }
 
 /**
@@ -766,8 +1153,9 @@ has_secret(const unsigned char *secret, unsigned int secret_len, uint32_t ipsrc,
  * @return: 1 if pass security, 0 otherwise
  */
 static bool
-pass_security(struct peer *peer, const struct xt_pknock_mtinfo *info,
-        const unsigned char *payload, unsigned int payload_len)
+pass_security(struct xt_pknock_rule *rule, struct peer *peer,
+    const struct xt_pknock_mtinfo *info,
+    const unsigned char *payload, unsigned int payload_len)
 {
 	if (is_allowed(peer))
 		return true;
@@ -778,10 +1166,9 @@ pass_security(struct peer *peer, const struct xt_pknock_mtinfo *info,
 		return false;
 	}
 	/* Check for OPEN secret */
-	if (has_secret(info->open_secret,
-					info->open_secret_len, peer->ip,
-					payload, payload_len))
+	if (has_secret(rule, peer, info, HMAC_OPEN, payload, payload_len))
 		return true;
+	++rule->hmac_rejected;
 	return false;
 }
 
@@ -815,18 +1202,18 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 	if (info->option & XT_PKNOCK_OPENSECRET ) {
 		if (hdr->proto != IPPROTO_UDP && hdr->proto != IPPROTO_UDPLITE)
 			return false;
-		if (!pass_security(peer, info, hdr->payload, hdr->payload_len))
+		if (!pass_security(rule, peer, info, hdr->payload,
+		    hdr->payload_len))
 			return false;
 	}
 
-	/* Update the gc timer when there is a state change. */
-	update_rule_gc_timer(rule);
 	++peer->accepted_knock_count;
 
 	if (is_last_knock(peer, info)) {
 		peer->status = ST_ALLOWED;
 		pk_debug("ALLOWED", peer);
 		peer->login_sec = get_seconds();
+		peer_gc_queue(rule, peer);
 		if (nl_multicast_group > 0)
 			msg_to_userspace_nl(info, peer, nl_multicast_group);
 		return true;
@@ -846,6 +1233,7 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 			return false;
 		}
 		peer->timestamp = time;
+		peer_gc_queue(rule, peer);
 	}
 	pk_debug("MATCHING", peer);
 	peer->status = ST_MATCHING;
@@ -856,6 +1244,7 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
  * Make the peer no more ALLOWED sending a payload with a special secret for
  * closure.
  *
+ * @rule
  * @peer
  * @info
  * @payload
@@ -863,13 +1252,12 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
  * @return: 1 if close knock, 0 otherwise
  */
 static bool
-is_close_knock(const struct peer *peer, const struct xt_pknock_mtinfo *info,
+is_close_knock(const struct xt_pknock_rule *rule, struct peer *peer,
+		const struct xt_pknock_mtinfo *info,
 		const unsigned char *payload, unsigned int payload_len)
 {
 	/* Check for CLOSE secret. */
-	if (has_secret(info->close_secret,
-				info->close_secret_len, peer->ip,
-				payload, payload_len))
+	if (has_secret(rule, peer, info, HMAC_CLOSE, payload, payload_len))
 	{
 		pk_debug("BLOCKED", peer);
 		return true;
@@ -943,9 +1331,12 @@ static bool pknock_mt(const struct sk_buff *skb,
 			    (iph->protocol == IPPROTO_UDP ||
 			    iph->protocol == IPPROTO_UDPLITE))
 			{
-				if (is_close_knock(peer, info, hdr.payload, hdr.payload_len))
+				if (is_close_knock(rule, peer, info, hdr.payload,
+				    hdr.payload_len))
 				{
 					reset_knock_status(peer);
+					peer->timestamp = jiffies / HZ;
+					peer_gc_queue(rule, peer);
 					ret = false;
 				}
 			}
@@ -1051,8 +1442,45 @@ static struct xt_match xt_pknock_mt_reg __read_mostly = {
 	.me			= THIS_MODULE
 };
 
+#if IS_ENABLED(CONFIG_CONNECTOR)
+static int pknock_nl_batch_init(void)
+{
+	unsigned int cpu;
+
+	if (nl_batch_ms == 0 || nl_multicast_group <= 0)
+		return 0;
+	nl_batch_msg = kzalloc(sizeof(*nl_batch_msg) + XT_PKNOCK_NL_BATCH_MAX *
+	               sizeof(struct xt_pknock_nl_msg), GFP_KERNEL);
+	if (nl_batch_msg == NULL)
+		return -ENOMEM;
+	nl_batch = alloc_percpu(struct pknock_nl_batch);
+	if (nl_batch == NULL) {
+		kfree(nl_batch_msg);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(nl_batch, cpu)->lock);
+	return 0;
+}
+
+static void pknock_nl_batch_exit(void)
+{
+	if (nl_batch == NULL)
+		return;
+	cancel_delayed_work_sync(&nl_flush_work);
+	pknock_nl_flush(NULL);
+	free_percpu(nl_batch);
+	kfree(nl_batch_msg);
+}
+#else
+static inline int pknock_nl_batch_init(void) { return 0; }
+static inline void pknock_nl_batch_exit(void) {}
+#endif
+
 static int __init xt_pknock_mt_init(void)
 {
+	int ret;
+
 #if !IS_ENABLED(CONFIG_CONNECTOR)
 	if (nl_multicast_group != -1)
 		pr_info("CONFIG_CONNECTOR not present; "
@@ -1076,19 +1504,60 @@ static int __init xt_pknock_mt_init(void)
 
 	crypto.size = crypto_shash_digestsize(crypto.tfm);
 	crypto.desc.tfm = crypto.tfm;
+	if (crypto.size > PKNOCK_HMAC_SIZE) {
+		pr_err("digest size of %s exceeds %u bytes\n",
+		       crypto.algo, PKNOCK_HMAC_SIZE);
+		crypto_free_shash(crypto.tfm);
+		return -EINVAL;
+	}
+
+	ret = pknock_nl_batch_init();
+	if (ret < 0)
+		goto out_crypto;
 
 	pde = proc_mkdir("xt_pknock", init_net.proc_net);
 	if (pde == NULL) {
 		pr_err("proc_mkdir() error in _init().\n");
-		return -ENXIO;
+		ret = -ENXIO;
+		goto out_batch;
 	}
-	return xt_register_match(&xt_pknock_mt_reg);
+	pde_state = proc_mkdir("xt_pknock_state", init_net.proc_net);
+	if (pde_state == NULL) {
+		pr_err("proc_mkdir() error in _init().\n");
+		ret = -ENXIO;
+		goto out_proc;
+	}
+	pde_stats = proc_mkdir("xt_pknock_stats", init_net.proc_net);
+	if (pde_stats == NULL) {
+		pr_err("proc_mkdir() error in _init().\n");
+		ret = -ENXIO;
+		goto out_proc_state;
+	}
+	ret = xt_register_match(&xt_pknock_mt_reg);
+	if (ret < 0)
+		goto out_proc_stats;
+	return 0;
+
+ out_proc_stats:
+	remove_proc_entry("xt_pknock_stats", init_net.proc_net);
+ out_proc_state:
+	remove_proc_entry("xt_pknock_state", init_net.proc_net);
+ out_proc:
+	remove_proc_entry("xt_pknock", init_net.proc_net);
+ out_batch:
+	pknock_nl_batch_exit();
+ out_crypto:
+	crypto_free_shash(crypto.tfm);
+	return ret;
 }
 
 static void __exit xt_pknock_mt_exit(void)
 {
+	remove_proc_entry("xt_pknock_stats", init_net.proc_net);
+	remove_proc_entry("xt_pknock_state", init_net.proc_net);
 	remove_proc_entry("xt_pknock", init_net.proc_net);
 	xt_unregister_match(&xt_pknock_mt_reg);
+	pknock_nl_batch_exit();
 	kfree(rule_hashtable);
 	if (crypto.tfm != NULL)
 		crypto_free_shash(crypto.tfm);
@@ -27,6 +27,9 @@ enum {
 	XT_PKNOCK_MAX_PORTS      = 15,
 	XT_PKNOCK_MAX_BUF_LEN    = 31,
 	XT_PKNOCK_MAX_PASSWD_LEN = 31,
+
+	/* Max. number of xt_pknock_nl_msg in one batched netlink message */
+	XT_PKNOCK_NL_BATCH_MAX   = 64,
 };
 
 struct xt_pknock_mtinfo {
@@ -43,6 +46,31 @@ struct xt_pknock_mtinfo {
 	uint32_t autoclose_time;
 };
 
+/* Peer status values in struct xt_pknock_peer_state */
+enum {
+	XT_PKNOCK_PEER_INIT = 1,
+	XT_PKNOCK_PEER_MATCHING,
+	XT_PKNOCK_PEER_ALLOWED,
+};
+
+/*
+ * Record format of /proc/net/xt_pknock_state/<rule>, which is read to
+ * export and written to import the peers of a rule. Host byte order,
+ * except for the address.
+ *
+ * @age:	seconds since the last accepted knock
+ * @login_sec:	time of the successful knock, in seconds since the epoch
+ */
+struct xt_pknock_peer_state {
+	__be32 peer_ip;
+	uint32_t accepted_knock_count;
+	uint32_t age;
+	uint8_t status;
+	uint8_t proto;
+	uint16_t __pad;
+	uint64_t login_sec;
+};
+
 struct xt_pknock_nl_msg {
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	__be32 peer_ip;
@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Measures how many replies per second TARPIT sends. A generator namespace
+# floods a target namespace over a veth pair with TCP ACK segments carrying
+# a payload of the given size; the target answers them with -j TARPIT and
+# the replies are counted on the generator side.
+#
+# To compare two builds of xt_TARPIT, e.g. the skb_copy_expand based one
+# against header-only replies, load one, run this, unload it, load the
+# other and run again with the same options:
+#
+#	insmod ./xt_TARPIT.ko && ./tarpit_bench.sh -s 1400; rmmod xt_TARPIT
+#
+# veth delivers into the target on the sending CPU, so with -c 1 the
+# figure is what one CPU manages for generating, receiving and replying.
+#
+# Needs root, ip(8), iptables(8) with libxt_TARPIT, and trafgen(8) from
+# netsniff-ng.
+#
+# No figures have been taken with it yet; the comparison between the
+# skb_copy_expand and the header-only reply is still to be done.
+
+size=1400
+secs=10
+cpus=1
+while getopts "c:s:t:" opt; do
+	case "$opt" in
+	c) cpus="$OPTARG";;
+	s) size="$OPTARG";;
+	t) secs="$OPTARG";;
+	*) echo "usage: $0 [-c cpus] [-s payload-size] [-t seconds]"; exit 1;;
+	esac
+done
+
+gen=tb-gen
+tgt=tb-tgt
+conf=$(mktemp)
+
+cleanup()
+{
+	ip netns del "$gen" 2>/dev/null
+	ip netns del "$tgt" 2>/dev/null
+	rm -f "$conf"
+}
+trap cleanup EXIT
+
+set -e
+ip netns add "$gen"
+ip netns add "$tgt"
+ip -n "$gen" link add tb0 type veth peer name tb1 netns "$tgt"
+ip -n "$gen" addr add 10.99.0.1/24 dev tb0
+ip -n "$tgt" addr add 10.99.0.2/24 dev tb1
+ip -n "$gen" link set tb0 up
+ip -n "$tgt" link set tb1 up
+ip netns exec "$tgt" iptables -A INPUT -p tcp --dport 80 -j TARPIT
+# keep the generator from answering the replies
+ip netns exec "$gen" iptables -t raw -A PREROUTING -i tb0 -j DROP
+# resolve the generator's address before the flood starts
+ip netns exec "$tgt" ping -c 1 -q 10.99.0.1 >/dev/null
+
+smac=$(ip netns exec "$gen" cat /sys/class/net/tb0/address)
+dmac=$(ip netns exec "$tgt" cat /sys/class/net/tb1/address)
+cat >"$conf" <<EOF
+{
+	eth(da=$dmac, sa=$smac),
+	ipv4(sa=10.99.0.1, da=10.99.0.2, ttl=64),
+	tcp(sp=40000, dp=80, seq=1, aseq=1, ack),
+	fill(0x41, $size),
+}
+EOF
+
+counter()
+{
+	ip netns exec "$1" cat "/sys/class/net/$2/statistics/rx_packets"
+}
+
+req=$(counter "$tgt" tb1)
+rep=$(counter "$gen" tb0)
+ip netns exec "$gen" timeout -s INT "$secs" \
+	trafgen -o tb0 -i "$conf" -P "$cpus" >/dev/null 2>&1 || :
+req=$(( $(counter "$tgt" tb1) - req ))
+rep=$(( $(counter "$gen" tb0) - rep ))
+
+echo "payload $size bytes, $cpus CPU(s), $secs s:" \
+	"$(( req / secs )) requests/s, $(( rep / secs )) replies/s"
@@ -1,5 +1,5 @@
-/* DNETMAP - dynamic two-way 1:1 NAT mapping of IPv4 network addresses.
- * The mapping can be applied to source (POSTROUTING|OUTPUT)
+/* DNETMAP - dynamic two-way 1:1 NAT mapping of IPv4 and IPv6 network
+ * addresses. The mapping can be applied to source (POSTROUTING|OUTPUT)
  * or destination (PREROUTING),
  */
 
@@ -19,17 +19,27 @@
  */
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#include <linux/connector.h>
 #include <linux/inet.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/netdevice.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/rhashtable.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/uidgid.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 #include <net/netfilter/nf_nat.h>
@@ -39,50 +49,120 @@
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Marek Kierdelewicz <marek@piasta.pl>");
 MODULE_DESCRIPTION(
-	"Xtables: dynamic two-way 1:1 NAT mapping of IPv4 addresses");
+	"Xtables: dynamic two-way 1:1 NAT mapping of IPv4 and IPv6 addresses");
 MODULE_ALIAS("ipt_DNETMAP");
+MODULE_ALIAS("ip6t_DNETMAP");
 
 static unsigned int default_ttl = 600;
 static unsigned int proc_perms = S_IRUGO | S_IWUSR;
 static unsigned int proc_uid;
 static unsigned int proc_gid;
-static unsigned int default_hash_size = 256;
 static unsigned int hash_size = 256;
 static unsigned int disable_log;
 static unsigned int whole_prefix = 1;
+static unsigned int ipv6_max_bindings = 65536;
+static int nl_multicast_group = -1;
+static unsigned int nl_batch_ms = 100;
 module_param(default_ttl, uint, S_IRUSR);
 MODULE_PARM_DESC(default_ttl,
 		 " default ttl value to be used if rule doesn't specify any (default: 600)");
 module_param(hash_size, uint, S_IRUSR);
 MODULE_PARM_DESC(hash_size,
-		 " hash size for ip lists, needs to be power of 2 (default: 256)");
+		 " initial number of bindings the per-netns tables are sized for, they grow and shrink automatically (default: 256)");
 module_param(disable_log, uint, S_IRUSR);
 MODULE_PARM_DESC(disable_log,
 		 " disables logging of bind/timeout events (default: 0)");
 module_param(whole_prefix, uint, S_IRUSR);
 MODULE_PARM_DESC(whole_prefix,
 		 " use network and broadcast addresses of specified prefix for bindings (default: 1)");
+module_param(ipv6_max_bindings, uint, S_IRUSR);
+MODULE_PARM_DESC(ipv6_max_bindings,
+		 " maximum number of bindings per IPv6 prefix (default: 65536)");
+module_param(nl_multicast_group, int, S_IRUSR);
+MODULE_PARM_DESC(nl_multicast_group,
+		 " netlink (connector) multicast group for bind/unbind events (default: -1, disabled)");
+module_param(nl_batch_ms, uint, S_IRUSR);
+MODULE_PARM_DESC(nl_batch_ms,
+		 " send bind/unbind events at least every N msecs, batched per CPU (default: 100, 0 sends each at once)");
 
 static unsigned int jtimeout;
+static u32 dnetmap_seed __read_mostly;
+static struct kmem_cache *dnetmap_cachep __read_mostly;
 
+#if IS_ENABLED(CONFIG_CONNECTOR)
+/*
+ * Per-CPU buffer of pending events. @msg carries up to
+ * XT_DNETMAP_NL_BATCH_MAX struct xt_DNETMAP_event records.
+ */
+struct dnetmap_nl_batch {
+	spinlock_t lock;
+	unsigned int count;
+	struct cn_msg *msg;
+};
+
+static struct dnetmap_nl_batch __percpu *dnetmap_nl_batch;
+static void dnetmap_nl_flush(struct work_struct *);
+static DECLARE_DELAYED_WORK(dnetmap_nl_flush_work, dnetmap_nl_flush);
+#endif
+
+/*
+ * Bindings are refreshed only when their expiry moves by at least this much,
+ * which keeps the prefix lock and LRU list_move_tail out of the common path.
+ * A binding closer than this to its expiry is handled under the lock.
+ */
+#define DNETMAP_STAMP_GRAN HZ
+
+/* postnat addresses tried for a new IPv6 binding before evicting one */
+#define DNETMAP_IPV6_PROBES 8
+
+/* binding records restored per prefix lock hold */
+#define DNETMAP_IMPORT_BATCH 64
+
+/* entry flags besides the XT_DNETMAP_* ones */
+enum {
+	DNETMAP_RELEASED = 1 << 7,
+};
+
+/*
+ * Locking: the hash tables are searched under RCU. An entry exists for one
+ * binding only: it is allocated and hashed when the binding is made, and
+ * unhashed, marked DNETMAP_RELEASED and freed after an RCU grace period when
+ * the binding goes away. Its addresses and prefix never change; stamp, flags
+ * and lru_list are changed under the prefix's lock, as are the prefix's
+ * lists and address map. At most one prefix lock is held at a time.
+ */
 struct dnetmap_entry {
-	struct list_head list, glist, grlist, lru_list;
-	__be32 prenat_addr, postnat_addr;
+	struct list_head list, lru_list;
+	struct rhash_head node, rnode;
+	union nf_inet_addr prenat_addr, postnat_addr;
 	__u8 flags;
 	unsigned long stamp;
 	struct dnetmap_prefix *prefix;
+	struct rcu_head rcu;
 };
 
 struct dnetmap_prefix {
 	struct nf_nat_range prefix;
-	char prefix_str[20];
+	char prefix_str[INET6_ADDRSTRLEN + 4];
 #ifdef CONFIG_PROC_FS
-	char proc_str_data[20], proc_str_stat[25];
+	char proc_str_data[INET6_ADDRSTRLEN + 4];
+	char proc_str_stat[INET6_ADDRSTRLEN + 9];
+	char proc_str_state[INET6_ADDRSTRLEN + 10];
 #endif
 	struct list_head elist; // element list head
 	struct list_head list;	// prefix list
+	spinlock_t lock;
+	/* set under lock once the prefix is being destroyed */
+	bool dead;
 	__u8 flags;
+	__u8 family;
 	unsigned int refcnt;
+	/* current number of entries and the limit */
+	unsigned int nr_entries, max_entries;
+	/* IPv4: bound addresses, bit 0 being addr_base; next bit to try */
+	unsigned long *addr_map;
+	__u32 addr_base;
+	unsigned int addr_next;
 	/* lru entry list */
 	struct list_head lru_list;
 	/* pointer do dnetmap_net */
@@ -94,8 +174,8 @@ struct dnetmap_net {
 #ifdef CONFIG_PROC_FS
 	struct proc_dir_entry *xt_dnetmap;
 #endif
-	/* global hash */
-	struct list_head *dnetmap_iphash;
+	/* bound entries by prenat and by postnat address, per family */
+	struct rhashtable iphash[2], riphash[2];
 };
 
 static int dnetmap_net_id;
@@ -104,63 +184,284 @@ static inline struct dnetmap_net *dnetmap_pernet(struct net *net)
 	return net_generic(net, dnetmap_net_id);
 }
 
-static DEFINE_SPINLOCK(dnetmap_lock);
 static DEFINE_MUTEX(dnetmap_mutex);
 
 #ifdef CONFIG_PROC_FS
-static const struct proc_ops dnetmap_tg_fops, dnetmap_stat_proc_fops;
+static const struct proc_ops dnetmap_tg_fops, dnetmap_stat_proc_fops,
+	dnetmap_state_proc_fops;
 #endif
 
-static inline unsigned int dnetmap_entry_hash(const __be32 addr)
+static const struct rhashtable_params dnetmap_params = {
+	.head_offset         = offsetof(struct dnetmap_entry, node),
+	.key_offset          = offsetof(struct dnetmap_entry, prenat_addr),
+	.key_len             = sizeof(union nf_inet_addr),
+	.automatic_shrinking = true,
+};
+
+static const struct rhashtable_params dnetmap_rparams = {
+	.head_offset         = offsetof(struct dnetmap_entry, rnode),
+	.key_offset          = offsetof(struct dnetmap_entry, postnat_addr),
+	.key_len             = sizeof(union nf_inet_addr),
+	.automatic_shrinking = true,
+};
+
+/* index into the per-family tables */
+static inline unsigned int dnetmap_fam(__u8 family)
 {
-	return ntohl(addr) & (hash_size - 1);
+	return family == NFPROTO_IPV6;
 }
 
+/*
+ * Called under RCU; a returned entry may be rebound concurrently unless its
+ * prefix lock is held. IPv4 keys have the unused part of the union zeroed.
+ */
 static struct dnetmap_entry *
-dnetmap_entry_lookup(struct dnetmap_net *dnetmap_net, const __be32 addr)
+dnetmap_entry_lookup(struct dnetmap_net *dnetmap_net, __u8 family,
+		     const union nf_inet_addr *addr)
 {
-	struct dnetmap_entry *e;
-	unsigned int h = dnetmap_entry_hash(addr);
-
-	list_for_each_entry(e, &dnetmap_net->dnetmap_iphash[h], glist)
-		if (memcmp(&e->prenat_addr, &addr, sizeof(addr)) == 0)
-			return e;
-	return NULL;
+	return rhashtable_lookup(&dnetmap_net->iphash[dnetmap_fam(family)],
+	       addr, dnetmap_params);
 }
 
 static struct dnetmap_entry *
-dnetmap_entry_rlookup(struct dnetmap_net *dnetmap_net, const __be32 addr)
+dnetmap_entry_rlookup(struct dnetmap_net *dnetmap_net, __u8 family,
+		      const union nf_inet_addr *addr)
 {
-	struct dnetmap_entry *e;
-	unsigned int h = dnetmap_entry_hash(addr);
+	return rhashtable_lookup(&dnetmap_net->riphash[dnetmap_fam(family)],
+	       addr, dnetmap_rparams);
+}
 
-	list_for_each_entry(e, &dnetmap_net->dnetmap_iphash[hash_size + h],
-	    grlist)
-		if (memcmp(&e->postnat_addr, &addr, sizeof(addr)) == 0)
-			return e;
-	return NULL;
+/*
+ * Called with the entry's prefix lock held and e->prenat_addr set. Fails
+ * with -EEXIST if the prenat address is already bound.
+ */
+static int dnetmap_entry_hash_add(struct dnetmap_net *dnetmap_net,
+				  struct dnetmap_entry *e)
+{
+	unsigned int f = dnetmap_fam(e->prefix->family);
+	int ret;
+
+	ret = rhashtable_lookup_insert_fast(&dnetmap_net->iphash[f], &e->node,
+	      dnetmap_params);
+	if (ret != 0)
+		return ret;
+	ret = rhashtable_insert_fast(&dnetmap_net->riphash[f], &e->rnode,
+	      dnetmap_rparams);
+	if (ret != 0)
+		rhashtable_remove_fast(&dnetmap_net->iphash[f], &e->node,
+		                       dnetmap_params);
+	return ret;
 }
 
-static int
-dnetmap_addr_in_prefix(struct dnetmap_net *dnetmap_net, const __be32 addr,
-	struct dnetmap_prefix *p)
+static void dnetmap_entry_unhash(struct dnetmap_net *dnetmap_net,
+				 struct dnetmap_entry *e)
 {
-	struct dnetmap_entry *e;
+	unsigned int f = dnetmap_fam(e->prefix->family);
 
-	list_for_each_entry(e, &p->elist, list)
-		if (memcmp(&e->postnat_addr, &addr, sizeof(addr)) == 0)
-			return 1;
+	rhashtable_remove_fast(&dnetmap_net->iphash[f], &e->node,
+	                       dnetmap_params);
+	rhashtable_remove_fast(&dnetmap_net->riphash[f], &e->rnode,
+	                       dnetmap_rparams);
+}
+
+/* An entry found under RCU may have been released meanwhile. */
+static inline bool dnetmap_entry_bound(const struct dnetmap_entry *e)
+{
+	return !(READ_ONCE(e->flags) & DNETMAP_RELEASED);
+}
+
+static void dnetmap_entry_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(dnetmap_cachep,
+	                container_of(head, struct dnetmap_entry, rcu));
+}
+
+#if IS_ENABLED(CONFIG_CONNECTOR)
+/* Called with b->lock held. */
+static void dnetmap_nl_send(struct dnetmap_nl_batch *b)
+{
+	b->msg->len = b->count * sizeof(struct xt_DNETMAP_event);
+	cn_netlink_send(b->msg, 0, nl_multicast_group, GFP_ATOMIC);
+	b->count = 0;
+}
+
+static void dnetmap_nl_flush(struct work_struct *work)
+{
+	struct dnetmap_nl_batch *b;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(dnetmap_nl_batch, cpu);
+		spin_lock_bh(&b->lock);
+		if (b->count > 0)
+			dnetmap_nl_send(b);
+		spin_unlock_bh(&b->lock);
+	}
+}
+
+/*
+ * Queue a bind/unbind event in this CPU's buffer, which is sent when it is
+ * full or nl_batch_ms after its first event.
+ */
+static void dnetmap_nl_event(const struct dnetmap_entry *e, __u8 type)
+{
+	struct xt_DNETMAP_event ev;
+	struct dnetmap_nl_batch *b;
+	bool first;
+
+	if (dnetmap_nl_batch == NULL)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.time         = ktime_get_real_ns();
+	ev.prenat_addr  = e->prenat_addr;
+	ev.postnat_addr = e->postnat_addr;
+	ev.type         = type;
+	ev.family       = e->prefix->family;
+	ev.flags        = e->flags & XT_DNETMAP_STATIC;
+
+	local_bh_disable();
+	b = this_cpu_ptr(dnetmap_nl_batch);
+	spin_lock(&b->lock);
+	first = b->count == 0;
+	memcpy(b->msg->data + b->count++ * sizeof(ev), &ev, sizeof(ev));
+	if (b->count == XT_DNETMAP_NL_BATCH_MAX || nl_batch_ms == 0) {
+		dnetmap_nl_send(b);
+		first = false;
+	}
+	spin_unlock(&b->lock);
+	local_bh_enable();
+	if (first)
+		schedule_delayed_work(&dnetmap_nl_flush_work,
+		                      msecs_to_jiffies(nl_batch_ms));
+}
+
+static int dnetmap_nl_init(void)
+{
+	struct dnetmap_nl_batch *b;
+	unsigned int cpu;
+
+	if (nl_multicast_group <= 0)
+		return 0;
+	dnetmap_nl_batch = alloc_percpu(struct dnetmap_nl_batch);
+	if (dnetmap_nl_batch == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(dnetmap_nl_batch, cpu);
+		spin_lock_init(&b->lock);
+		b->msg = kzalloc(sizeof(*b->msg) + XT_DNETMAP_NL_BATCH_MAX *
+		         sizeof(struct xt_DNETMAP_event), GFP_KERNEL);
+		if (b->msg == NULL)
+			goto err;
+	}
 	return 0;
+
+ err:
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(dnetmap_nl_batch, cpu)->msg);
+	free_percpu(dnetmap_nl_batch);
+	dnetmap_nl_batch = NULL;
+	return -ENOMEM;
+}
+
+static void dnetmap_nl_exit(void)
+{
+	unsigned int cpu;
+
+	if (dnetmap_nl_batch == NULL)
+		return;
+	cancel_delayed_work_sync(&dnetmap_nl_flush_work);
+	dnetmap_nl_flush(NULL);
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(dnetmap_nl_batch, cpu)->msg);
+	free_percpu(dnetmap_nl_batch);
+}
+#else
+static inline void dnetmap_nl_event(const struct dnetmap_entry *e,
+				    __u8 type) {}
+static inline int dnetmap_nl_init(void) { return 0; }
+static inline void dnetmap_nl_exit(void) {}
+#endif
+
+static void dnetmap_log(const struct dnetmap_prefix *p, const char *event,
+			const union nf_inet_addr *prenat,
+			const union nf_inet_addr *postnat)
+{
+	if (disable_log)
+		return;
+	if (p->family == NFPROTO_IPV6)
+		printk(KERN_INFO KBUILD_MODNAME ": %s %pI6c -> %pI6c\n",
+		       event, &prenat->in6, &postnat->in6);
+	else
+		printk(KERN_INFO KBUILD_MODNAME ": %s %pI4 -> %pI4\n",
+		       event, &prenat->ip, &postnat->ip);
+}
+
+/*
+ * Release the binding of @e and return its postnat address to the prefix.
+ * Called with the prefix lock held.
+ */
+static void dnetmap_entry_unbind(struct dnetmap_prefix *p,
+				 struct dnetmap_entry *e)
+{
+	dnetmap_entry_unhash(p->dnetmap, e);
+	dnetmap_nl_event(e, XT_DNETMAP_EVENT_UNBIND);
+	list_del(&e->list);
+	if (!(e->flags & XT_DNETMAP_STATIC))
+		list_del(&e->lru_list);
+	if (p->family == NFPROTO_IPV4)
+		__clear_bit(ntohl(e->postnat_addr.ip) - p->addr_base,
+		            p->addr_map);
+	WRITE_ONCE(e->flags, e->flags | DNETMAP_RELEASED);
+	--p->nr_entries;
+	call_rcu(&e->rcu, dnetmap_entry_free_rcu);
+}
+
+/*
+ * Push out the expiry of a binding found under RCU, unless it would move by
+ * less than DNETMAP_STAMP_GRAN.
+ */
+static void dnetmap_entry_refresh(struct dnetmap_entry *e, long jttl)
+{
+	struct dnetmap_prefix *p = e->prefix;
+	unsigned long stamp = jiffies + jttl;
+
+	if (abs((long)(stamp - READ_ONCE(e->stamp))) < DNETMAP_STAMP_GRAN)
+		return;
+	spin_lock_bh(&p->lock);
+	if (dnetmap_entry_bound(e) && !(e->flags & XT_DNETMAP_STATIC)) {
+		e->stamp = stamp;
+		list_move_tail(&e->lru_list, &p->lru_list);
+	}
+	spin_unlock_bh(&p->lock);
+}
+
+static int
+dnetmap_addr_in_prefix(const struct dnetmap_prefix *p,
+		       const union nf_inet_addr *addr)
+{
+	const union nf_inet_addr *net = &p->prefix.min_addr;
+	const union nf_inet_addr *last = &p->prefix.max_addr;
+	unsigned int k;
+
+	if (p->family == NFPROTO_IPV4)
+		return ntohl(addr->ip) - p->addr_base < p->max_entries;
+	for (k = 0; k < ARRAY_SIZE(addr->all); ++k)
+		if ((addr->all[k] & ~(net->all[k] ^ last->all[k])) !=
+		    net->all[k])
+			return 0;
+	return 1;
 }
 
 static struct dnetmap_prefix *
-dnetmap_prefix_lookup(struct dnetmap_net *dnetmap_net,
+dnetmap_prefix_lookup(struct dnetmap_net *dnetmap_net, __u8 family,
 		      const struct nf_nat_range *mr)
 {
 	struct dnetmap_prefix *p;
 
-	list_for_each_entry(p, &dnetmap_net->prefixes, list)
-		if (memcmp(&p->prefix, mr, sizeof(*mr)) == 0)
+	list_for_each_entry_rcu(p, &dnetmap_net->prefixes, list)
+		if (p->family == family &&
+		    memcmp(&p->prefix, mr, sizeof(*mr)) == 0)
 			return p;
 	return NULL;
 }
@@ -169,65 +470,155 @@ static void dnetmap_prefix_destroy(struct dnetmap_net *dnetmap_net,
 				 struct dnetmap_prefix *p)
 {
 	struct dnetmap_entry *e, *next;
-	unsigned int i;
 
 #ifdef CONFIG_PROC_FS
 	remove_proc_entry(p->proc_str_data, dnetmap_net->xt_dnetmap);
 	remove_proc_entry(p->proc_str_stat, dnetmap_net->xt_dnetmap);
+	remove_proc_entry(p->proc_str_state, dnetmap_net->xt_dnetmap);
 #endif
 
-	for (i = 0; i < hash_size; i++) {
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->dnetmap_iphash[i], glist)
-			if (e->prefix == p)
-				list_del(&e->glist);
-
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->
-					 dnetmap_iphash[hash_size + i], grlist)
-			if (e->prefix == p)
-				list_del(&e->grlist);
+	list_del_rcu(&p->list);
+	spin_lock_bh(&p->lock);
+	p->dead = true;
+	list_for_each_entry(e, &p->elist, list) {
+		dnetmap_entry_unhash(dnetmap_net, e);
+		dnetmap_nl_event(e, XT_DNETMAP_EVENT_UNBIND);
+		WRITE_ONCE(e->flags, e->flags | DNETMAP_RELEASED);
 	}
+	spin_unlock_bh(&p->lock);
+
+	/* wait for lookups that may still hold entries of this prefix */
+	synchronize_rcu();
 
 	list_for_each_entry_safe(e, next, &p->elist, list) {
 		list_del(&e->list);
 		if(! (e->flags & XT_DNETMAP_STATIC)) list_del(&e->lru_list);
-		kfree(e);
+		kmem_cache_free(dnetmap_cachep, e);
 	}
-
-	list_del(&p->list);
+	kfree(p->addr_map);
 	kfree(p);
 }
 
-/* function clears bindings without destroying prefix */
+/*
+ * function clears bindings without destroying prefix,
+ * called with the prefix lock held
+ */
 static void dnetmap_prefix_softflush(struct dnetmap_prefix *p)
 {
-	struct dnetmap_net *dnetmap_net = p->dnetmap;
 	struct dnetmap_entry *e, *next;
-	unsigned int i;
 
-	for (i = 0; i < hash_size; i++) {
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->dnetmap_iphash[i], glist)
-			if (e->prefix == p)
-				list_del(&e->glist);
+	/* static bindings included */
+	list_for_each_entry_safe(e, next, &p->elist, list)
+		dnetmap_entry_unbind(p, e);
+}
+
+/* prefix length of an IPv6 range given by its first and last address */
+static unsigned int dnetmap_plen6(const struct nf_nat_range *mr)
+{
+	unsigned int i;
+	__u32 x;
 
-		list_for_each_entry_safe(e, next,
-					 &dnetmap_net->
-					 dnetmap_iphash[hash_size + i], grlist)
-			if (e->prefix == p)
-				list_del(&e->grlist);
+	for (i = 0; i < ARRAY_SIZE(mr->min_addr.all); ++i) {
+		x = ntohl(mr->min_addr.all[i] ^ mr->max_addr.all[i]);
+		if (x != 0)
+			return i * 32 + 32 - fls(x);
 	}
-	list_for_each_entry_safe(e, next, &p->elist, list) {
+	return 128;
+}
 
-		/* make dynamic entry of any static entry */
-		if(e->flags & XT_DNETMAP_STATIC){
-			list_add_tail(&e->lru_list, &p->lru_list);
-			e->flags&=~XT_DNETMAP_STATIC;
+/*
+ * Pick an unused postnat address for a new IPv4 binding, going round the
+ * prefix so that a released address is not handed out again right away.
+ * Called with the prefix lock held.
+ */
+static bool
+dnetmap_prefix4_addr(struct dnetmap_prefix *p, union nf_inet_addr *postnat)
+{
+	unsigned int bit;
+
+	bit = find_next_zero_bit(p->addr_map, p->max_entries, p->addr_next);
+	if (bit >= p->max_entries)
+		bit = find_first_zero_bit(p->addr_map, p->max_entries);
+	if (bit >= p->max_entries)
+		return false;
+	p->addr_next = bit + 1;
+	postnat->ip = htonl(p->addr_base + bit);
+	return true;
+}
+
+/*
+ * Pick an unused postnat address for a new IPv6 binding. The first candidate
+ * keeps the host part of @prenat, as NPTv6 would; the others are hashed from
+ * it. The all-zero host part (subnet-router anycast) is never used. Called
+ * with the prefix lock held, which makes the rlookup authoritative for the
+ * addresses of this prefix.
+ */
+static bool
+dnetmap_prefix6_addr(const struct dnetmap_prefix *p,
+		     const union nf_inet_addr *prenat,
+		     union nf_inet_addr *postnat)
+{
+	const union nf_inet_addr *net = &p->prefix.min_addr;
+	const union nf_inet_addr *last = &p->prefix.max_addr;
+	unsigned int i, k;
+	__be32 host, any;
+
+	for (i = 0; i < DNETMAP_IPV6_PROBES; ++i) {
+		any = 0;
+		for (k = 0; k < ARRAY_SIZE(postnat->all); ++k) {
+			if (i == 0)
+				host = prenat->all[k];
+			else
+				host = (__force __be32)jhash2(
+				       (const u32 *)prenat->all,
+				       ARRAY_SIZE(prenat->all),
+				       dnetmap_seed + i * 4 + k);
+			host &= net->all[k] ^ last->all[k];
+			postnat->all[k] = net->all[k] | host;
+			any |= host;
 		}
-		e->stamp=jiffies-1;
-		e->prenat_addr=0;
+		if (any != 0 && dnetmap_entry_rlookup(p->dnetmap, NFPROTO_IPV6,
+		    postnat) == NULL)
+			return true;
 	}
+	return false;
+}
+
+/*
+ * Create and hash a binding of the unused address @postnat. Called under RCU
+ * with the prefix lock held.
+ */
+static int
+dnetmap_entry_add(struct dnetmap_prefix *p, const union nf_inet_addr *prenat,
+		  const union nf_inet_addr *postnat, long jttl, __u8 flags)
+{
+	struct dnetmap_entry *e;
+	int ret;
+
+	e = kmem_cache_zalloc(dnetmap_cachep, GFP_ATOMIC);
+	if (e == NULL)
+		return -ENOMEM;
+	e->prenat_addr = *prenat;
+	e->postnat_addr = *postnat;
+	e->stamp = jiffies + jttl;
+	e->flags = flags;
+	e->prefix = p;
+
+	ret = dnetmap_entry_hash_add(p->dnetmap, e);
+	if (ret != 0) {
+		/* may have been visible in iphash for a moment */
+		e->flags = DNETMAP_RELEASED;
+		call_rcu(&e->rcu, dnetmap_entry_free_rcu);
+		return ret;
+	}
+	list_add_tail(&e->list, &p->elist);
+	if (!(flags & XT_DNETMAP_STATIC))
+		list_add_tail(&e->lru_list, &p->lru_list);
+	if (p->family == NFPROTO_IPV4)
+		__set_bit(ntohl(postnat->ip) - p->addr_base, p->addr_map);
+	++p->nr_entries;
+	dnetmap_nl_event(e, XT_DNETMAP_EVENT_BIND);
+	return 0;
 }
 
 static int dnetmap_tg_check(const struct xt_tgchk_param *par)
@@ -236,13 +627,12 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 	const struct xt_DNETMAP_tginfo *tginfo = par->targinfo;
 	const struct nf_nat_range *mr = &tginfo->prefix;
 	struct dnetmap_prefix *p;
-	struct dnetmap_entry *e;
 #ifdef CONFIG_PROC_FS
-	struct proc_dir_entry *pde_data, *pde_stat;
+	struct proc_dir_entry *pde_data, *pde_stat, *pde_state;
 #endif
 	int ret = -EINVAL;
-	__be32 a;
-	__u32 ip_min, ip_max, ip;
+	__u32 ip_min, ip_max;
+	unsigned int plen;
 
 	/* prefix not specified - no need to do anything */
 	if (!(tginfo->flags & XT_DNETMAP_PREFIX)) {
@@ -255,8 +645,13 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 		return -EINVAL;
 	}
 
+	if (par->family == NFPROTO_IPV6 && dnetmap_plen6(mr) >= 128) {
+		pr_info("IPv6 prefix must be shorter than /128\n");
+		return -EINVAL;
+	}
+
 	mutex_lock(&dnetmap_mutex);
-	p = dnetmap_prefix_lookup(dnetmap_net, mr);
+	p = dnetmap_prefix_lookup(dnetmap_net, par->family, mr);
 
 	if (p != NULL) {
 		p->refcnt++;
@@ -264,21 +659,41 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 		goto out;
 	}
 
-	p = kzalloc(sizeof(*p) + sizeof(struct list_head) * hash_size * 2,
-		    GFP_KERNEL);
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
 	if (p == NULL) {
 		ret = -ENOMEM;
 		goto out;
 	}
 	p->refcnt = 1;
+	spin_lock_init(&p->lock);
 	p->flags = 0;
 	p->flags |= (tginfo->flags & XT_DNETMAP_PERSISTENT);
+	p->family = par->family;
 	p->dnetmap = dnetmap_net;
 	memcpy(&p->prefix, mr, sizeof(*mr));
 
 	INIT_LIST_HEAD(&p->lru_list);
 	INIT_LIST_HEAD(&p->elist);
 
+	if (p->family == NFPROTO_IPV6) {
+		/* entries are created on demand, up to max_entries */
+		plen = dnetmap_plen6(mr);
+		p->max_entries = ipv6_max_bindings;
+		if (128 - plen < 32)
+			p->max_entries = min(p->max_entries,
+			                     (1U << (128 - plen)) - 1);
+
+		sprintf(p->prefix_str, "%pI6c/%u", &mr->min_addr.in6, plen);
+#ifdef CONFIG_PROC_FS
+		sprintf(p->proc_str_data, "%pI6c_%u", &mr->min_addr.in6, plen);
+		sprintf(p->proc_str_stat, "%pI6c_%u_stat", &mr->min_addr.in6,
+			plen);
+#endif
+		printk(KERN_INFO KBUILD_MODNAME ": new prefix %s\n",
+		       p->prefix_str);
+		goto proc;
+	}
+
 	ip_min = ntohl(mr->min_addr.ip) + (whole_prefix == 0);
 	ip_max = ntohl(mr->max_addr.ip) - (whole_prefix == 0);
 
@@ -292,26 +707,28 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 #endif
 	printk(KERN_INFO KBUILD_MODNAME ": new prefix %s\n", p->prefix_str);
 
-	for (ip = ip_min; ip <= ip_max; ip++) {
-		a = htonl(ip);
-		e = kmalloc(sizeof(*e), GFP_ATOMIC);
-		if (e == NULL)
-			return 0;
-		e->postnat_addr = a;
-		e->prenat_addr = 0;
-		e->stamp = jiffies;
-		e->prefix = p;
-		e->flags = 0;
-		list_add_tail(&e->lru_list, &p->lru_list);
-		list_add_tail(&e->list, &p->elist);
+	/* entries are created on demand, the map tracks the used addresses */
+	p->addr_base = ip_min;
+	p->max_entries = ip_max >= ip_min ? ip_max - ip_min + 1 : 0;
+	p->addr_map = kcalloc(BITS_TO_LONGS(p->max_entries),
+	                      sizeof(unsigned long), GFP_KERNEL);
+	if (p->addr_map == NULL) {
+		kfree(p);
+		ret = -ENOMEM;
+		goto out;
 	}
 
+ proc:
 #ifdef CONFIG_PROC_FS
+	snprintf(p->proc_str_state, sizeof(p->proc_str_state), "%s_state",
+		 p->proc_str_data);
+
 	/* data */
 	pde_data = proc_create_data(p->proc_str_data, proc_perms,
 				    dnetmap_net->xt_dnetmap,
 				    &dnetmap_tg_fops, p);
 	if (pde_data == NULL) {
+		kfree(p->addr_map);
 		kfree(p);
 		ret = -ENOMEM;
 		goto out;
@@ -324,17 +741,32 @@ static int dnetmap_tg_check(const struct xt_tgchk_param *par)
 		                    dnetmap_net->xt_dnetmap,
 		                    &dnetmap_stat_proc_fops, p);
 	if (pde_stat == NULL) {
+		remove_proc_entry(p->proc_str_data, dnetmap_net->xt_dnetmap);
+		kfree(p->addr_map);
 		kfree(p);
 		ret = -ENOMEM;
 		goto out;
 	}
 	proc_set_user(pde_stat, make_kuid(&init_user_ns, proc_uid),
 	              make_kgid(&init_user_ns, proc_gid));
+
+	/* binary dump and restore */
+	pde_state = proc_create_data(p->proc_str_state, proc_perms,
+		                     dnetmap_net->xt_dnetmap,
+		                     &dnetmap_state_proc_fops, p);
+	if (pde_state == NULL) {
+		remove_proc_entry(p->proc_str_stat, dnetmap_net->xt_dnetmap);
+		remove_proc_entry(p->proc_str_data, dnetmap_net->xt_dnetmap);
+		kfree(p->addr_map);
+		kfree(p);
+		ret = -ENOMEM;
+		goto out;
+	}
+	proc_set_user(pde_state, make_kuid(&init_user_ns, proc_uid),
+	              make_kgid(&init_user_ns, proc_gid));
 #endif
 
-	spin_lock_bh(&dnetmap_lock);
-	list_add_tail(&p->list, &dnetmap_net->prefixes);
-	spin_unlock_bh(&dnetmap_lock);
+	list_add_tail_rcu(&p->list, &dnetmap_net->prefixes);
 	ret = 0;
 
 out:
@@ -342,13 +774,125 @@ out:
 	return ret;
 }
 
+/*
+ * Slow path of the SNAT direction: find or create the binding for @prenat
+ * under the prefix locks. Returns false if no postnat address is available.
+ */
+static bool
+dnetmap_bind(struct dnetmap_net *dnetmap_net, struct dnetmap_prefix *p,
+	     const struct xt_DNETMAP_tginfo *tginfo, __u8 family,
+	     const union nf_inet_addr *prenat, long jttl,
+	     union nf_inet_addr *postnat)
+{
+	struct dnetmap_prefix *ep;
+	struct dnetmap_entry *e;
+	union nf_inet_addr prenat_prev = {};
+	bool bound_prev;
+	int ret;
+
+ again:
+	e = dnetmap_entry_lookup(dnetmap_net, family, prenat);
+
+	if (e == NULL) {	/* need for new binding */
+
+		// finish if it's static only rule
+		if(tginfo->flags & XT_DNETMAP_STATIC)
+			return false;
+		goto bind_new_prefix;
+	}
+
+	ep = e->prefix;
+	spin_lock_bh(&ep->lock);
+	if (!dnetmap_entry_bound(e)) {
+		/* released while we were looking */
+		spin_unlock_bh(&ep->lock);
+		goto again;
+	}
+
+	if (!(tginfo->flags & XT_DNETMAP_REUSE) && !(e->flags & XT_DNETMAP_STATIC))
+		if (time_before(e->stamp, jiffies) && p != ep) {
+			dnetmap_log(ep, "timeout binding", &e->prenat_addr,
+				    &e->postnat_addr);
+			dnetmap_entry_unbind(ep, e);
+			spin_unlock_bh(&ep->lock);
+			goto bind_new_prefix;
+		}
+	/* don't reset ttl if flag is set
+	or it is static entry*/
+	if (jttl >= 0 && ! (e->flags & XT_DNETMAP_STATIC) ) {
+		e->stamp = jiffies + jttl;
+		list_move_tail(&e->lru_list, &ep->lru_list);
+	}
+	*postnat = e->postnat_addr;
+	spin_unlock_bh(&ep->lock);
+	return true;
+
+bind_new_prefix:
+	if (p == NULL)
+		return false;
+	spin_lock_bh(&p->lock);
+	if (p->dead) {
+		spin_unlock_bh(&p->lock);
+		return false;
+	}
+
+	/* prefer an unused address over evicting a binding */
+	bound_prev = false;
+	if (p->nr_entries >= p->max_entries ||
+	    !(p->family == NFPROTO_IPV6 ?
+	    dnetmap_prefix6_addr(p, prenat, postnat) :
+	    dnetmap_prefix4_addr(p, postnat))) {
+		e = list_first_entry_or_null(&p->lru_list,
+		    struct dnetmap_entry, lru_list);
+		if (e == NULL || time_before(jiffies, e->stamp)) {
+			if (!disable_log && ! (p->flags & XT_DNETMAP_FULL) ){
+				if (p->family == NFPROTO_IPV6)
+					printk(KERN_INFO KBUILD_MODNAME
+					       ": ip %pI6c - no free adresses in prefix %s\n",
+					       &prenat->in6, p->prefix_str);
+				else
+					printk(KERN_INFO KBUILD_MODNAME
+					       ": ip %pI4 - no free adresses in prefix %s\n",
+					       &prenat->ip, p->prefix_str);
+				p->flags |= XT_DNETMAP_FULL;
+			}
+			spin_unlock_bh(&p->lock);
+			return false;
+		}
+		/* take over the address of the expired binding */
+		bound_prev = true;
+		prenat_prev = e->prenat_addr;
+		*postnat = e->postnat_addr;
+		dnetmap_entry_unbind(p, e);
+	}
+
+	p->flags &= ~XT_DNETMAP_FULL;
+
+	/*
+	 * Another CPU may have bound prenat since the lookup above, in which
+	 * case the insertion fails with -EEXIST and we start over.
+	 */
+	ret = dnetmap_entry_add(p, prenat, postnat, jttl, 0);
+	spin_unlock_bh(&p->lock);
+
+	if (bound_prev)
+		dnetmap_log(p, "timeout binding", &prenat_prev, postnat);
+	if (ret == -EEXIST)
+		goto again;
+	if (ret != 0)
+		return false;
+
+	dnetmap_log(p, "add binding", prenat, postnat);
+	return true;
+}
+
 static unsigned int
 dnetmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
 {
 	struct net *net = dev_net(par->state->in ? par->state->in : par->state->out);
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
 	enum ip_conntrack_info ctinfo;
-	__be32 prenat_ip, postnat_ip, prenat_ip_prev;
+	union nf_inet_addr prenat = {}, postnat = {};
 	const struct xt_DNETMAP_tginfo *tginfo = par->targinfo;
 	const struct nf_nat_range *mr = &tginfo->prefix;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
@@ -359,16 +903,20 @@ dnetmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
 	struct dnetmap_entry *e;
 	struct dnetmap_prefix *p;
 	unsigned int hooknum = par->state->hook;
+	__u8 family = xt_family(par);
 	struct nf_conn *ct = nf_ct_get(skb, &ctinfo);
 	__s32 jttl = tginfo->flags & XT_DNETMAP_TTL ? tginfo->ttl * HZ : jtimeout;
 
+	rcu_read_lock();
+
 	/* in prerouting we try to map postnat-ip to prenat-ip */
 	if (hooknum == NF_INET_PRE_ROUTING) {
-		postnat_ip = ip_hdr(skb)->daddr;
+		if (family == NFPROTO_IPV6)
+			postnat.in6 = ipv6_hdr(skb)->daddr;
+		else
+			postnat.ip = ip_hdr(skb)->daddr;
 
-		spin_lock_bh(&dnetmap_lock);
-
-		e = dnetmap_entry_rlookup(dnetmap_net, postnat_ip);
+		e = dnetmap_entry_rlookup(dnetmap_net, family, &postnat);
 
 		if (e == NULL)
 			goto no_rev_map;	/* no binding found */
@@ -378,112 +926,62 @@ dnetmap_tg(struct sk_buff *skb, const struct xt_action_param *par)
 		if (tginfo->flags & XT_DNETMAP_PREFIX)
 			if (memcmp(mr, &e->prefix->prefix, sizeof(*mr)))
 				goto no_rev_map;
+		if (!dnetmap_entry_bound(e))
+			goto no_rev_map;	/* unbound meanwhile */
+		prenat = e->prenat_addr;
 		/* don't reset ttl if flag is set */
-		if (jttl >= 0 && (! (e->flags & XT_DNETMAP_STATIC) ) ) {
-			p = e->prefix;
-			e->stamp = jiffies + jttl;
-			list_move_tail(&e->lru_list, &p->lru_list);
-		}
+		if (jttl >= 0 && (! (READ_ONCE(e->flags) & XT_DNETMAP_STATIC) ) )
+			dnetmap_entry_refresh(e, jttl);
 
-		spin_unlock_bh(&dnetmap_lock);
+		rcu_read_unlock();
 
 		memset(&newrange, 0, sizeof(newrange));
 		newrange.flags = mr->flags | NF_NAT_RANGE_MAP_IPS;
-		newrange.min_addr.ip = e->prenat_addr;
-		newrange.max_addr.ip = e->prenat_addr;
+		newrange.min_addr = prenat;
+		newrange.max_addr = prenat;
 		newrange.min_proto = mr->min_proto;
 		newrange.max_proto = mr->max_proto;
 		return nf_nat_setup_info(ct, &newrange,
 					 HOOK2MANIP(hooknum));
 	}
 
-	prenat_ip = ip_hdr(skb)->saddr;
-	spin_lock_bh(&dnetmap_lock);
-
-	p = dnetmap_prefix_lookup(dnetmap_net, mr);
-	e = dnetmap_entry_lookup(dnetmap_net, prenat_ip);
-
-	if (e == NULL) {	/* need for new binding */
-
-		// finish if it's static only rule
-		if(tginfo->flags & XT_DNETMAP_STATIC)
-			goto no_free_ip;
-
-bind_new_prefix:
-		e = list_entry(p->lru_list.next, struct dnetmap_entry,
-			       lru_list);
-		if (e->prenat_addr != 0 && time_before(jiffies, e->stamp)) {
-			if (!disable_log && ! (p->flags & XT_DNETMAP_FULL) ){
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": ip %pI4 - no free adresses in prefix %s\n",
-				       &prenat_ip, p->prefix_str);
-				p->flags |= XT_DNETMAP_FULL;
-			}
-			goto no_free_ip;
-		}
-
-		p->flags &= ~XT_DNETMAP_FULL;
-		postnat_ip = e->postnat_addr;
-
-		if (e->prenat_addr != 0) {
-			prenat_ip_prev = e->prenat_addr;
-			if (!disable_log)
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": timeout binding %pI4 -> %pI4\n",
-				       &prenat_ip_prev, &postnat_ip);
-			list_del(&e->glist);
-			list_del(&e->grlist);
-		}
-
-		e->prenat_addr = prenat_ip;
-		e->stamp = jiffies + jttl;
-		list_move_tail(&e->lru_list, &p->lru_list);
-		list_add_tail(&e->glist,
-			      &dnetmap_net->
-			      dnetmap_iphash[dnetmap_entry_hash(prenat_ip)]);
-		list_add_tail(&e->grlist,
-			      &dnetmap_net->dnetmap_iphash[hash_size +
-							   dnetmap_entry_hash
-							   (postnat_ip)]);
-		if (!disable_log)
-			printk(KERN_INFO KBUILD_MODNAME
-			       ": add binding %pI4 -> %pI4\n",
-			       &prenat_ip, &postnat_ip);
-	} else {
-
-		if (!(tginfo->flags & XT_DNETMAP_REUSE) && !(e->flags & XT_DNETMAP_STATIC))
-			if (time_before(e->stamp, jiffies) && p != e->prefix) {
-				if (!disable_log)
-					printk(KERN_INFO KBUILD_MODNAME
-					       ": timeout binding %pI4 -> %pI4\n",
-					       &e->prenat_addr, &e->postnat_addr);
-				list_del(&e->glist);
-				list_del(&e->grlist);
-				e->prenat_addr = 0;
-				goto bind_new_prefix;
-			}
-		/* don't reset ttl if flag is set
-		or it is static entry*/
-		if (jttl >= 0 && ! (e->flags & XT_DNETMAP_STATIC) ) {
-			e->stamp = jiffies + jttl;
-			p = e->prefix;
-			list_move_tail(&e->lru_list, &p->lru_list);
-		}
-		postnat_ip = e->postnat_addr;
+	if (family == NFPROTO_IPV6)
+		prenat.in6 = ipv6_hdr(skb)->saddr;
+	else
+		prenat.ip = ip_hdr(skb)->saddr;
+	p = dnetmap_prefix_lookup(dnetmap_net, family, mr);
+	e = dnetmap_entry_lookup(dnetmap_net, family, &prenat);
+
+	/*
+	 * Common case: a binding that is well clear of its expiry cannot be
+	 * taken over by another address, so it is used without locking.
+	 */
+	if (e != NULL && ((READ_ONCE(e->flags) & XT_DNETMAP_STATIC) ||
+	    time_before(jiffies + DNETMAP_STAMP_GRAN, READ_ONCE(e->stamp)))) {
+		postnat = e->postnat_addr;
+		if (jttl >= 0 && !(READ_ONCE(e->flags) & XT_DNETMAP_STATIC))
+			dnetmap_entry_refresh(e, jttl);
+		if (dnetmap_entry_bound(e))
+			goto map;
 	}
 
-	spin_unlock_bh(&dnetmap_lock);
+	if (!dnetmap_bind(dnetmap_net, p, tginfo, family, &prenat, jttl,
+	    &postnat))
+		goto no_free_ip;
+
+ map:
+	rcu_read_unlock();
 
 	memset(&newrange, 0, sizeof(newrange));
 	newrange.flags = mr->flags | NF_NAT_RANGE_MAP_IPS;
-	newrange.min_addr.ip = postnat_ip;
-	newrange.max_addr.ip = postnat_ip;
+	newrange.min_addr = postnat;
+	newrange.max_addr = postnat;
 	newrange.min_proto = mr->min_proto;
 	newrange.max_proto = mr->max_proto;
 	return nf_nat_setup_info(ct, &newrange, HOOK2MANIP(par->state->hook));
 no_rev_map:
 no_free_ip:
-	spin_unlock_bh(&dnetmap_lock);
+	rcu_read_unlock();
 	return XT_CONTINUE;
 
 }
@@ -499,30 +997,28 @@ static void dnetmap_tg_destroy(const struct xt_tgdtor_param *par)
 		return;
 
 	mutex_lock(&dnetmap_mutex);
-	spin_lock_bh(&dnetmap_lock);
-	p = dnetmap_prefix_lookup(dnetmap_net, mr);
+	p = dnetmap_prefix_lookup(dnetmap_net, par->family, mr);
 	if (--p->refcnt == 0 && (! (p->flags & XT_DNETMAP_PERSISTENT) ) ) {
 		dnetmap_prefix_destroy(dnetmap_net, p);
 	}
-	spin_unlock_bh(&dnetmap_lock);
 	mutex_unlock(&dnetmap_mutex);
 }
 
 #ifdef CONFIG_PROC_FS
 struct dnetmap_iter_state {
-	const struct dnetmap_prefix *p;
+	struct dnetmap_prefix *p;
 	unsigned int bucket;
 };
 
 static void *dnetmap_seq_start(struct seq_file *seq, loff_t * pos)
-__acquires(dnetmap_lock)
+__acquires(prefix->lock)
 {
 	struct dnetmap_iter_state *st = seq->private;
-	const struct dnetmap_prefix *prefix = st->p;
+	struct dnetmap_prefix *prefix = st->p;
 	struct dnetmap_entry *e;
 	loff_t p = *pos;
 
-	spin_lock_bh(&dnetmap_lock);
+	spin_lock_bh(&prefix->lock);
 
 	list_for_each_entry(e, &prefix->elist, list)
 		if (p-- == 0)
@@ -545,23 +1041,33 @@ static void *dnetmap_seq_next(struct seq_file *seq, void *v, loff_t * pos)
 }
 
 static void dnetmap_seq_stop(struct seq_file *s, void *v)
-__releases(dnetmap_lock)
+__releases(prefix->lock)
 {
-	spin_unlock_bh(&dnetmap_lock);
+	struct dnetmap_iter_state *st = s->private;
+
+	spin_unlock_bh(&st->p->lock);
 }
 
 static int dnetmap_seq_show(struct seq_file *seq, void *v)
 {
 	const struct dnetmap_entry *e = v;
 
+	if (e->prefix->family == NFPROTO_IPV6) {
+		seq_printf(seq, "%pI6c -> %pI6c --- ttl: %d lasthit: %lu\n",
+		           &e->prenat_addr.in6, &e->postnat_addr.in6,
+		           (int)(e->stamp - jiffies) / HZ,
+		           (e->stamp - jtimeout) / HZ);
+		return 0;
+	}
+
 	if((e->flags & XT_DNETMAP_STATIC) == 0){
 		seq_printf(seq, "%pI4 -> %pI4 --- ttl: %d lasthit: %lu\n",
-		           &e->prenat_addr, &e->postnat_addr,
+		           &e->prenat_addr.ip, &e->postnat_addr.ip,
 		           (int)(e->stamp - jiffies) / HZ,
 		           (e->stamp - jtimeout) / HZ);
 	}else{
 		seq_printf(seq, "%pI4 -> %pI4 --- ttl: S lasthit: S\n",
-		           &e->prenat_addr, &e->postnat_addr);
+		           &e->prenat_addr.ip, &e->postnat_addr.ip);
 	}
 	return 0;
 }
@@ -589,11 +1095,12 @@ static ssize_t
 dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, loff_t *loff)
 {
 	struct dnetmap_prefix *p = PDE_DATA(file_inode(file));
+	struct dnetmap_prefix *ep;
 	struct dnetmap_entry *e;
-	char buf[sizeof("+192.168.100.100:200.200.200.200")];
+	char buf[INET6_ADDRSTRLEN + 2];
 	const char *c = buf;
 	const char *c2;
-	__be32 addr1,addr2;
+	union nf_inet_addr addr1 = {}, addr2 = {};
 	bool add;
 	char str[25];
 
@@ -614,9 +1121,9 @@ dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, l
 			if( strcmp(c,"flush") != 0 )
 				goto invalid_arg;
 			printk(KERN_INFO KBUILD_MODNAME ": flushing prefix %s\n", p->prefix_str);
-			spin_lock_bh(&dnetmap_lock);
+			spin_lock_bh(&p->lock);
 			dnetmap_prefix_softflush(p);
-			spin_unlock_bh(&dnetmap_lock);
+			spin_unlock_bh(&p->lock);
 			return size;
 		case '-': /* remove address or attribute */
 			if( strcmp(c,"-persistent") == 0){
@@ -626,9 +1133,9 @@ dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, l
 					return size;
 				}
 				printk(KERN_INFO KBUILD_MODNAME ": prefix %s is now non-persistent\n", p->prefix_str);
-				spin_lock_bh(&dnetmap_lock);
+				spin_lock_bh(&p->lock);
 				p->flags &= ~XT_DNETMAP_PERSISTENT;
-				spin_unlock_bh(&dnetmap_lock);
+				spin_unlock_bh(&p->lock);
 				return size;
 			}
 			add = false;
@@ -641,18 +1148,22 @@ dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, l
 					return size;
 				}
 				printk(KERN_INFO KBUILD_MODNAME ": prefix %s is now persistent\n", p->prefix_str);
-				spin_lock_bh(&dnetmap_lock);
+				spin_lock_bh(&p->lock);
 				p->flags |= XT_DNETMAP_PERSISTENT;
-				spin_unlock_bh(&dnetmap_lock);
+				spin_unlock_bh(&p->lock);
 				return size;
 			}
+			if (p->family == NFPROTO_IPV6) {
+				printk(KERN_INFO KBUILD_MODNAME ": static bindings are not supported for IPv6 prefix %s\n", p->prefix_str);
+				goto invalid_arg;
+			}
 			add = true;
 			break;
 		default:
 			goto invalid_arg;
 	}
 
-	spin_lock_bh(&dnetmap_lock);
+	rcu_read_lock();
 
 	// in case static entry is added we need to parse second ip addresses
 	if (add){
@@ -663,88 +1174,97 @@ dnetmap_tg_proc_write(struct file *file, const char __user *input,size_t size, l
 		c++;
 		c2++;
 
-		if( ! (in4_pton(c2,strlen(c2),(void *)&addr2, '\0', NULL) &&
-			  in4_pton(c,strlen(c),(void *)&addr1, ':', NULL)))
+		if( ! (in4_pton(c2,strlen(c2),(void *)&addr2.ip, '\0', NULL) &&
+			  in4_pton(c,strlen(c),(void *)&addr1.ip, ':', NULL)))
 			goto invalid_arg_unlock;
 
+		/* a prenat address is bound at most once, release it first */
+		e = dnetmap_entry_lookup(p->dnetmap, NFPROTO_IPV4, &addr1);
+		if (e != NULL) {
+			ep = e->prefix;
+			spin_lock_bh(&ep->lock);
+			if (dnetmap_entry_bound(e)) {
+				dnetmap_log(ep, "timeout binding",
+					    &e->prenat_addr, &e->postnat_addr);
+				dnetmap_entry_unbind(ep, e);
+			}
+			spin_unlock_bh(&ep->lock);
+		}
+
+		ep = p;
+		spin_lock_bh(&ep->lock);
+
 		// sanity check - prenat ip can't belong to postnat prefix
-		if ( dnetmap_addr_in_prefix(p->dnetmap, addr1, p)){
+		if ( dnetmap_addr_in_prefix(p, &addr1)){
 			printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - prenat ip can't belong to postnat prefix\n");
-			goto invalid_arg_unlock;
+			goto invalid_arg_unlock_prefix;
 		}
 
 		// make sure postnat ip belongs to postnat prefix
-		if ( ! dnetmap_addr_in_prefix(p->dnetmap, addr2, p)){
+		if ( ! dnetmap_addr_in_prefix(p, &addr2)){
 			printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - postnat ip must belong to postnat prefix\n");
-			goto invalid_arg_unlock;
+			goto invalid_arg_unlock_prefix;
 		}
 
-		e = dnetmap_entry_rlookup(p->dnetmap,addr2);
-		if(e != NULL){
-			if (!disable_log)
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": timeout binding %pI4 -> %pI4\n",
-				       &e->prenat_addr, &e->postnat_addr);
-			list_del(&e->glist);
-			list_del(&e->grlist);
-		}else{
-			// find existing entry in prefix elist
-			list_for_each_entry(e, &p->elist, list)
-				if (memcmp(&e->postnat_addr, &addr2, sizeof(addr2)) == 0){
-					break;
-				}
+		// release the current binding of postnat ip
+		e = dnetmap_entry_rlookup(p->dnetmap, NFPROTO_IPV4, &addr2);
+		if (e != NULL && e->prefix != p) {
+			printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - postnat ip is bound by another prefix\n");
+			goto invalid_arg_unlock_prefix;
+		}
+		if (e != NULL) {
+			dnetmap_log(p, "timeout binding", &e->prenat_addr,
+				    &e->postnat_addr);
+			dnetmap_entry_unbind(p, e);
 		}
 
-		e->prenat_addr=addr1;
-		e->flags |= XT_DNETMAP_STATIC;
-		list_add_tail(&e->glist,
-			      &p->dnetmap->
-			      dnetmap_iphash[dnetmap_entry_hash(e->prenat_addr)]);
-		list_add_tail(&e->grlist,
-			      &p->dnetmap->dnetmap_iphash[hash_size +
-							   dnetmap_entry_hash
-							   (e->postnat_addr)]);
-		list_del(&e->lru_list);
+		if (dnetmap_entry_add(p, &addr1, &addr2, 0,
+		    XT_DNETMAP_STATIC) != 0) {
+			printk(KERN_INFO KBUILD_MODNAME ": add static binding operation failed - prenat ip is bound meanwhile\n");
+			goto invalid_arg_unlock_prefix;
+		}
 
-		sprintf(str, "%pI4:%pI4", &addr1, &addr2);
+		sprintf(str, "%pI4:%pI4", &addr1.ip, &addr2.ip);
 		printk(KERN_INFO KBUILD_MODNAME ": adding static binding %s\n", str);
 
 	// case of removing binding
 	}else{
 
 		c++;
-		if( ! in4_pton(c,strlen(c),(void *)&addr1, '\0', NULL))
+		if (p->family == NFPROTO_IPV6) {
+			if (!in6_pton(c, strlen(c), (void *)&addr1.in6, '\0', NULL))
+				goto invalid_arg_unlock;
+		} else if( ! in4_pton(c,strlen(c),(void *)&addr1.ip, '\0', NULL))
 			goto invalid_arg_unlock;
 
-		e = dnetmap_entry_rlookup(p->dnetmap,addr1);
-		if(e == NULL) e = dnetmap_entry_lookup(p->dnetmap,addr1);
-
-		if(e != NULL){
-			if (!disable_log)
-				printk(KERN_INFO KBUILD_MODNAME
-				       ": remove binding %pI4 -> %pI4\n",
-				       &e->prenat_addr, &e->postnat_addr);
-			list_del(&e->glist);
-			list_del(&e->grlist);
-			if(e->flags & XT_DNETMAP_STATIC){
-				list_add_tail(&e->lru_list,&p->lru_list);
-				e->flags &= ~XT_DNETMAP_STATIC;
-			}
-			e->prenat_addr=0;
-			e->stamp=jiffies-1;
-		}else{
+		e = dnetmap_entry_rlookup(p->dnetmap, p->family, &addr1);
+		if(e == NULL) e = dnetmap_entry_lookup(p->dnetmap, p->family, &addr1);
+		if (e == NULL)
 			goto invalid_arg_unlock;
-		}
+
+		/* the binding may belong to another prefix */
+		ep = e->prefix;
+		spin_lock_bh(&ep->lock);
+		if (!dnetmap_entry_bound(e))
+			/* unbound meanwhile */
+			goto invalid_arg_unlock_prefix;
+
+		dnetmap_log(ep, "remove binding", &e->prenat_addr,
+			    &e->postnat_addr);
+		dnetmap_entry_unbind(ep, e);
 	}
 
-	spin_unlock_bh(&dnetmap_lock);
+	spin_unlock_bh(&ep->lock);
+	rcu_read_unlock();
 
 	/* Note we removed one above */
 	*loff += size + 1;
 	return size + 1;
 
+	invalid_arg_unlock_prefix:
+		spin_unlock_bh(&ep->lock);
 	invalid_arg_unlock:
-		spin_unlock_bh(&dnetmap_lock);
+		rcu_read_unlock();
 
 	invalid_arg:
 		//printk(KERN_INFO KBUILD_MODNAME ": Need \"+prenat_ip:postnat_ip\", \"-ip\" or \"/\"\n");
@@ -761,38 +1281,53 @@ static const struct proc_ops dnetmap_tg_fops = {
 };
 
 /* for statistics */
+static void dnetmap_hash_stat(struct seq_file *m, struct rhashtable *ht)
+{
+	unsigned int nelems, size, load;
+
+	rcu_read_lock();
+	nelems = atomic_read(&ht->nelems);
+	size   = rht_dereference_rcu(ht->tbl, ht)->size;
+	rcu_read_unlock();
+
+	/* load factor in hundredths */
+	load = nelems * 100U / size;
+	seq_printf(m, "hash %u %u %u.%02u\n", nelems, size,
+	           load / 100, load % 100);
+}
+
 static int dnetmap_stat_proc_show(struct seq_file *m, void *data)
 {
-	const struct dnetmap_prefix *p = m->private;
+	struct dnetmap_prefix *p = m->private;
 	struct dnetmap_entry *e;
 	unsigned int used, used_static, all;
 	long int ttl, sum_ttl;
 
 	used=used_static=all=sum_ttl=0;
 
-	spin_lock_bh(&dnetmap_lock);
+	spin_lock_bh(&p->lock);
 
+	/* entries only exist while bound */
 	list_for_each_entry(e, &p->elist, list) {
 
-		if (e->prenat_addr != 0){
-			if (e->flags & XT_DNETMAP_STATIC){
-				used_static++;
-			}else{
-				ttl = e->stamp - jiffies;
-				if (e->prenat_addr != 0 && ttl >= 0) {
-					used++;
-					sum_ttl += ttl;
-				}
+		if (e->flags & XT_DNETMAP_STATIC){
+			used_static++;
+		}else{
+			ttl = e->stamp - jiffies;
+			if (ttl >= 0) {
+				used++;
+				sum_ttl += ttl;
 			}
 		}
-		all++;
 	}
+	all = p->max_entries;
 
 	sum_ttl = used > 0 ? sum_ttl / (used * HZ) : 0;
 	seq_printf(m, "%u %u %u %ld %s\n", used, used_static, all, sum_ttl,(p->flags & XT_DNETMAP_PERSISTENT ? "persistent" : ""));
 
-	spin_unlock_bh(&dnetmap_lock);
+	spin_unlock_bh(&p->lock);
 
+	dnetmap_hash_stat(m, &p->dnetmap->iphash[dnetmap_fam(p->family)]);
 	return 0;
 }
 
@@ -808,6 +1343,175 @@ static const struct proc_ops dnetmap_stat_proc_fops = {
 	.proc_release = single_release,
 };
 
+/* snapshot of the bindings of a prefix, taken when the state file is opened */
+struct dnetmap_dump {
+	size_t len;
+	struct xt_DNETMAP_binding rec[];
+};
+
+static void dnetmap_dump_entry(struct xt_DNETMAP_binding *rec,
+			       const struct dnetmap_entry *e)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->prenat_addr  = e->prenat_addr;
+	rec->postnat_addr = e->postnat_addr;
+	rec->flags        = e->flags & XT_DNETMAP_STATIC;
+	if (!(e->flags & XT_DNETMAP_STATIC))
+		rec->ttl = (long)(e->stamp - jiffies) / HZ;
+}
+
+/*
+ * Dynamic bindings are dumped in LRU order, so that restoring them in file
+ * order rebuilds the same eviction order; static bindings follow.
+ */
+static int dnetmap_state_proc_open(struct inode *inode, struct file *file)
+{
+	struct dnetmap_prefix *p = PDE_DATA(inode);
+	struct dnetmap_dump *d;
+	struct dnetmap_entry *e;
+	unsigned int n, i = 0;
+
+	if (!(file->f_mode & FMODE_READ))
+		return 0;
+
+	for (;;) {
+		n = READ_ONCE(p->nr_entries);
+		d = kvmalloc(sizeof(*d) + n * sizeof(d->rec[0]), GFP_KERNEL);
+		if (d == NULL)
+			return -ENOMEM;
+		spin_lock_bh(&p->lock);
+		if (p->nr_entries <= n)
+			break;
+		/* grew meanwhile */
+		spin_unlock_bh(&p->lock);
+		kvfree(d);
+	}
+
+	list_for_each_entry(e, &p->lru_list, lru_list)
+		dnetmap_dump_entry(&d->rec[i++], e);
+	list_for_each_entry(e, &p->elist, list)
+		if (e->flags & XT_DNETMAP_STATIC)
+			dnetmap_dump_entry(&d->rec[i++], e);
+	spin_unlock_bh(&p->lock);
+
+	d->len = i * sizeof(d->rec[0]);
+	file->private_data = d;
+	return 0;
+}
+
+static ssize_t
+dnetmap_state_proc_read(struct file *file, char __user *output, size_t size,
+			loff_t *loff)
+{
+	const struct dnetmap_dump *d = file->private_data;
+
+	return simple_read_from_buffer(output, size, loff, d->rec, d->len);
+}
+
+/*
+ * Restore one binding; an existing binding of either address is replaced.
+ * Called under RCU with the prefix lock held.
+ */
+static bool dnetmap_import(struct dnetmap_prefix *p,
+			   const struct xt_DNETMAP_binding *rec)
+{
+	struct dnetmap_entry *e;
+
+	if (rec->flags & ~XT_DNETMAP_STATIC)
+		return false;
+	if ((rec->flags & XT_DNETMAP_STATIC) && p->family == NFPROTO_IPV6)
+		return false;
+	if (!dnetmap_addr_in_prefix(p, &rec->postnat_addr) ||
+	    dnetmap_addr_in_prefix(p, &rec->prenat_addr))
+		return false;
+
+	e = dnetmap_entry_lookup(p->dnetmap, p->family, &rec->prenat_addr);
+	if (e != NULL) {
+		/* never touch another prefix's binding */
+		if (e->prefix != p)
+			return false;
+		dnetmap_entry_unbind(p, e);
+	}
+	e = dnetmap_entry_rlookup(p->dnetmap, p->family, &rec->postnat_addr);
+	if (e != NULL) {
+		if (e->prefix != p)
+			return false;
+		dnetmap_entry_unbind(p, e);
+	}
+	if (p->nr_entries >= p->max_entries)
+		return false;
+	return dnetmap_entry_add(p, &rec->prenat_addr, &rec->postnat_addr,
+	       (long)rec->ttl * HZ, rec->flags) == 0;
+}
+
+/*
+ * Restores binary struct xt_DNETMAP_binding records. Only whole records are
+ * consumed; records that do not fit the prefix are skipped.
+ */
+static ssize_t
+dnetmap_state_proc_write(struct file *file, const char __user *input,
+			 size_t size, loff_t *loff)
+{
+	struct dnetmap_prefix *p = PDE_DATA(file_inode(file));
+	struct xt_DNETMAP_binding *buf;
+	unsigned int i, count, imported = 0, total = 0;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (size < sizeof(*buf))
+		return -EINVAL;
+	buf = kmalloc(sizeof(*buf) * DNETMAP_IMPORT_BATCH, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	while (size - done >= sizeof(*buf)) {
+		count = min_t(size_t, (size - done) / sizeof(*buf),
+		        DNETMAP_IMPORT_BATCH);
+		if (copy_from_user(buf, input + done, count * sizeof(*buf))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (p->family == NFPROTO_IPV4)
+			for (i = 0; i < count; ++i) {
+				/* keys compare the whole union */
+				memset(&buf[i].prenat_addr.all[1], 0,
+				       3 * sizeof(buf[i].prenat_addr.all[0]));
+				memset(&buf[i].postnat_addr.all[1], 0,
+				       3 * sizeof(buf[i].postnat_addr.all[0]));
+			}
+
+		rcu_read_lock();
+		spin_lock_bh(&p->lock);
+		for (i = 0; i < count; ++i)
+			imported += dnetmap_import(p, &buf[i]);
+		spin_unlock_bh(&p->lock);
+		rcu_read_unlock();
+
+		total += count;
+		done += count * sizeof(*buf);
+		cond_resched();
+	}
+
+	kfree(buf);
+	printk(KERN_INFO KBUILD_MODNAME ": restored %u of %u bindings of prefix %s\n",
+	       imported, total, p->prefix_str);
+	return done > 0 ? done : ret;
+}
+
+static int dnetmap_state_proc_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+	return 0;
+}
+
+static const struct proc_ops dnetmap_state_proc_fops = {
+	.proc_open    = dnetmap_state_proc_open,
+	.proc_read    = dnetmap_state_proc_read,
+	.proc_write   = dnetmap_state_proc_write,
+	.proc_lseek   = default_llseek,
+	.proc_release = dnetmap_state_proc_release,
+};
+
 static int __net_init dnetmap_proc_net_init(struct net *net)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
@@ -837,36 +1541,59 @@ static inline void dnetmap_proc_net_exit(struct net *net)
 static int __net_init dnetmap_net_init(struct net *net)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
-	int i;
-
-	dnetmap_net->dnetmap_iphash = kmalloc(sizeof(struct list_head) *
-					      hash_size * 2, GFP_ATOMIC);
-	if (dnetmap_net->dnetmap_iphash == NULL)
-		return -ENOMEM;
+	struct rhashtable_params params;
+	unsigned int i;
+	int ret;
 
 	INIT_LIST_HEAD(&dnetmap_net->prefixes);
-	for (i = 0; i < hash_size * 2; i++)
-		INIT_LIST_HEAD(&dnetmap_net->dnetmap_iphash[i]);
-	return dnetmap_proc_net_init(net);
+
+	for (i = 0; i < ARRAY_SIZE(dnetmap_net->iphash); ++i) {
+		params = dnetmap_params;
+		params.nelem_hint = hash_size;
+		ret = rhashtable_init(&dnetmap_net->iphash[i], &params);
+		if (ret < 0)
+			goto out;
+		params = dnetmap_rparams;
+		params.nelem_hint = hash_size;
+		ret = rhashtable_init(&dnetmap_net->riphash[i], &params);
+		if (ret < 0) {
+			rhashtable_destroy(&dnetmap_net->iphash[i]);
+			goto out;
+		}
+	}
+
+	ret = dnetmap_proc_net_init(net);
+	if (ret < 0)
+		goto out;
+	return 0;
+
+ out:
+	while (i-- > 0) {
+		rhashtable_destroy(&dnetmap_net->riphash[i]);
+		rhashtable_destroy(&dnetmap_net->iphash[i]);
+	}
+	return ret;
 }
 
 static void __net_exit dnetmap_net_exit(struct net *net)
 {
 	struct dnetmap_net *dnetmap_net = dnetmap_pernet(net);
 	struct dnetmap_prefix *p,*next;
+	unsigned int i;
 
 	mutex_lock(&dnetmap_mutex);
-	spin_lock_bh(&dnetmap_lock);
 
 	list_for_each_entry_safe(p, next, &dnetmap_net->prefixes, list){
 		BUG_ON(p->refcnt != 0);
 		dnetmap_prefix_destroy(dnetmap_net, p);
 	}
 
-	spin_unlock_bh(&dnetmap_lock);
 	mutex_unlock(&dnetmap_mutex);
 
-	kfree(dnetmap_net->dnetmap_iphash);
+	for (i = 0; i < ARRAY_SIZE(dnetmap_net->iphash); ++i) {
+		rhashtable_destroy(&dnetmap_net->riphash[i]);
+		rhashtable_destroy(&dnetmap_net->iphash[i]);
+	}
 	kfree(dnetmap_net);
 	dnetmap_proc_net_exit(net);
 }
@@ -878,48 +1605,84 @@ static struct pernet_operations dnetmap_net_ops = {
 	.size = sizeof(struct dnetmap_net),
 };
 
-static struct xt_target dnetmap_tg_reg __read_mostly = {
-	.name       = "DNETMAP",
-	.family     = NFPROTO_IPV4,
-	.target     = dnetmap_tg,
-	.targetsize = sizeof(struct xt_DNETMAP_tginfo),
-	.table      = "nat",
-	.hooks      = (1 << NF_INET_POST_ROUTING) | (1 << NF_INET_LOCAL_OUT) |
-	              (1 << NF_INET_PRE_ROUTING),
-	.checkentry = dnetmap_tg_check,
-	.destroy    = dnetmap_tg_destroy,
-	.me         = THIS_MODULE
+static struct xt_target dnetmap_tg_reg[] __read_mostly = {
+	{
+		.name       = "DNETMAP",
+		.family     = NFPROTO_IPV4,
+		.target     = dnetmap_tg,
+		.targetsize = sizeof(struct xt_DNETMAP_tginfo),
+		.table      = "nat",
+		.hooks      = (1 << NF_INET_POST_ROUTING) | (1 << NF_INET_LOCAL_OUT) |
+		              (1 << NF_INET_PRE_ROUTING),
+		.checkentry = dnetmap_tg_check,
+		.destroy    = dnetmap_tg_destroy,
+		.me         = THIS_MODULE
+	},
+	{
+		.name       = "DNETMAP",
+		.family     = NFPROTO_IPV6,
+		.target     = dnetmap_tg,
+		.targetsize = sizeof(struct xt_DNETMAP_tginfo),
+		.table      = "nat",
+		.hooks      = (1 << NF_INET_POST_ROUTING) | (1 << NF_INET_LOCAL_OUT) |
+		              (1 << NF_INET_PRE_ROUTING),
+		.checkentry = dnetmap_tg_check,
+		.destroy    = dnetmap_tg_destroy,
+		.me         = THIS_MODULE
+	},
 };
 
 static int __init dnetmap_tg_init(void)
 {
 	int err;
 
-	/* verify parameters */
-	if (ffs(hash_size) != fls(hash_size) || hash_size <= 0) {
-		pr_info("bad hash_size parameter value - using defaults");
-		hash_size = default_hash_size;
-	}
-
 	jtimeout = default_ttl * HZ;
+	get_random_bytes(&dnetmap_seed, sizeof(dnetmap_seed));
+
+#if !IS_ENABLED(CONFIG_CONNECTOR)
+	if (nl_multicast_group != -1)
+		pr_info("CONFIG_CONNECTOR not present; "
+		        "netlink events disabled\n");
+#endif
+
+	dnetmap_cachep = KMEM_CACHE(dnetmap_entry, 0);
+	if (dnetmap_cachep == NULL)
+		return -ENOMEM;
+
+	err = dnetmap_nl_init();
+	if (err)
+		goto out_cache;
 
 	err = register_pernet_subsys(&dnetmap_net_ops);
 	if (err)
-		return err;
+		goto out_nl;
 
-	err = xt_register_target(&dnetmap_tg_reg);
+	err = xt_register_targets(dnetmap_tg_reg, ARRAY_SIZE(dnetmap_tg_reg));
 	if (err)
-		unregister_pernet_subsys(&dnetmap_net_ops);
+		goto out_pernet;
 
 	printk( KERN_INFO KBUILD_MODNAME " INIT successfull (version %d)\n", DNETMAP_VERSION );
 
+	return 0;
+
+ out_pernet:
+	unregister_pernet_subsys(&dnetmap_net_ops);
+ out_nl:
+	dnetmap_nl_exit();
+ out_cache:
+	rcu_barrier();
+	kmem_cache_destroy(dnetmap_cachep);
 	return err;
 }
 
 static void __exit dnetmap_tg_exit(void)
 {
-	xt_unregister_target(&dnetmap_tg_reg);
+	xt_unregister_targets(dnetmap_tg_reg, ARRAY_SIZE(dnetmap_tg_reg));
 	unregister_pernet_subsys(&dnetmap_net_ops);
+	dnetmap_nl_exit();
+	/* wait for entries still queued by call_rcu */
+	rcu_barrier();
+	kmem_cache_destroy(dnetmap_cachep);
 }
 
 module_init(dnetmap_tg_init);
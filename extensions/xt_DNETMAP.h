@@ -18,4 +18,46 @@ struct xt_DNETMAP_tginfo {
 	__s32 ttl;
 };
 
+/*
+ * Record format of /proc/net/xt_DNETMAP/<prefix>_state, which is read to
+ * dump and written to restore the bindings of a prefix. Host byte order,
+ * except for the addresses; IPv4 addresses use the first word.
+ *
+ * @ttl:	seconds until the binding expires, not used for static ones
+ * @flags:	XT_DNETMAP_STATIC or 0
+ */
+struct xt_DNETMAP_binding {
+	union nf_inet_addr prenat_addr, postnat_addr;
+	__s32 ttl;
+	__u8 flags;
+	__u8 __pad[3];
+};
+
+enum {
+	XT_DNETMAP_EVENT_BIND = 1,
+	XT_DNETMAP_EVENT_UNBIND,
+};
+
+/* events per netlink message at most */
+#define XT_DNETMAP_NL_BATCH_MAX 64
+
+/*
+ * Binding event, multicast through the kernel connector to the group given
+ * by the nl_multicast_group module parameter; a message carries one or more
+ * records. Host byte order, except for the addresses.
+ *
+ * @time:	wall-clock time of the event, nanoseconds since the epoch
+ * @type:	XT_DNETMAP_EVENT_*
+ * @family:	NFPROTO_IPV4 or NFPROTO_IPV6
+ * @flags:	XT_DNETMAP_STATIC or 0
+ */
+struct xt_DNETMAP_event {
+	__u64 time;
+	union nf_inet_addr prenat_addr, postnat_addr;
+	__u8 type;
+	__u8 family;
+	__u8 flags;
+	__u8 __pad[5];
+};
+
 #endif
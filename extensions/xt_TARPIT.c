@@ -38,10 +38,21 @@
  * - Reply to TCP !SYN,!RST,!FIN with ACK, window 0 bytes, rate-limited
  */
 
+#include <linux/err.h>
 #include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/spinlock.h>
 #include <linux/version.h>
+#include <linux/netfilter.h>
 #include <linux/netfilter_ipv6.h>
 #include <linux/netfilter/x_tables.h>
 #ifdef CONFIG_BRIDGE_NETFILTER
@@ -52,6 +63,7 @@
 #include <net/ip6_route.h>
 #include <net/ipv6.h>
 #include <net/route.h>
+#include <net/netns/generic.h>
 #include <net/tcp.h>
 #include "compat_xtables.h"
 #include "xt_TARPIT.h"
@@ -59,6 +71,87 @@
 #	define WITH_IPV6 1
 #endif
 
+/*
+ * Rate-limited rules use a limiter named by --limit-name, shared by all rules
+ * of a namespace and family with that name, and kept as long as one of them
+ * exists. Since a ruleset change adds the new rules before it deletes the
+ * old ones, buckets survive iptables -A/-D and iptables-restore. All rules
+ * of a limiter must have the same rates and bursts, so changing them takes
+ * a new name.
+ *
+ * A limiter tracks up to source_table_size sources, in sets of TARPIT_WAYS
+ * entries selected by a hash of the address. Each set has its own lock and
+ * replaces its least recently seen source when full. The --total-rate budget
+ * is one bucket with its own lock, only taken for replies that passed the
+ * per-source limit.
+ */
+static unsigned int source_table_size = 4096;
+module_param(source_table_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(source_table_size, "number of sources tracked per limiter, "
+		 "used for new limiters (default: 4096)");
+
+#define TARPIT_WAYS		4
+#define TARPIT_MAX_SOURCES	(1U << 22)
+
+/* Token bucket; a reply costs HZ credits, each jiffy adds rate credits. */
+struct tarpit_bucket {
+	unsigned long stamp;
+	u64 credit;
+};
+
+struct tarpit_source {
+	union nf_inet_addr addr;
+	struct tarpit_bucket bucket;
+	bool used;
+};
+
+struct tarpit_set {
+	spinlock_t lock;
+	struct tarpit_source way[TARPIT_WAYS];
+};
+
+/*
+ * @rate:	replies per second, 0 if unlimited
+ * @cap:	credits of a full bucket
+ * @fill:	jiffies after which an idle bucket is full
+ */
+struct tarpit_rate {
+	u32 rate;
+	u64 cap;
+	unsigned long fill;
+};
+
+/*
+ * @refcnt:	rules using the limiter, protected by tarpit_limit_mutex
+ * @src, @total:	limits, the same for all rules using the limiter
+ */
+struct xt_tarpit_limit {
+	struct list_head list;
+	char name[XT_TARPIT_NAME_LEN];
+	u_int8_t family;
+	unsigned int refcnt;
+	u32 seed;
+	unsigned int set_mask;
+	struct tarpit_rate src, total;
+	spinlock_t total_lock;
+	struct tarpit_bucket total_bucket;
+	struct tarpit_set set[];
+};
+
+/* limiters go away with the rules that use them, so no net exit is needed */
+struct tarpit_net {
+	struct list_head limits;
+};
+
+static int tarpit_net_id;
+static DEFINE_MUTEX(tarpit_limit_mutex);
+
+struct tarpit_stats {
+	u64 replies, src_suppressed, total_suppressed, evictions;
+};
+
+static struct tarpit_stats __percpu *tarpit_stats;
+
 static bool xttarpit_tarpit(struct tcphdr *tcph, const struct tcphdr *oth)
 {
 	/* No replies for RST, FIN or !SYN,!ACK */
@@ -76,13 +169,6 @@ static bool xttarpit_tarpit(struct tcphdr *tcph, const struct tcphdr *oth)
 		tcph->ack     = true;
 		tcph->ack_seq = htonl(ntohl(oth->seq) + oth->syn);
 	}
-#if 0
-	/* Rate-limit replies to !SYN,ACKs */
-	if (!oth->syn && oth->ack)
-		if (!xrlim_allow(&ort->dst, HZ))
-			return false;
-#endif
-
 	return true;
 }
 
@@ -170,16 +256,111 @@ static bool tarpit_generic(struct tcphdr *tcph, const struct tcphdr *oth,
 	return true;
 }
 
+static inline struct tarpit_net *tarpit_pernet(struct net *net)
+{
+	return net_generic(net, tarpit_net_id);
+}
+
+/*
+ * Refill @b for the jiffies since its last use and take one reply's worth
+ * of credits.
+ */
+static bool tarpit_bucket_take(struct tarpit_bucket *b, unsigned long now,
+    const struct tarpit_rate *r)
+{
+	unsigned long elapsed = now - b->stamp;
+	u64 cap = r->cap;
+
+	b->stamp = now;
+	if (elapsed >= r->fill)
+		b->credit = cap;
+	else
+		b->credit = min(cap, b->credit + (u64)elapsed * r->rate);
+	if (b->credit < HZ)
+		return false;
+	b->credit -= HZ;
+	return true;
+}
+
+static bool tarpit_source_take(struct xt_tarpit_limit *limit,
+    const union nf_inet_addr *addr, unsigned long now)
+{
+	struct tarpit_set *set;
+	struct tarpit_source *src, *victim = NULL;
+	unsigned int i;
+	bool ret;
+
+	set = &limit->set[jhash2(addr->all, ARRAY_SIZE(addr->all),
+	      limit->seed) & limit->set_mask];
+	spin_lock(&set->lock);
+	for (i = 0; i < TARPIT_WAYS; ++i) {
+		src = &set->way[i];
+		if (!src->used) {
+			if (victim == NULL || victim->used)
+				victim = src;
+			continue;
+		}
+		if (nf_inet_addr_cmp(&src->addr, addr))
+			goto found;
+		if (victim == NULL || (victim->used &&
+		    time_before(src->bucket.stamp, victim->bucket.stamp)))
+			victim = src;
+	}
+	src = victim;
+	if (src->used)
+		this_cpu_inc(tarpit_stats->evictions);
+	src->used = true;
+	src->addr = *addr;
+	src->bucket.stamp  = now;
+	src->bucket.credit = limit->src.cap;
+ found:
+	ret = tarpit_bucket_take(&src->bucket, now, &limit->src);
+	spin_unlock(&set->lock);
+	return ret;
+}
+
+/*
+ * Decide whether a reply to @saddr may be sent. Called with BHs disabled.
+ */
+static bool tarpit_allow(struct xt_tarpit_limit *limit,
+    const union nf_inet_addr *saddr)
+{
+	unsigned long now = jiffies;
+	bool ret;
+
+	if (limit == NULL)
+		goto allow;
+	if (limit->src.rate != 0 &&
+	    !tarpit_source_take(limit, saddr, now)) {
+		this_cpu_inc(tarpit_stats->src_suppressed);
+		return false;
+	}
+	if (limit->total.rate != 0) {
+		spin_lock(&limit->total_lock);
+		ret = tarpit_bucket_take(&limit->total_bucket, now,
+		      &limit->total);
+		spin_unlock(&limit->total_lock);
+		if (!ret) {
+			this_cpu_inc(tarpit_stats->total_suppressed);
+			return false;
+		}
+	}
+ allow:
+	this_cpu_inc(tarpit_stats->replies);
+	return true;
+}
+
 static void tarpit_tcp4(struct net *net, struct sk_buff *oldskb,
-    unsigned int hook, unsigned int mode)
+    unsigned int hook, unsigned int mode, struct xt_tarpit_limit *limit)
 {
+	union nf_inet_addr saddr = {};
 	struct tcphdr _otcph, *tcph;
 	const struct tcphdr *oth;
 	unsigned int addr_type = RTN_UNSPEC;
 	struct sk_buff *nskb;
 	const struct iphdr *oldhdr;
 	struct iphdr *niph;
-	uint16_t tmp, payload;
+	uint16_t payload;
 
 	/* A truncated TCP header is not going to be useful */
 	if (oldskb->len < ip_hdrlen(oldskb) + sizeof(struct tcphdr))
@@ -195,42 +376,43 @@ static void tarpit_tcp4(struct net *net, struct sk_buff *oldskb,
 		return;
 
 	/*
-	 * Copy skb (even if skb is about to be dropped, we cannot just
-	 * clone it because there may be other things, such as tcpdump,
-	 * interested in it)
+	 * Build the reply from the headers only. The payload of the
+	 * original packet is never part of the reply, so there is no
+	 * point in copying it.
 	 */
-	nskb = skb_copy_expand(oldskb, LL_MAX_HEADER,
-	                       skb_tailroom(oldskb), GFP_ATOMIC);
+	nskb = alloc_skb(LL_MAX_HEADER + sizeof(struct iphdr) +
+	                 sizeof(struct tcphdr), GFP_ATOMIC);
 	if (nskb == NULL)
 		return;
 
-	/* This packet will not be the same as the other: clear nf fields */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
-	nf_reset_ct(nskb);
-#else
-	nf_reset(nskb);
-#endif
-	skb_nfmark(nskb) = 0;
-	skb_init_secmark(nskb);
-	skb_shinfo(nskb)->gso_size = 0;
-	skb_shinfo(nskb)->gso_segs = 0;
-	skb_shinfo(nskb)->gso_type = 0;
+	skb_reserve(nskb, LL_MAX_HEADER);
+	nskb->protocol = htons(ETH_P_IP);
+	/* ip_route_me_harder expects skb->dst to be set */
+	skb_dst_set_noref(nskb, skb_dst(oldskb));
+
 	oldhdr = ip_hdr(oldskb);
-	tcph = (struct tcphdr *)(skb_network_header(nskb) + ip_hdrlen(nskb));
+	skb_reset_network_header(nskb);
+	niph = skb_put_zero(nskb, sizeof(struct iphdr));
+	/* no options, whatever the original packet carried */
+	niph->version  = 4;
+	niph->ihl      = sizeof(struct iphdr) / 4;
+	niph->tos      = oldhdr->tos;
+	niph->protocol = IPPROTO_TCP;
+	skb_set_transport_header(nskb, sizeof(struct iphdr));
+	tcph = skb_put(nskb, sizeof(struct tcphdr));
+	memcpy(tcph, oth, sizeof(struct tcphdr));
 
 	/* Swap source and dest */
-	niph         = ip_hdr(nskb);
-	niph->daddr  = xchg(&niph->saddr, niph->daddr);
-	tmp          = tcph->source;
-	tcph->source = tcph->dest;
-	tcph->dest   = tmp;
+	niph->daddr  = oldhdr->saddr;
+	niph->saddr  = oldhdr->daddr;
+	tcph->source = oth->dest;
+	tcph->dest   = oth->source;
 
 	/* Calculate payload size?? */
-	payload = nskb->len - ip_hdrlen(nskb) - sizeof(struct tcphdr);
+	payload = oldskb->len - ip_hdrlen(oldskb) - sizeof(struct tcphdr);
 
-	/* Truncate to length (no data) */
+	/* No data */
 	tcph->doff    = sizeof(struct tcphdr) / 4;
-	skb_trim(nskb, ip_hdrlen(nskb) + sizeof(struct tcphdr));
 	niph->tot_len = htons(nskb->len);
 	tcph->urg_ptr = 0;
 	/* Reset flags */
@@ -238,6 +420,9 @@ static void tarpit_tcp4(struct net *net, struct sk_buff *oldskb,
 
 	if (!tarpit_generic(tcph, oth, payload, mode))
 		goto free_nskb;
+	saddr.ip = oldhdr->saddr;
+	if (!tarpit_allow(limit, &saddr))
+		goto free_nskb;
 
 	/* Adjust TCP checksum */
 	tcph->check = 0;
@@ -254,11 +439,11 @@ static void tarpit_tcp4(struct net *net, struct sk_buff *oldskb,
 
 #ifdef CONFIG_BRIDGE_NETFILTER
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
-	if (hook != NF_INET_FORWARD || ((struct nf_bridge_info *)skb_ext_find(nskb, SKB_EXT_BRIDGE_NF) != NULL &&
-	    ((struct nf_bridge_info *)skb_ext_find(nskb, SKB_EXT_BRIDGE_NF))->physoutdev))
+	if (hook != NF_INET_FORWARD || ((struct nf_bridge_info *)skb_ext_find(oldskb, SKB_EXT_BRIDGE_NF) != NULL &&
+	    ((struct nf_bridge_info *)skb_ext_find(oldskb, SKB_EXT_BRIDGE_NF))->physoutdev))
 #else
-	if (hook != NF_INET_FORWARD || (nskb->nf_bridge != NULL &&
-	    nskb->nf_bridge->physoutdev != NULL))
+	if (hook != NF_INET_FORWARD || (oldskb->nf_bridge != NULL &&
+	    oldskb->nf_bridge->physoutdev != NULL))
 #endif
 #else
 	if (hook != NF_INET_FORWARD)
@@ -297,7 +482,7 @@ static void tarpit_tcp4(struct net *net, struct sk_buff *oldskb,
 
 #ifdef WITH_IPV6
 static void tarpit_tcp6(struct net *net, struct sk_buff *oldskb,
-    unsigned int hook, unsigned int mode)
+    unsigned int hook, unsigned int mode, struct xt_tarpit_limit *limit)
 {
 	struct sk_buff *nskb;
 	struct tcphdr *tcph, oth;
@@ -334,34 +519,30 @@ static void tarpit_tcp6(struct net *net, struct sk_buff *oldskb,
 		return;
 	}
 
-	/* Check checksum. */
-	if (csum_ipv6_magic(&oip6h->saddr, &oip6h->daddr, otcplen, IPPROTO_TCP,
+	/* Check checksum, unless the device already did. */
+	if (!skb_csum_unnecessary(oldskb) &&
+	    csum_ipv6_magic(&oip6h->saddr, &oip6h->daddr, otcplen, IPPROTO_TCP,
 	    skb_checksum(oldskb, tcphoff, otcplen, 0))) {
 		pr_debug("TCP checksum is invalid\n");
 		return;
 	}
 
-	nskb = skb_copy_expand(oldskb, LL_MAX_HEADER,
-	       skb_tailroom(oldskb), GFP_ATOMIC);
+	/* Headers only, see tarpit_tcp4 */
+	nskb = alloc_skb(LL_MAX_HEADER + sizeof(struct ipv6hdr) +
+	                 sizeof(struct tcphdr), GFP_ATOMIC);
 	if (nskb == NULL) {
 		if (net_ratelimit())
 			pr_debug("cannot alloc skb\n");
 		return;
 	}
 
-	/* This packet will not be the same as the other: clear nf fields */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
-	nf_reset_ct(nskb);
-#else
-	nf_reset(nskb);
-#endif
-	skb_nfmark(nskb) = 0;
-	skb_init_secmark(nskb);
-	skb_shinfo(nskb)->gso_size = 0;
-	skb_shinfo(nskb)->gso_segs = 0;
-	skb_shinfo(nskb)->gso_type = 0;
-	skb_put(nskb, sizeof(struct ipv6hdr));
-	ip6h = ipv6_hdr(nskb);
+	skb_reserve(nskb, LL_MAX_HEADER);
+	nskb->protocol = htons(ETH_P_IPV6);
+	/* ip6_route_me_harder expects skb->dst to be set */
+	skb_dst_set_noref(nskb, skb_dst(oldskb));
+
+	skb_reset_network_header(nskb);
+	ip6h = skb_put(nskb, sizeof(struct ipv6hdr));
 	*(__be32 *)ip6h =  htonl(0x60000000 | (tclass << 20));
 	ip6h->nexthdr = IPPROTO_TCP;
 	ip6h->saddr = oip6h->daddr;
@@ -374,11 +555,11 @@ static void tarpit_tcp6(struct net *net, struct sk_buff *oldskb,
 		ip6h->hop_limit = ip6_dst_hoplimit(skb_dst(nskb));
 	}
 
-	tcph = (struct tcphdr *)(skb_network_header(nskb) +
-	       sizeof(struct ipv6hdr));
+	skb_set_transport_header(nskb, sizeof(struct ipv6hdr));
+	tcph = skb_put(nskb, sizeof(struct tcphdr));
+	memcpy(tcph, &oth, sizeof(struct tcphdr));
 
-	/* Truncate to length (no data) */
-	skb_trim(nskb, sizeof(struct ipv6hdr) + sizeof(struct tcphdr));
+	/* No data */
 	tcph->doff    = sizeof(struct tcphdr)/4;
 	tcph->source  = oth.dest;
 	tcph->dest    = oth.source;
@@ -386,8 +567,10 @@ static void tarpit_tcp6(struct net *net, struct sk_buff *oldskb,
 	/* Reset flags */
 	((uint8_t *)tcph)[13] = 0;
 
-	payload = nskb->len - sizeof(struct ipv6hdr) - sizeof(struct tcphdr);
-	if (!tarpit_generic(&oth, tcph, payload, mode))
+	payload = otcplen - sizeof(struct tcphdr);
+	if (!tarpit_generic(tcph, &oth, payload, mode))
+		goto free_nskb;
+	if (!tarpit_allow(limit, (const union nf_inet_addr *)&oip6h->saddr))
 		goto free_nskb;
 
 	ip6h->payload_len = htons(sizeof(struct tcphdr));
@@ -413,6 +596,15 @@ static void tarpit_tcp6(struct net *net, struct sk_buff *oldskb,
 }
 #endif
 
+/* Revision 0 and 1 share variant, only revision 1 has limits. */
+static inline struct xt_tarpit_limit *
+tarpit_limit(const struct xt_action_param *par)
+{
+	const struct xt_tarpit_tginfo1 *info = par->targinfo;
+
+	return (par->target->revision >= 1) ? info->limit : NULL;
+}
+
 static unsigned int
 tarpit_tg4(struct sk_buff *skb, const struct xt_action_param *par)
 {
@@ -443,7 +635,8 @@ tarpit_tg4(struct sk_buff *skb, const struct xt_action_param *par)
 	/* We are not interested in fragments */
 	if (iph->frag_off & htons(IP_OFFSET))
 		return NF_DROP;
-	tarpit_tcp4(par_net(par), skb, par->state->hook, info->variant);
+	tarpit_tcp4(par_net(par), skb, par->state->hook, info->variant,
+	            tarpit_limit(par));
 	return NF_DROP;
 }
 
@@ -484,11 +677,119 @@ tarpit_tg6(struct sk_buff *skb, const struct xt_action_param *par)
 		pr_debug("addr is not unicast.\n");
 		return NF_DROP;
 	}
-	tarpit_tcp6(par_net(par), skb, par->state->hook, info->variant);
+	tarpit_tcp6(par_net(par), skb, par->state->hook, info->variant,
+	            tarpit_limit(par));
 	return NF_DROP;
 }
 #endif
 
+static void tarpit_rate_set(struct tarpit_rate *r, u32 rate, u32 burst)
+{
+	r->rate = rate;
+	r->cap  = (u64)max(burst, 1U) * HZ;
+	r->fill = (rate != 0) ? div_u64(r->cap, rate) + 1 : 0;
+}
+
+static bool tarpit_rate_equal(const struct tarpit_rate *r, u32 rate,
+    u32 burst)
+{
+	if (r->rate != rate)
+		return false;
+	return rate == 0 || r->cap == (u64)max(burst, 1U) * HZ;
+}
+
+static struct xt_tarpit_limit *
+tarpit_limit_get(struct net *net, const struct xt_tarpit_tginfo1 *info,
+    u_int8_t family)
+{
+	struct tarpit_net *tn = tarpit_pernet(net);
+	struct xt_tarpit_limit *limit;
+	unsigned int sets, i;
+
+	mutex_lock(&tarpit_limit_mutex);
+	list_for_each_entry(limit, &tn->limits, list) {
+		if (limit->family != family ||
+		    strcmp(limit->name, info->name) != 0)
+			continue;
+		/* Rules sharing a limiter must agree on its limits. */
+		if (!tarpit_rate_equal(&limit->src, info->src_rate,
+		    info->src_burst) ||
+		    !tarpit_rate_equal(&limit->total, info->total_rate,
+		    info->total_burst)) {
+			pr_info("xt_TARPIT: limiter \"%s\" is already in use "
+			        "with other rates\n", info->name);
+			limit = ERR_PTR(-EINVAL);
+			goto out;
+		}
+		++limit->refcnt;
+		goto out;
+	}
+
+	sets = roundup_pow_of_two(DIV_ROUND_UP(clamp_t(unsigned int,
+	       READ_ONCE(source_table_size), TARPIT_WAYS, TARPIT_MAX_SOURCES),
+	       TARPIT_WAYS));
+	limit = kvzalloc(sizeof(*limit) + sets * sizeof(*limit->set),
+	        GFP_KERNEL);
+	if (limit == NULL) {
+		limit = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	memcpy(limit->name, info->name, sizeof(limit->name));
+	limit->family = family;
+	limit->refcnt = 1;
+	get_random_bytes(&limit->seed, sizeof(limit->seed));
+	limit->set_mask = sets - 1;
+	tarpit_rate_set(&limit->src, info->src_rate, info->src_burst);
+	tarpit_rate_set(&limit->total, info->total_rate, info->total_burst);
+	for (i = 0; i < sets; ++i)
+		spin_lock_init(&limit->set[i].lock);
+	spin_lock_init(&limit->total_lock);
+	limit->total_bucket.stamp  = jiffies;
+	limit->total_bucket.credit = (u64)max(info->total_burst, 1U) * HZ;
+	list_add(&limit->list, &tn->limits);
+ out:
+	mutex_unlock(&tarpit_limit_mutex);
+	return limit;
+}
+
+static void tarpit_limit_put(struct xt_tarpit_limit *limit)
+{
+	mutex_lock(&tarpit_limit_mutex);
+	if (--limit->refcnt == 0) {
+		list_del(&limit->list);
+		kvfree(limit);
+	}
+	mutex_unlock(&tarpit_limit_mutex);
+}
+
+static int tarpit_tg_check(const struct xt_tgchk_param *par)
+{
+	struct xt_tarpit_tginfo1 *info = par->targinfo;
+	struct xt_tarpit_limit *limit;
+
+	if (info->variant > XTTARPIT_RESET)
+		return -EINVAL;
+	info->limit = NULL;
+	if (info->src_rate == 0 && info->total_rate == 0)
+		return 0;
+	if (info->name[0] == '\0' ||
+	    info->name[sizeof(info->name)-1] != '\0')
+		return -EINVAL;
+	limit = tarpit_limit_get(par->net, info, par->family);
+	if (IS_ERR(limit))
+		return PTR_ERR(limit);
+	info->limit = limit;
+	return 0;
+}
+
+static void tarpit_tg_destroy(const struct xt_tgdtor_param *par)
+{
+	const struct xt_tarpit_tginfo1 *info = par->targinfo;
+
+	if (info->limit != NULL)
+		tarpit_limit_put(info->limit);
+}
+
 static struct xt_target tarpit_tg_reg[] __read_mostly = {
 	{
 		.name       = "TARPIT",
@@ -500,6 +801,18 @@ static struct xt_target tarpit_tg_reg[] __read_mostly = {
 		.targetsize = sizeof(struct xt_tarpit_tginfo),
 		.me         = THIS_MODULE,
 	},
+	{
+		.name       = "TARPIT",
+		.revision   = 1,
+		.family     = NFPROTO_IPV4,
+		.hooks      = (1 << NF_INET_LOCAL_IN) | (1 << NF_INET_FORWARD),
+		.proto      = IPPROTO_TCP,
+		.target     = tarpit_tg4,
+		.checkentry = tarpit_tg_check,
+		.destroy    = tarpit_tg_destroy,
+		.targetsize = sizeof(struct xt_tarpit_tginfo1),
+		.me         = THIS_MODULE,
+	},
 #ifdef WITH_IPV6
 	{
 		.name       = "TARPIT",
@@ -511,17 +824,99 @@ static struct xt_target tarpit_tg_reg[] __read_mostly = {
 		.targetsize = sizeof(struct xt_tarpit_tginfo),
 		.me         = THIS_MODULE,
 	},
+	{
+		.name       = "TARPIT",
+		.revision   = 1,
+		.family     = NFPROTO_IPV6,
+		.hooks      = (1 << NF_INET_LOCAL_IN) | (1 << NF_INET_FORWARD),
+		.proto      = IPPROTO_TCP,
+		.target     = tarpit_tg6,
+		.checkentry = tarpit_tg_check,
+		.destroy    = tarpit_tg_destroy,
+		.targetsize = sizeof(struct xt_tarpit_tginfo1),
+		.me         = THIS_MODULE,
+	},
 #endif
 };
 
+static int tarpit_stat_proc_show(struct seq_file *m, void *data)
+{
+	struct tarpit_stats sum = {};
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct tarpit_stats *st = per_cpu_ptr(tarpit_stats, cpu);
+
+		sum.replies          += st->replies;
+		sum.src_suppressed   += st->src_suppressed;
+		sum.total_suppressed += st->total_suppressed;
+		sum.evictions        += st->evictions;
+	}
+	seq_printf(m, "replies %llu\nsuppressed_source %llu\n"
+	           "suppressed_total %llu\nevictions %llu\n", sum.replies,
+	           sum.src_suppressed, sum.total_suppressed, sum.evictions);
+	return 0;
+}
+
+static int tarpit_stat_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tarpit_stat_proc_show, NULL);
+}
+
+static const struct proc_ops tarpit_stat_proc_fops = {
+	.proc_open    = tarpit_stat_proc_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
+
+static int __net_init tarpit_net_init(struct net *net)
+{
+	INIT_LIST_HEAD(&tarpit_pernet(net)->limits);
+	return 0;
+}
+
+static struct pernet_operations tarpit_net_ops = {
+	.init   = tarpit_net_init,
+	.id     = &tarpit_net_id,
+	.size   = sizeof(struct tarpit_net),
+};
+
 static int __init tarpit_tg_init(void)
 {
-	return xt_register_targets(tarpit_tg_reg, ARRAY_SIZE(tarpit_tg_reg));
+	int ret;
+
+	tarpit_stats = alloc_percpu(struct tarpit_stats);
+	if (tarpit_stats == NULL)
+		return -ENOMEM;
+	if (proc_create("xt_TARPIT", S_IRUGO, init_net.proc_net,
+	    &tarpit_stat_proc_fops) == NULL) {
+		ret = -ENOMEM;
+		goto out_stats;
+	}
+	ret = register_pernet_subsys(&tarpit_net_ops);
+	if (ret != 0)
+		goto out_proc;
+	ret = xt_register_targets(tarpit_tg_reg, ARRAY_SIZE(tarpit_tg_reg));
+	if (ret < 0)
+		goto out_pernet;
+	return 0;
+
+ out_pernet:
+	unregister_pernet_subsys(&tarpit_net_ops);
+ out_proc:
+	remove_proc_entry("xt_TARPIT", init_net.proc_net);
+ out_stats:
+	free_percpu(tarpit_stats);
+	return ret;
 }
 
 static void __exit tarpit_tg_exit(void)
 {
 	xt_unregister_targets(tarpit_tg_reg, ARRAY_SIZE(tarpit_tg_reg));
+	unregister_pernet_subsys(&tarpit_net_ops);
+	remove_proc_entry("xt_TARPIT", init_net.proc_net);
+	free_percpu(tarpit_stats);
 }
 
 module_init(tarpit_tg_init);
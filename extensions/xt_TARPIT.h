@@ -1,6 +1,8 @@
 #ifndef _LINUX_NETFILTER_XT_TARPIT_H
 #define _LINUX_NETFILTER_XT_TARPIT_H 1
 
+#define XT_TARPIT_NAME_LEN 16
+
 enum xt_tarpit_target_variant {
 	XTTARPIT_TARPIT,
 	XTTARPIT_HONEYPOT,
@@ -11,4 +13,18 @@ struct xt_tarpit_tginfo {
 	uint8_t variant;
 };
 
+/*
+ * Rates are in replies per second, bursts in replies; a rate of 0 means no
+ * limit. Rules with the same @name share their limiter.
+ */
+struct xt_tarpit_tginfo1 {
+	uint8_t variant;
+	uint32_t src_rate, src_burst;
+	uint32_t total_rate, total_burst;
+	char name[XT_TARPIT_NAME_LEN];
+
+	/* Used internally by the kernel */
+	struct xt_tarpit_limit *limit __attribute__((aligned(8)));
+};
+
 #endif /* _LINUX_NETFILTER_XT_TARPIT_H */
@@ -13,10 +13,18 @@
  *	under the terms of the GNU General Public License; either version 2
  *	or 3 of the License, as published by the Free Software Foundation.
  */
+#include <linux/ctype.h>
+#include <linux/hashtable.h>
+#include <linux/idr.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/version.h>
@@ -50,36 +58,122 @@ MODULE_PARM_DESC(condition_gid_perms, "group owner of /proc/net/nf_condition/* f
 MODULE_ALIAS("ipt_condition");
 MODULE_ALIAS("ip6t_condition");
 
+#define CONDITION_HASH_BITS 8
+
+/**
+ * Values of all condition variables of a namespace, indexed by their slot.
+ * Single writes change a value in place; a batch through .all publishes a
+ * new copy, so that packets see either none or all of its changes.
+ */
+struct condition_values {
+	struct rcu_head rcu;
+	unsigned int size;
+	u32 value[];
+};
+
 struct condition_variable {
-	struct list_head list;
+	struct hlist_node node;
+	struct condition_net *cnet;
 	struct proc_dir_entry *status_proc;
 	unsigned int refcount;
-	bool enabled;
+	unsigned int slot;
 	char name[sizeof(((struct xt_condition_mtinfo *)NULL)->name)];
 };
 
 /* proc_lock is a user context only semaphore used for write access */
-/*           to the conditions' list.                               */
+/*           to the conditions' list and values.                    */
 static DEFINE_MUTEX(proc_lock);
 
 struct condition_net {
-	struct list_head conditions_list;
+	DECLARE_HASHTABLE(conditions_hash, CONDITION_HASH_BITS);
+	struct condition_values __rcu *values;
+	struct ida slots;
 	struct proc_dir_entry *proc_net_condition;
 	bool after_clear;
 };
 
 static int condition_net_id;
 
+/* reserved, condition names may not start with a dot */
+static const char condition_all_name[] = ".all";
+
 static inline struct condition_net *condition_pernet(struct net *net)
 {
 	return net_generic(net, condition_net_id);
 }
 
+static inline u32 condition_hash(const char *name)
+{
+	return jhash(name, strlen(name), 0);
+}
+
+/* Called with proc_lock held. */
+static struct condition_variable *
+condition_lookup(struct condition_net *cnet, const char *name)
+{
+	struct condition_variable *var;
+
+	hash_for_each_possible(cnet->conditions_hash, var, node,
+	                       condition_hash(name))
+		if (strcmp(var->name, name) == 0)
+			return var;
+	return NULL;
+}
+
+static inline struct condition_values *
+condition_values(struct condition_net *cnet)
+{
+	return rcu_dereference_protected(cnet->values,
+	       lockdep_is_held(&proc_lock));
+}
+
+/*
+ * Copy the values into a new array with room for at least @size slots.
+ * Called with proc_lock held.
+ */
+static struct condition_values *
+condition_values_copy(struct condition_net *cnet, unsigned int size)
+{
+	const struct condition_values *old = condition_values(cnet);
+	struct condition_values *cv;
+
+	if (old != NULL && size < old->size)
+		size = old->size;
+	cv = kvzalloc(sizeof(*cv) + size * sizeof(*cv->value), GFP_KERNEL);
+	if (cv == NULL)
+		return NULL;
+	cv->size = size;
+	if (old != NULL)
+		memcpy(cv->value, old->value, old->size * sizeof(*cv->value));
+	return cv;
+}
+
+static void condition_values_free_rcu(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct condition_values, rcu));
+}
+
+/* Called with proc_lock held. */
+static void
+condition_values_publish(struct condition_net *cnet,
+                         struct condition_values *cv)
+{
+	struct condition_values *old = condition_values(cnet);
+
+	rcu_assign_pointer(cnet->values, cv);
+	if (old != NULL)
+		call_rcu(&old->rcu, condition_values_free_rcu);
+}
+
 static int condition_proc_show(struct seq_file *m, void *data)
 {
 	const struct condition_variable *var = m->private;
+	u32 value;
 
-	seq_printf(m, var->enabled ? "1\n" : "0\n");
+	rcu_read_lock();
+	value = READ_ONCE(rcu_dereference(var->cnet->values)->value[var->slot]);
+	rcu_read_unlock();
+	seq_printf(m, "%u\n", value);
 	return 0;
 }
 
@@ -93,21 +187,24 @@ condition_proc_write(struct file *file, const char __user *buffer,
                      size_t length, loff_t *loff)
 {
 	struct condition_variable *var = PDE_DATA(file_inode(file));
-	char newval;
-
-	if (length > 0) {
-		if (get_user(newval, buffer) != 0)
-			return -EFAULT;
-		/* Match only on the first character */
-		switch (newval) {
-		case '0':
-			var->enabled = false;
-			break;
-		case '1':
-			var->enabled = true;
-			break;
-		}
+	char buf[16];
+	size_t len = min(length, sizeof(buf) - 1);
+	u32 newval;
+
+	if (length == 0)
+		return length;
+	if (copy_from_user(buf, buffer, len) != 0)
+		return -EFAULT;
+	buf[len] = '\0';
+	if (len != length || kstrtou32(buf, 0, &newval) != 0) {
+		/* Not a number: match only on the first character */
+		if (buf[0] != '0' && buf[0] != '1')
+			return length;
+		newval = buf[0] == '1';
 	}
+	mutex_lock(&proc_lock);
+	WRITE_ONCE(condition_values(var->cnet)->value[var->slot], newval);
+	mutex_unlock(&proc_lock);
 	return length;
 }
 
@@ -119,86 +216,224 @@ static const struct proc_ops condition_proc_fops = {
 	.proc_release = single_release,
 };
 
+/*
+ * /proc/net/nf_condition/.all lists all conditions of the namespace as
+ * "name value" lines. Writing such lines changes all of them at once: either
+ * every line is applied, in one step, or none is.
+ */
+static int condition_all_proc_show(struct seq_file *m, void *data)
+{
+	struct condition_net *cnet = m->private;
+	const struct condition_values *cv;
+	const struct condition_variable *var;
+	unsigned int bkt;
+
+	mutex_lock(&proc_lock);
+	cv = condition_values(cnet);
+	hash_for_each(cnet->conditions_hash, bkt, var, node)
+		seq_printf(m, "%s %u\n", var->name, cv->value[var->slot]);
+	mutex_unlock(&proc_lock);
+	return 0;
+}
+
+static int condition_all_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, condition_all_proc_show, PDE_DATA(inode));
+}
+
+static ssize_t
+condition_all_proc_write(struct file *file, const char __user *input,
+                         size_t length, loff_t *loff)
+{
+	struct condition_net *cnet = PDE_DATA(file_inode(file));
+	struct condition_variable *var;
+	struct condition_values *cv;
+	char *buf, *next, *line, *value;
+	u32 newval;
+	int ret = 0;
+
+	if (length > INT_MAX)
+		return -EFBIG;
+	buf = kvmalloc(length + 1, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+	if (copy_from_user(buf, input, length) != 0) {
+		kvfree(buf);
+		return -EFAULT;
+	}
+	buf[length] = '\0';
+
+	mutex_lock(&proc_lock);
+	cv = condition_values_copy(cnet, 0);
+	if (cv == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	next = buf;
+	while ((line = strsep(&next, "\n")) != NULL) {
+		line = skip_spaces(line);
+		if (*line == '\0')
+			continue;
+		value = line;
+		while (*value != '\0' && !isspace(*value))
+			++value;
+		if (*value != '\0')
+			*value++ = '\0';
+		value = strim(value);
+		if (kstrtou32(value, 0, &newval) != 0) {
+			ret = -EINVAL;
+			break;
+		}
+		var = condition_lookup(cnet, line);
+		if (var == NULL) {
+			ret = -ENOENT;
+			break;
+		}
+		cv->value[var->slot] = newval;
+	}
+	if (ret == 0)
+		condition_values_publish(cnet, cv);
+	else
+		kvfree(cv);
+ out:
+	mutex_unlock(&proc_lock);
+	kvfree(buf);
+	return (ret != 0) ? ret : length;
+}
+
+static const struct proc_ops condition_all_proc_fops = {
+	.proc_open    = condition_all_proc_open,
+	.proc_read    = seq_read,
+	.proc_write   = condition_all_proc_write,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
+
+static inline u32 condition_value(const struct condition_variable *var)
+{
+	const struct condition_values *cv = rcu_dereference(var->cnet->values);
+
+	return READ_ONCE(cv->value[var->slot]);
+}
+
 static bool
 condition_mt(const struct sk_buff *skb, struct xt_action_param *par)
 {
 	const struct xt_condition_mtinfo *info = par->matchinfo;
 	const struct condition_variable *var   = info->condvar;
 
-	return var->enabled ^ info->invert;
+	return (condition_value(var) != 0) ^ info->invert;
 }
 
-static int condition_mt_check(const struct xt_mtchk_param *par)
+static bool
+condition_mt2(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct xt_condition_mtinfo2 *info = par->matchinfo;
+	u32 value = condition_value(info->condvar);
+	bool ret;
+
+	switch (info->op) {
+	case XT_CONDITION_VALUE:
+		ret = (value & info->mask) == info->value;
+		break;
+	case XT_CONDITION_RANGE:
+		ret = value >= info->min && value <= info->max;
+		break;
+	default:
+		ret = value != 0;
+		break;
+	}
+	return ret ^ info->invert;
+}
+
+/*
+ * Look up the variable @name, creating it if needed, and take a reference.
+ */
+static struct condition_variable *
+condition_get(struct net *net, const char *name)
 {
-	struct xt_condition_mtinfo *info = par->matchinfo;
 	struct condition_variable *var;
-	struct condition_net *condition_net = condition_pernet(par->net);
+	struct condition_net *condition_net = condition_pernet(net);
+	struct condition_values *cv;
+	int slot;
 
 	/* Forbid certain names */
-	if (*info->name == '\0' || *info->name == '.' ||
-	    info->name[sizeof(info->name)-1] != '\0' ||
-	    memchr(info->name, '/', sizeof(info->name)) != NULL) {
+	if (*name == '\0' || *name == '.' ||
+	    name[CONDITION_NAME_LEN-1] != '\0' ||
+	    memchr(name, '/', CONDITION_NAME_LEN) != NULL) {
 		printk(KERN_INFO KBUILD_MODNAME ": name not allowed or too "
-		       "long: \"%.*s\"\n", (unsigned int)sizeof(info->name),
-		       info->name);
-		return -EINVAL;
+		       "long: \"%.*s\"\n", CONDITION_NAME_LEN, name);
+		return ERR_PTR(-EINVAL);
 	}
 	/*
 	 * Let's acquire the lock, check for the condition and add it
 	 * or increase the reference counter.
 	 */
 	mutex_lock(&proc_lock);
-	list_for_each_entry(var, &condition_net->conditions_list, list) {
-		if (strcmp(info->name, var->name) == 0) {
-			var->refcount++;
-			mutex_unlock(&proc_lock);
-			info->condvar = var;
-			return 0;
-		}
+	var = condition_lookup(condition_net, name);
+	if (var != NULL) {
+		var->refcount++;
+		mutex_unlock(&proc_lock);
+		return var;
 	}
 
 	/* At this point, we need to allocate a new condition variable. */
 	var = kmalloc(sizeof(struct condition_variable), GFP_KERNEL);
-	if (var == NULL) {
-		mutex_unlock(&proc_lock);
-		return -ENOMEM;
+	if (var == NULL)
+		goto err_unlock;
+	slot = ida_simple_get(&condition_net->slots, 0, 0, GFP_KERNEL);
+	if (slot < 0)
+		goto err_var;
+	cv = condition_values(condition_net);
+	if (slot >= cv->size) {
+		cv = condition_values_copy(condition_net, 2 * cv->size);
+		if (cv == NULL)
+			goto err_slot;
+		condition_values_publish(condition_net, cv);
 	}
+	/* a previous user of the slot may have left it set */
+	WRITE_ONCE(cv->value[slot], 0);
 
-	memcpy(var->name, info->name, sizeof(info->name));
+	memcpy(var->name, name, sizeof(var->name));
+	/* The proc file is usable as soon as it is created. */
+	var->cnet     = condition_net;
+	var->slot     = slot;
+	var->refcount = 1;
 	/* Create the condition variable's proc file entry. */
-	var->status_proc = proc_create_data(info->name, condition_list_perms,
+	var->status_proc = proc_create_data(var->name, condition_list_perms,
 	                   condition_net->proc_net_condition, &condition_proc_fops, var);
-	if (var->status_proc == NULL) {
-		kfree(var);
-		mutex_unlock(&proc_lock);
-		return -ENOMEM;
-	}
+	if (var->status_proc == NULL)
+		goto err_slot;
 
 	proc_set_user(var->status_proc,
 	              make_kuid(&init_user_ns, condition_uid_perms),
 	              make_kgid(&init_user_ns, condition_gid_perms));
-	var->refcount = 1;
-	var->enabled  = false;
-	wmb();
-	list_add(&var->list, &condition_net->conditions_list);
+	hash_add(condition_net->conditions_hash, &var->node,
+	         condition_hash(var->name));
 	mutex_unlock(&proc_lock);
-	info->condvar = var;
-	return 0;
+	return var;
+
+ err_slot:
+	ida_simple_remove(&condition_net->slots, slot);
+ err_var:
+	kfree(var);
+ err_unlock:
+	mutex_unlock(&proc_lock);
+	return ERR_PTR(-ENOMEM);
 }
 
-static void condition_mt_destroy(const struct xt_mtdtor_param *par)
+static void condition_put(struct net *net, struct condition_variable *var)
 {
-	const struct xt_condition_mtinfo *info = par->matchinfo;
-	struct condition_variable *var = info->condvar;
-	struct condition_net *cnet = condition_pernet(par->net);
+	struct condition_net *cnet = condition_pernet(net);
 
 	if (cnet->after_clear)
 		return;
 
 	mutex_lock(&proc_lock);
 	if (--var->refcount == 0) {
-		list_del(&var->list);
+		hash_del(&var->node);
 		remove_proc_entry(var->name, cnet->proc_net_condition);
+		ida_simple_remove(&cnet->slots, var->slot);
 		mutex_unlock(&proc_lock);
 		kfree(var);
 		return;
@@ -206,6 +441,47 @@ static void condition_mt_destroy(const struct xt_mtdtor_param *par)
 	mutex_unlock(&proc_lock);
 }
 
+static int condition_mt_check(const struct xt_mtchk_param *par)
+{
+	struct xt_condition_mtinfo *info = par->matchinfo;
+	struct condition_variable *var;
+
+	var = condition_get(par->net, info->name);
+	if (IS_ERR(var))
+		return PTR_ERR(var);
+	info->condvar = var;
+	return 0;
+}
+
+static int condition_mt_check2(const struct xt_mtchk_param *par)
+{
+	struct xt_condition_mtinfo2 *info = par->matchinfo;
+	struct condition_variable *var;
+
+	if (info->op > XT_CONDITION_RANGE ||
+	    (info->op == XT_CONDITION_RANGE && info->min > info->max))
+		return -EINVAL;
+	var = condition_get(par->net, info->name);
+	if (IS_ERR(var))
+		return PTR_ERR(var);
+	info->condvar = var;
+	return 0;
+}
+
+static void condition_mt_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct xt_condition_mtinfo *info = par->matchinfo;
+
+	condition_put(par->net, info->condvar);
+}
+
+static void condition_mt_destroy2(const struct xt_mtdtor_param *par)
+{
+	const struct xt_condition_mtinfo2 *info = par->matchinfo;
+
+	condition_put(par->net, info->condvar);
+}
+
 static struct xt_match condition_mt_reg[] __read_mostly = {
 	{
 		.name       = "condition",
@@ -227,6 +503,26 @@ static struct xt_match condition_mt_reg[] __read_mostly = {
 		.destroy    = condition_mt_destroy,
 		.me         = THIS_MODULE,
 	},
+	{
+		.name       = "condition",
+		.revision   = 2,
+		.family     = NFPROTO_IPV4,
+		.matchsize  = sizeof(struct xt_condition_mtinfo2),
+		.match      = condition_mt2,
+		.checkentry = condition_mt_check2,
+		.destroy    = condition_mt_destroy2,
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "condition",
+		.revision   = 2,
+		.family     = NFPROTO_IPV6,
+		.matchsize  = sizeof(struct xt_condition_mtinfo2),
+		.match      = condition_mt2,
+		.checkentry = condition_mt_check2,
+		.destroy    = condition_mt_destroy2,
+		.me         = THIS_MODULE,
+	},
 };
 
 static const char *const dir_name = "nf_condition";
@@ -234,28 +530,55 @@ static const char *const dir_name = "nf_condition";
 static int __net_init condition_net_init(struct net *net)
 {
 	struct condition_net *condition_net = condition_pernet(net);
-	INIT_LIST_HEAD(&condition_net->conditions_list);
+	struct condition_values *cv;
+	struct proc_dir_entry *p;
+
+	hash_init(condition_net->conditions_hash);
+	ida_init(&condition_net->slots);
+	cv = kvzalloc(sizeof(*cv) + 64 * sizeof(*cv->value), GFP_KERNEL);
+	if (cv == NULL)
+		return -ENOMEM;
+	cv->size = 64;
+	RCU_INIT_POINTER(condition_net->values, cv);
 	condition_net->proc_net_condition = proc_mkdir(dir_name, net->proc_net);
 	if (condition_net->proc_net_condition == NULL)
-		return -EACCES;
+		goto err;
+	p = proc_create_data(condition_all_name, condition_list_perms,
+	    condition_net->proc_net_condition, &condition_all_proc_fops,
+	    condition_net);
+	if (p == NULL) {
+		remove_proc_subtree(dir_name, net->proc_net);
+		goto err;
+	}
+	proc_set_user(p, make_kuid(&init_user_ns, condition_uid_perms),
+	              make_kgid(&init_user_ns, condition_gid_perms));
 	condition_net->after_clear = 0;
 	return 0;
+
+ err:
+	kvfree(cv);
+	return -EACCES;
 }
 
 static void __net_exit condition_net_exit(struct net *net)
 {
 	struct condition_net *condition_net = condition_pernet(net);
-	struct list_head *pos, *q;
 	struct condition_variable *var = NULL;
+	struct hlist_node *tmp;
+	unsigned int bkt;
 
 	remove_proc_subtree(dir_name, net->proc_net);
 	mutex_lock(&proc_lock);
-	list_for_each_safe(pos, q, &condition_net->conditions_list) {
-		var = list_entry(pos, struct condition_variable, list);
-		list_del(pos);
+	hash_for_each_safe(condition_net->conditions_hash, bkt, tmp, var, node) {
+		hash_del(&var->node);
 		kfree(var);
 	}
+	/* no packets of this namespace are left */
+	kvfree(rcu_dereference_protected(condition_net->values,
+	       lockdep_is_held(&proc_lock)));
+	RCU_INIT_POINTER(condition_net->values, NULL);
 	mutex_unlock(&proc_lock);
+	ida_destroy(&condition_net->slots);
 	condition_net->after_clear = true;
 }
 
@@ -289,6 +612,8 @@ static void __exit condition_mt_exit(void)
 {
 	xt_unregister_matches(condition_mt_reg, ARRAY_SIZE(condition_mt_reg));
 	unregister_pernet_subsys(&condition_net_ops);
+	/* wait for condition_values_free_rcu */
+	rcu_barrier();
 }
 
 module_init(condition_mt_init);
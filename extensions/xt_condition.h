@@ -13,4 +13,25 @@ struct xt_condition_mtinfo {
 	void *condvar __attribute__((aligned(8)));
 };
 
+enum {
+	XT_CONDITION_NONZERO = 0,
+	XT_CONDITION_VALUE,
+	XT_CONDITION_RANGE,
+};
+
+/*
+ * Revision 2 tests the integer value v of the variable:
+ * NONZERO: v != 0; VALUE: (v & mask) == value; RANGE: min <= v <= max.
+ */
+struct xt_condition_mtinfo2 {
+	char name[CONDITION_NAME_LEN];
+	__u8 invert;
+	__u8 op;
+	__u32 value, mask;
+	__u32 min, max;
+
+	/* Used internally by the kernel */
+	void *condvar __attribute__((aligned(8)));
+};
+
 #endif /* _XT_CONDITION_H */
@@ -21,16 +21,30 @@
 */
 
 #define pr_fmt(x) KBUILD_MODNAME ": " x
+#include <linux/jhash.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/tcp.h>
 #include <linux/spinlock.h>
-#include <linux/vmalloc.h>
+#include <linux/netfilter.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv6/ip6_tables.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 #include "xt_psd.h"
 #include "compat_xtables.h"
 
@@ -44,14 +58,34 @@ MODULE_ALIAS("ipt_psd");
 MODULE_ALIAS("ip6t_psd");
 
 /*
- * Keep track of up to LIST_SIZE source addresses, using a hash table of
- * PSD_HASH_SIZE entries for faster lookups, but limiting hash collisions to
- * HASH_MAX source addresses per the same hash value.
+ * Keep track of up to table_size source addresses per address family and
+ * network namespace. The table is split into PSD_SHARDS shards, each with its
+ * own lock and LRU list; a shard evicts its least recently updated source when
+ * full. Lookups run under RCU and only take the shard lock to change a
+ * source's state. The size can be changed per namespace in /proc/net/xt_psd.
  */
-#define LIST_SIZE			0x100
-#define HASH_LOG			9
-#define PSD_HASH_SIZE			(1 << HASH_LOG)
-#define HASH_MAX			0x10
+static unsigned int table_size = 4096;
+module_param(table_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(table_size, "maximum number of source addresses tracked per "
+		 "address family, default for new namespaces (default: 4096)");
+
+#define PSD_SHARDS			64
+#define PSD_MAX_HOSTS			(1U << 22)
+
+/*
+ * Horizontal scans are counted in two count-min sketches, one keyed by source
+ * network and one by destination port, whose cells are small HyperLogLog
+ * counters of distinct destinations and sources respectively. Each sketch
+ * has two generations of hscan_window seconds; estimates cover both.
+ */
+static unsigned int hscan_window = 60;
+module_param(hscan_window, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hscan_window, "seconds over which distinct destinations and "
+		 "sources are counted, 1-2 windows back (default: 60)");
+
+#define PSD_CM_ROWS			2
+#define PSD_CM_COLS			1024 /* must be <= 1 << (32 / PSD_CM_ROWS) */
+#define PSD_HLL_REGS			16
 
 #if defined(CONFIG_IP6_NF_IPTABLES) || defined(CONFIG_IP6_NF_IPTABLES_MODULE)
 #	define WITH_IPV6 1
@@ -67,119 +101,120 @@ struct port {
 
 /**
  * Information we keep per each source address.
- * @next:	next entry with the same hash
+ * @node:	hash chain, RCU-protected
+ * @lru:	position in the shard's LRU list
+ * @saddr:	source address; IPv4 uses the first word, the rest is zero
  * @timestamp:	last update time
  * @count:	number of ports in the list
  * @weight:	total weight of ports in the list
  */
 struct host {
-	struct host *next;
+	struct hlist_node node;
+	struct list_head lru;
+	struct rcu_head rcu;
+	union nf_inet_addr saddr;
 	unsigned long timestamp;
-	__be16 src_port;
 	uint16_t count;
 	uint8_t weight;
 	struct port ports[SCAN_MAX_COUNT-1];
 };
 
 /**
- * Information we keep per ipv4 source address.
+ * @lock:	protects the shard's hash chains, LRU list and hosts
+ * @lru:	hosts, least recently updated first
+ * @count:	number of hosts in the shard
+ * @evictions:	number of hosts dropped because the shard was full
  */
-struct host4 {
-	struct host host;
-	__be32 saddr;
-};
-
-static struct host4 *host_to_host4(const struct host *h)
-{
-	return (struct host4 *)h;
-}
+struct psd_shard {
+	spinlock_t lock;
+	struct list_head lru;
+	unsigned int count;
+	unsigned long evictions;
+} ____cacheline_aligned_in_smp;
 
-struct host6 {
-	struct host host;
-	struct in6_addr saddr;
+/**
+ * State information for portscan detection of one address family, allocated
+ * when the first rule is added and freed with the last one.
+ * @refcnt:	number of rules using the table
+ * @hash_mask:	number of hash buckets - 1; bucket i belongs to shard
+ * 		i % PSD_SHARDS. Fixed when the table is allocated.
+ * @shard_max:	maximum number of hosts per shard, may change at any time
+ * @hscan:	[0] destinations per source network, [1] sources per port;
+ * 		allocated for the first revision 2 rule that needs them
+ */
+struct psd_state {
+	unsigned int refcnt;
+	unsigned int hash_mask;
+	unsigned int shard_max;
+	struct psd_sketch *hscan;
+	struct psd_shard shard[PSD_SHARDS];
+	struct hlist_head hash[];
 };
 
 /**
- * State information for IPv4 portscan detection.
- * @list:	list of source addresses
- * @hash:	pointers into the list
- * @index:	oldest entry to be replaced
+ * @window:	length of a generation, in jiffies
+ * @epoch:	jiffies / window at the last update; selects the generation
+ * @reg:	HyperLogLog registers, by generation, row and column
  */
-static struct {
-	spinlock_t lock;
-	struct host4 list[LIST_SIZE];
-	struct host *hash[PSD_HASH_SIZE];
-	int index;
-} state;
+struct psd_sketch {
+	unsigned long window;
+	unsigned long epoch;
+	u8 reg[2][PSD_CM_ROWS][PSD_CM_COLS][PSD_HLL_REGS];
+};
 
-#ifdef WITH_IPV6
 /**
- * State information for IPv6 portscan detection.
- * @list:	list of source addresses
- * @hash:	pointers into the list
- * @index:	oldest entry to be replaced
+ * @state:	[0] for IPv4, [1] for IPv6
+ * @table_size:	size for the tables of this namespace
  */
-static struct {
-	spinlock_t lock;
-	struct host6 *list;
-	struct host **hash;
-	int index;
-} state6;
+struct psd_net {
+	struct psd_state *state[2];
+	unsigned int table_size;
+};
 
-static struct host6 *host_to_host6(const struct host *h)
+static int psd_net_id;
+/* protects the psd_net members */
+static DEFINE_MUTEX(psd_state_mutex);
+static u32 psd_seed __read_mostly, psd_hll_seed __read_mostly;
+
+static inline struct psd_net *psd_pernet(struct net *net)
 {
-	return (struct host6 *) h;
+	return net_generic(net, psd_net_id);
 }
 
-/**
- * allocate state6 memory only when needed
- */
-static bool state6_alloc_mem(void)
+static unsigned int psd_hash(const union nf_inet_addr *addr)
 {
-	if (state6.hash != NULL)
-		return true;
-
-	state6.list = vmalloc(LIST_SIZE * sizeof(struct host6));
-	if (state6.list == NULL)
-		return false;
-	memset(state6.list, 0, LIST_SIZE * sizeof(struct host6));
-	state6.hash = vmalloc(PSD_HASH_SIZE * sizeof(struct host *));
-	if (state6.hash == NULL) {
-		vfree(state6.list);
-		return false;
-	}
-	memset(state6.hash, 0, PSD_HASH_SIZE * sizeof(struct host *));
-	return true;
+	return jhash2(addr->all, ARRAY_SIZE(addr->all), psd_seed);
 }
-#endif
 
-/*
- * Convert an IP address into a hash table index.
- */
-static unsigned int hashfunc(__be32 addr)
+static struct host *
+psd_host_find(const struct hlist_head *head, const union nf_inet_addr *saddr)
 {
-	unsigned int value;
-	unsigned int hash;
-
-	value = addr;
-	hash = 0;
-	do {
-		hash ^= value;
-	} while ((value >>= HASH_LOG) != 0);
-	return hash & (PSD_HASH_SIZE - 1);
+	struct host *h;
+
+	hlist_for_each_entry_rcu(h, head, node)
+		if (nf_inet_addr_cmp(&h->saddr, saddr))
+			return h;
+	return NULL;
 }
 
-static inline unsigned int hashfunc6(const struct in6_addr *addr)
+/* Called with shard->lock held. */
+static void psd_host_free(struct psd_shard *shard, struct host *h)
 {
-	__be32 h = addr->s6_addr32[0] ^ addr->s6_addr32[1];
-	return hashfunc(h ^ addr->s6_addr32[2] ^ addr->s6_addr32[3]);
+	hlist_del_rcu(&h->node);
+	list_del(&h->lru);
+	--shard->count;
+	kfree_rcu(h, rcu);
 }
 
+/*
+ * May run without the shard lock: is_portscan fills in a port before it
+ * publishes the new count.
+ */
 static bool port_in_list(struct host *host, uint8_t proto, uint16_t port)
 {
-	unsigned int i;
+	unsigned int i, count = smp_load_acquire(&host->count);
 
-	for (i = 0; i < host->count; ++i) {
+	for (i = 0; i < count; ++i) {
 		if (host->ports[i].proto != proto)
 			continue;
 		if (host->ports[i].number == port)
@@ -207,7 +242,7 @@ is_portscan(struct host *host, const struct xt_psd_info *psdinfo,
 	if (proto == IPPROTO_TCP && (tcph->ack || tcph->rst))
 		return false;
 
-	host->timestamp = jiffies;
+	WRITE_ONCE(host->timestamp, jiffies);
 
 	if (host->weight >= psdinfo->weight_threshold) /* already matched */
 		return true;
@@ -223,53 +258,19 @@ is_portscan(struct host *host, const struct xt_psd_info *psdinfo,
 	if (host->count < ARRAY_SIZE(host->ports)) {
 		host->ports[host->count].number = tcph->dest;
 		host->ports[host->count].proto = proto;
-		host->count++;
+		smp_store_release(&host->count, host->count + 1);
 	}
 	return false;
 }
 
-static struct host *host_get_next(struct host *h, struct host **last)
-{
-	if (h->next != NULL)
-		*last = h;
-	return h->next;
-}
-
-static void ht_unlink(struct host **head, struct host *last)
-{
-	if (last != NULL)
-		last->next = last->next->next;
-	else if (*head != NULL)
-		*head = (*head)->next;
-}
-
 static bool
 entry_is_recent(const struct host *h, unsigned long delay_threshold,
                 unsigned long now)
 {
-	return now - h->timestamp <= (delay_threshold * HZ) / 100 &&
-	       time_after_eq(now, h->timestamp);
-}
-
-static void remove_oldest(struct host **head, struct host *curr)
-{
-	struct host *h, *last = NULL;
-
-	/*
-	 * We are going to re-use the oldest list entry, so remove it from the
-	 * hash table first, if it is really already in use.
-	 */
-	h = *head;
-	while (h != NULL) {
-		if (curr == h)
-			break;
-		last = h;
-		h = h->next;
-	}
+	unsigned long timestamp = READ_ONCE(h->timestamp);
 
-	/* Then, remove it */
-	if (h != NULL)
-		ht_unlink(head, last);
+	return now - timestamp <= (delay_threshold * HZ) / 100 &&
+	       time_after_eq(now, timestamp);
 }
 
 static void *
@@ -293,90 +294,205 @@ get_header_pointer4(const struct sk_buff *skb, unsigned int thoff, void *mem)
 	return skb_header_pointer(skb, thoff, hdrlen, mem);
 }
 
+/* HyperLogLog linear-counting estimates for 1..PSD_HLL_REGS empty registers */
+static const u8 psd_hll_lc[PSD_HLL_REGS] = {
+	44, 33, 27, 22, 19, 16, 13, 11, 9, 8, 6, 5, 3, 2, 1, 0,
+};
+
+/* Estimate the distinct items of the union of two HyperLogLog counters. */
+static unsigned int psd_hll_estimate(const u8 *a, const u8 *b)
+{
+	unsigned int i, zeros = 0, est;
+	u64 sum = 0;
+	u8 r;
+
+	for (i = 0; i < PSD_HLL_REGS; ++i) {
+		r = max(READ_ONCE(a[i]), READ_ONCE(b[i]));
+		if (r == 0)
+			++zeros;
+		sum += 1ULL << (32 - r);
+	}
+	/* alpha(16) * 16^2 = 0.673 * 256 */
+	est = div64_u64(172ULL << 32, sum);
+	if (zeros > 0 && est <= 5 * PSD_HLL_REGS / 2)
+		est = psd_hll_lc[zeros-1];
+	return est;
+}
+
+/*
+ * Record @item under the key with hash @khash and return the estimated
+ * number of distinct items for that key. Each row picks its column from
+ * different bits of @khash; the smallest estimate of the rows wins.
+ *
+ * Registers are updated without locking; they only ever grow within a
+ * generation, so a lost race undercounts by one item at most. The packet
+ * that starts a new window clears the generation it reuses.
+ */
+static unsigned int
+psd_sketch_count(struct psd_sketch *sk, u32 khash,
+                 const union nf_inet_addr *item)
+{
+	u32 h = jhash2(item->all, ARRAY_SIZE(item->all), psd_hll_seed);
+	unsigned int row, col, idx = h & (PSD_HLL_REGS - 1);
+	unsigned long epoch = jiffies / sk->window;
+	unsigned long old = READ_ONCE(sk->epoch);
+	unsigned int gen = epoch & 1, est, min = UINT_MAX;
+	u8 rank, *reg;
+
+	if (old != epoch && cmpxchg(&sk->epoch, old, epoch) == old) {
+		if (epoch - old > 1)
+			memset(sk->reg, 0, sizeof(sk->reg));
+		else
+			memset(sk->reg[gen], 0, sizeof(sk->reg[gen]));
+	}
+
+	h >>= ilog2(PSD_HLL_REGS);
+	rank = (h != 0) ? __ffs(h) + 1 : 33 - ilog2(PSD_HLL_REGS);
+	for (row = 0; row < PSD_CM_ROWS; ++row) {
+		col = (khash >> (row * (32 / PSD_CM_ROWS))) & (PSD_CM_COLS - 1);
+		reg = &sk->reg[gen][row][col][idx];
+		if (READ_ONCE(*reg) < rank)
+			WRITE_ONCE(*reg, rank);
+		est = psd_hll_estimate(sk->reg[0][row][col],
+		                       sk->reg[1][row][col]);
+		if (est < min)
+			min = est;
+	}
+	return min;
+}
+
+/*
+ * Horizontal scan detection: many destinations from one source network, or
+ * many sources on one destination port. Only connection attempts count.
+ */
 static bool
-handle_packet4(const struct iphdr *iph, const struct tcphdr *tcph,
-               const struct xt_psd_info *psdinfo, unsigned int hash)
+handle_hscan(struct psd_state *st, const struct xt_psd_mtinfo2 *info,
+             const union nf_inet_addr *saddr, const union nf_inet_addr *daddr,
+             const struct tcphdr *tcph, uint8_t proto, bool ipv6)
 {
-	unsigned long now;
-	struct host *curr, *last = NULL, **head;
-	struct host4 *curr4;
-	int count = 0;
-
-	now = jiffies;
-	head = &state.hash[hash];
-
-	/* Do we know this source address already? */
-	curr = *head;
-	while (curr != NULL) {
-		curr4 = host_to_host4(curr);
-		if (curr4->saddr == iph->saddr)
-			break;
-		count++;
-		curr = host_get_next(curr, &last);
+	union nf_inet_addr net = *saddr;
+	bool matched = false;
+	u32 khash;
+
+	if (proto == IPPROTO_TCP && (tcph->ack || tcph->rst))
+		return false;
+
+	if (info->dst_threshold != 0) {
+		if (ipv6)
+			net.all[2] = net.all[3] = 0;
+		else
+			net.ip &= htonl(0xFFFFFF00);
+		khash = jhash2(net.all, ARRAY_SIZE(net.all), psd_seed);
+		if (psd_sketch_count(&st->hscan[0], khash, daddr) >=
+		    info->dst_threshold)
+			matched = true;
+	}
+	if (info->src_threshold != 0) {
+		khash = jhash_1word(proto << 16 | ntohs(tcph->dest), psd_seed);
+		if (psd_sketch_count(&st->hscan[1], khash, saddr) >=
+		    info->src_threshold)
+			matched = true;
+	}
+	return matched;
+}
+
+static bool
+handle_packet(struct psd_state *st, const union nf_inet_addr *saddr,
+              const struct tcphdr *tcph, uint8_t proto,
+              const struct xt_psd_info *psdinfo)
+{
+	unsigned int hash = psd_hash(saddr);
+	struct hlist_head *head = &st->hash[hash & st->hash_mask];
+	struct psd_shard *shard = &st->shard[hash % PSD_SHARDS];
+	unsigned long now = jiffies;
+	struct host *curr;
+	bool matched = false;
+
+	/*
+	 * Most packets come from a source we know, to a port we have already
+	 * seen it use; those need no lock.
+	 */
+	rcu_read_lock();
+	curr = psd_host_find(head, saddr);
+	if (curr != NULL &&
+	    entry_is_recent(curr, psdinfo->delay_threshold, now) &&
+	    (port_in_list(curr, proto, tcph->dest) ||
+	    (proto == IPPROTO_TCP && (tcph->ack || tcph->rst)))) {
+		rcu_read_unlock();
+		return false;
 	}
+	rcu_read_unlock();
 
+	spin_lock(&shard->lock);
+	curr = psd_host_find(head, saddr);
 	if (curr != NULL) {
 		/* We know this address, and the entry isn't too old. Update it. */
-		if (entry_is_recent(curr, psdinfo->delay_threshold, now))
-			return is_portscan(curr, psdinfo, tcph, iph->protocol);
-
-		/* We know this address, but the entry is outdated. Mark it unused, and
-		 * remove from the hash table. We'll allocate a new entry instead since
-		 * this one might get re-used too soon. */
-		curr4 = host_to_host4(curr);
-		curr4->saddr = 0;
-		ht_unlink(head, last);
-		last = NULL;
+		if (entry_is_recent(curr, psdinfo->delay_threshold, now)) {
+			matched = is_portscan(curr, psdinfo, tcph, proto);
+			list_move_tail(&curr->lru, &shard->lru);
+			goto out;
+		}
+		/* We know this address, but the entry is outdated. Drop it and
+		 * allocate a new one, since lockless readers may still see it. */
+		psd_host_free(shard, curr);
 	}
 
 	/* We don't need an ACK from a new source address */
-	if (iph->protocol == IPPROTO_TCP && tcph->ack)
-		return false;
+	if (proto == IPPROTO_TCP && tcph->ack)
+		goto out;
 
-	/* Got too many source addresses with the same hash value? Then remove the
-	 * oldest one from the hash table, so that they can't take too much of our
-	 * CPU time even with carefully chosen spoofed IP addresses. */
-	if (count >= HASH_MAX && last != NULL)
-		last->next = NULL;
-
-	if (state.list[state.index].saddr != 0)
-		head = &state.hash[hashfunc(state.list[state.index].saddr)];
-	else
-		head = &last;
-
-	/* Get our list entry */
-	curr4 = &state.list[state.index++];
-	curr = &curr4->host;
-	remove_oldest(head, curr);
-	if (state.index >= LIST_SIZE)
-		state.index = 0;
-
-	/* Link it into the hash table */
-	head = &state.hash[hash];
-	curr->next = *head;
-	*head = curr;
-
-	/* And fill in the fields */
-	curr4 = host_to_host4(curr);
-	curr4->saddr = iph->saddr;
+	/* Shard full? Then forget its least recently updated source(s). */
+	while (shard->count >= READ_ONCE(st->shard_max)) {
+		psd_host_free(shard, list_first_entry(&shard->lru,
+		              struct host, lru));
+		++shard->evictions;
+	}
+
+	curr = kmalloc(sizeof(*curr), GFP_ATOMIC);
+	if (curr == NULL)
+		goto out;
+	curr->saddr = *saddr;
 	curr->timestamp = now;
 	curr->count = 1;
 	curr->weight = get_port_weight(psdinfo, tcph->dest);
 	curr->ports[0].number = tcph->dest;
-	curr->ports[0].proto = iph->protocol;
-	return false;
+	curr->ports[0].proto = proto;
+	list_add_tail(&curr->lru, &shard->lru);
+	hlist_add_head_rcu(&curr->node, head);
+	++shard->count;
+ out:
+	spin_unlock(&shard->lock);
+	return matched;
+}
+
+static bool
+psd_mt(const struct xt_action_param *par,
+       const union nf_inet_addr *saddr, const union nf_inet_addr *daddr,
+       const struct tcphdr *tcph, uint8_t proto)
+{
+	const struct xt_psd_mtinfo2 *info = par->matchinfo;
+	struct psd_state *st;
+	bool matched = false;
+
+	st = psd_pernet(par_net(par))->state[par->family == NFPROTO_IPV6];
+
+	if (par->match->revision < 2)
+		return handle_packet(st, saddr, tcph, proto, &info->psd);
+	if (info->psd.weight_threshold != 0)
+		matched = handle_packet(st, saddr, tcph, proto, &info->psd);
+	if (handle_hscan(st, info, saddr, daddr, tcph, proto,
+	    par->family == NFPROTO_IPV6))
+		matched = true;
+	return matched;
 }
 
 static bool
 xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 {
 	struct iphdr *iph = ip_hdr(pskb);
+	union nf_inet_addr saddr = {}, daddr = {};
 	struct tcphdr _tcph;
 	struct tcphdr *tcph;
-	bool matched;
-	unsigned int hash;
-	/* Parameters from userspace */
-	const struct xt_psd_info *psdinfo = match->matchinfo;
 
 	if (iph->frag_off & htons(IP_OFFSET)) {
 		pr_debug("sanity check failed\n");
@@ -396,76 +512,12 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 	if (tcph == NULL)
 		return false;
 
-	hash = hashfunc(iph->saddr);
-
-	spin_lock(&state.lock);
-	matched = handle_packet4(iph, tcph, psdinfo, hash);
-	spin_unlock(&state.lock);
-	return matched;
+	saddr.ip = iph->saddr;
+	daddr.ip = iph->daddr;
+	return psd_mt(match, &saddr, &daddr, tcph, iph->protocol);
 }
 
 #ifdef WITH_IPV6
-static bool
-handle_packet6(const struct ipv6hdr *ip6h, const struct tcphdr *tcph,
-	       const struct xt_psd_info *psdinfo, uint8_t proto, int hash)
-{
-	unsigned long now;
-	struct host *curr, *last = NULL, **head;
-	struct host6 *curr6;
-	int count = 0;
-
-	now = jiffies;
-	head = &state6.hash[hash];
-
-	curr = *head;
-	while (curr != NULL) {
-		curr6 = host_to_host6(curr);
-		if (ipv6_addr_equal(&curr6->saddr, &ip6h->saddr))
-			break;
-		count++;
-		curr = host_get_next(curr, &last);
-	}
-
-	if (curr != NULL) {
-		if (entry_is_recent(curr, psdinfo->delay_threshold, now))
-			return is_portscan(curr, psdinfo, tcph, proto);
-		curr6 = host_to_host6(curr);
-		memset(&curr6->saddr, 0, sizeof(curr6->saddr));
-		ht_unlink(head, last);
-		last = NULL;
-	}
-
-	if (proto == IPPROTO_TCP && tcph->ack)
-		return false;
-
-	if (count >= HASH_MAX && last != NULL)
-		last->next = NULL;
-
-	if (!ipv6_addr_any(&state6.list[state6.index].saddr))
-		head = &state6.hash[hashfunc6(&state6.list[state6.index].saddr)];
-	else
-		head = &last;
-
-	curr6 = &state6.list[state6.index++];
-	curr = &curr6->host;
-	remove_oldest(head, curr);
-	if (state6.index >= LIST_SIZE)
-		state6.index = 0;
-
-	head = &state6.hash[hash];
-	curr->next = *head;
-	*head = curr;
-
-	curr6 = host_to_host6(curr);
-	curr6->saddr = ip6h->saddr;
-	curr->timestamp = now;
-	curr->count = 1;
-	curr->weight = get_port_weight(psdinfo, tcph->dest);
-	curr->ports[0].number = tcph->dest;
-	curr->ports[0].proto = proto;
-	return false;
-}
-
 static void *
 get_header_pointer6(const struct sk_buff *skb, void *mem, uint8_t *proto)
 {
@@ -501,12 +553,10 @@ static bool
 xt_psd_match6(const struct sk_buff *pskb, struct xt_action_param *match)
 {
 	const struct ipv6hdr *ip6h = ipv6_hdr(pskb);
+	union nf_inet_addr saddr, daddr;
 	struct tcphdr _tcph;
 	struct tcphdr *tcph;
 	uint8_t proto = 0;
-	bool matched;
-	int hash;
-	const struct xt_psd_info *psdinfo = match->matchinfo;
 
 	if (ipv6_addr_any(&ip6h->saddr))
 		return false;
@@ -515,21 +565,107 @@ xt_psd_match6(const struct sk_buff *pskb, struct xt_action_param *match)
 	if (tcph == NULL)
 		return false;
 
-	hash = hashfunc6(&ip6h->saddr);
-
-	spin_lock(&state6.lock);
-	matched = handle_packet6(ip6h, tcph, psdinfo, proto, hash);
-	spin_unlock(&state6.lock);
-	return matched;
+	saddr.in6 = ip6h->saddr;
+	daddr.in6 = ip6h->daddr;
+	return psd_mt(match, &saddr, &daddr, tcph, proto);
 }
 #endif
 
+static struct psd_state *psd_state_alloc(unsigned int size)
+{
+	struct psd_state *st;
+	unsigned int i;
+
+	st = kvzalloc(sizeof(*st) + roundup_pow_of_two(size) *
+	     sizeof(struct hlist_head), GFP_KERNEL);
+	if (st == NULL)
+		return NULL;
+	st->hash_mask = roundup_pow_of_two(size) - 1;
+	st->shard_max = DIV_ROUND_UP(size, PSD_SHARDS);
+	for (i = 0; i < PSD_SHARDS; ++i) {
+		spin_lock_init(&st->shard[i].lock);
+		INIT_LIST_HEAD(&st->shard[i].lru);
+	}
+	return st;
+}
+
+static struct psd_sketch *psd_sketch_alloc(void)
+{
+	struct psd_sketch *sk;
+
+	sk = kvzalloc(2 * sizeof(*sk), GFP_KERNEL);
+	if (sk == NULL)
+		return NULL;
+	sk[0].window = sk[1].window = max(READ_ONCE(hscan_window), 1U) * HZ;
+	sk[0].epoch  = sk[1].epoch  = jiffies / sk[0].window;
+	return sk;
+}
+
+static void psd_state_free(struct psd_state *st)
+{
+	struct host *h, *next;
+	unsigned int i;
+
+	/* x_tables waited for packets in the old ruleset */
+	for (i = 0; i < PSD_SHARDS; ++i)
+		list_for_each_entry_safe(h, next, &st->shard[i].lru, lru)
+			kfree(h);
+	kvfree(st->hscan);
+	kvfree(st);
+}
+
+static int psd_state_get(struct psd_net *pn, unsigned int idx, bool hscan)
+{
+	struct psd_state *st;
+	int ret = 0;
+
+	mutex_lock(&psd_state_mutex);
+	st = pn->state[idx];
+	if (st == NULL) {
+		st = psd_state_alloc(pn->table_size);
+		if (st == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	if (hscan && st->hscan == NULL) {
+		st->hscan = psd_sketch_alloc();
+		if (st->hscan == NULL) {
+			if (st->refcnt == 0)
+				psd_state_free(st);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	++st->refcnt;
+	pn->state[idx] = st;
+ out:
+	mutex_unlock(&psd_state_mutex);
+	return ret;
+}
+
+static void psd_state_put(struct psd_net *pn, unsigned int idx)
+{
+	struct psd_state *st;
+
+	mutex_lock(&psd_state_mutex);
+	st = pn->state[idx];
+	if (--st->refcnt == 0) {
+		pn->state[idx] = NULL;
+		psd_state_free(st);
+	}
+	mutex_unlock(&psd_state_mutex);
+}
+
 static int psd_mt_check(const struct xt_mtchk_param *par)
 {
 	const struct xt_psd_info *info = par->matchinfo;
+	const struct xt_psd_mtinfo2 *info2 = par->matchinfo;
+	bool hscan = par->match->revision >= 2 &&
+	             (info2->dst_threshold | info2->src_threshold) != 0;
 
-	if (info->weight_threshold == 0)
-		/* 0 would match on every 1st packet */
+	if (info->weight_threshold == 0 && !hscan)
+		/* 0 would match on every 1st packet (revision 1) or never */
 		return -EINVAL;
 
 	if ((info->lo_ports_weight | info->hi_ports_weight) == 0)
@@ -542,17 +678,14 @@ static int psd_mt_check(const struct xt_mtchk_param *par)
 	    info->hi_ports_weight > PSD_MAX_RATE)
 		return -EINVAL;
 
-	return 0;
+	return psd_state_get(psd_pernet(par->net), par->family == NFPROTO_IPV6,
+	                     hscan);
 }
 
-#ifdef WITH_IPV6
-static int psd_mt_check6(const struct xt_mtchk_param *par)
+static void psd_mt_destroy(const struct xt_mtdtor_param *par)
 {
-	if (!state6_alloc_mem())
-		return -ENOMEM;
-	return psd_mt_check(par);
+	psd_state_put(psd_pernet(par->net), par->family == NFPROTO_IPV6);
 }
-#endif
 
 static struct xt_match xt_psd_reg[] __read_mostly = {
 	{
@@ -560,6 +693,7 @@ static struct xt_match xt_psd_reg[] __read_mostly = {
 		.family     = NFPROTO_IPV4,
 		.revision   = 1,
 		.checkentry = psd_mt_check,
+		.destroy    = psd_mt_destroy,
 		.match      = xt_psd_match,
 		.matchsize  = sizeof(struct xt_psd_info),
 		.me         = THIS_MODULE,
@@ -568,30 +702,152 @@ static struct xt_match xt_psd_reg[] __read_mostly = {
 		.name       = "psd",
 		.family     = NFPROTO_IPV6,
 		.revision   = 1,
-		.checkentry = psd_mt_check6,
+		.checkentry = psd_mt_check,
+		.destroy    = psd_mt_destroy,
 		.match      = xt_psd_match6,
 		.matchsize  = sizeof(struct xt_psd_info),
 		.me         = THIS_MODULE,
 #endif
+	}, {
+		.name       = "psd",
+		.family     = NFPROTO_IPV4,
+		.revision   = 2,
+		.checkentry = psd_mt_check,
+		.destroy    = psd_mt_destroy,
+		.match      = xt_psd_match,
+		.matchsize  = sizeof(struct xt_psd_mtinfo2),
+		.me         = THIS_MODULE,
+#ifdef WITH_IPV6
+	}, {
+		.name       = "psd",
+		.family     = NFPROTO_IPV6,
+		.revision   = 2,
+		.checkentry = psd_mt_check,
+		.destroy    = psd_mt_destroy,
+		.match      = xt_psd_match6,
+		.matchsize  = sizeof(struct xt_psd_mtinfo2),
+		.me         = THIS_MODULE,
+#endif
+	}
+};
+
+static int psd_proc_show(struct seq_file *m, void *data)
+{
+	static const char *const family[] = {"ipv4", "ipv6"};
+	struct psd_net *pn = m->private;
+	const struct psd_state *st;
+	unsigned long evictions;
+	unsigned int i, j, hosts;
+
+	mutex_lock(&psd_state_mutex);
+	seq_printf(m, "table_size %u\n", pn->table_size);
+	for (i = 0; i < ARRAY_SIZE(pn->state); ++i) {
+		st = pn->state[i];
+		if (st == NULL) {
+			seq_printf(m, "%s unused\n", family[i]);
+			continue;
+		}
+		hosts = 0;
+		evictions = 0;
+		for (j = 0; j < PSD_SHARDS; ++j) {
+			hosts     += READ_ONCE(st->shard[j].count);
+			evictions += READ_ONCE(st->shard[j].evictions);
+		}
+		seq_printf(m, "%s hosts %u max %u buckets %u evictions %lu\n",
+		           family[i], hosts, st->shard_max * PSD_SHARDS,
+		           st->hash_mask + 1, evictions);
 	}
+	mutex_unlock(&psd_state_mutex);
+	return 0;
+}
+
+static int psd_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, psd_proc_show, PDE_DATA(inode));
+}
+
+/*
+ * Writing a number sets the table size. Tables in use keep their hash
+ * buckets, but take the new limit at once; shrinking evicts as sources are
+ * added.
+ */
+static ssize_t
+psd_proc_write(struct file *file, const char __user *input,
+               size_t size, loff_t *loff)
+{
+	struct psd_net *pn = PDE_DATA(file_inode(file));
+	unsigned int i, value;
+	int ret;
+
+	ret = kstrtouint_from_user(input, size, 0, &value);
+	if (ret < 0)
+		return ret;
+	value = clamp_t(unsigned int, value, PSD_SHARDS, PSD_MAX_HOSTS);
+
+	mutex_lock(&psd_state_mutex);
+	pn->table_size = value;
+	for (i = 0; i < ARRAY_SIZE(pn->state); ++i)
+		if (pn->state[i] != NULL)
+			WRITE_ONCE(pn->state[i]->shard_max,
+			           DIV_ROUND_UP(value, PSD_SHARDS));
+	mutex_unlock(&psd_state_mutex);
+	return size;
+}
+
+static const struct proc_ops psd_proc_fops = {
+	.proc_open    = psd_proc_open,
+	.proc_read    = seq_read,
+	.proc_write   = psd_proc_write,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
+
+static int __net_init psd_net_init(struct net *net)
+{
+	struct psd_net *pn = psd_pernet(net);
+
+	pn->table_size = clamp_t(unsigned int, READ_ONCE(table_size),
+	                         PSD_SHARDS, PSD_MAX_HOSTS);
+	if (proc_create_data("xt_psd", S_IRUSR | S_IWUSR, net->proc_net,
+	    &psd_proc_fops, pn) == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+static void __net_exit psd_net_exit(struct net *net)
+{
+	/* tables go away with the rules that use them */
+	remove_proc_entry("xt_psd", net->proc_net);
+}
+
+static struct pernet_operations psd_net_ops = {
+	.init   = psd_net_init,
+	.exit   = psd_net_exit,
+	.id     = &psd_net_id,
+	.size   = sizeof(struct psd_net),
 };
 
 static int __init xt_psd_init(void)
 {
-	spin_lock_init(&(state.lock));
-#ifdef WITH_IPV6
-	spin_lock_init(&(state6.lock));
-#endif
-	return xt_register_matches(xt_psd_reg, ARRAY_SIZE(xt_psd_reg));
+	int ret;
+
+	get_random_bytes(&psd_seed, sizeof(psd_seed));
+	get_random_bytes(&psd_hll_seed, sizeof(psd_hll_seed));
+	ret = register_pernet_subsys(&psd_net_ops);
+	if (ret != 0)
+		return ret;
+	ret = xt_register_matches(xt_psd_reg, ARRAY_SIZE(xt_psd_reg));
+	if (ret < 0) {
+		unregister_pernet_subsys(&psd_net_ops);
+		return ret;
+	}
+	return 0;
 }
 
 static void __exit xt_psd_exit(void)
 {
         xt_unregister_matches(xt_psd_reg, ARRAY_SIZE(xt_psd_reg));
-#ifdef WITH_IPV6
-	vfree(state6.list);
-	vfree(state6.hash);
-#endif
+	unregister_pernet_subsys(&psd_net_ops);
 }
 
 module_init(xt_psd_init);
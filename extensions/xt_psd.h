@@ -27,4 +27,18 @@ struct xt_psd_info {
 	__u16 hi_ports_weight;
 };
 
+/**
+ * Revision 2 adds horizontal scan detection; a weight_threshold of 0 turns
+ * the per-source port count off.
+ * @dst_threshold:	distinct destination hosts seen from a source /24
+ * 			(IPv6: /64) to match, 0 to disable
+ * @src_threshold:	distinct source hosts seen on a destination port
+ * 			to match, 0 to disable
+ */
+struct xt_psd_mtinfo2 {
+	struct xt_psd_info psd;
+	__u32 dst_threshold;
+	__u32 src_threshold;
+};
+
 #endif /*_LINUX_NETFILTER_XT_PSD_H*/
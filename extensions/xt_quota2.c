@@ -11,13 +11,21 @@
  *	it under the terms of the GNU General Public License
  *	version 2, as published by the Free Software Foundation.
  */
+#include <linux/ctype.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/nsproxy.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
+#include <linux/timekeeping.h>
 #include <linux/uidgid.h>
 #include <linux/version.h>
 #include <asm/atomic.h>
@@ -31,18 +39,30 @@
 
 /**
  * @lock:	lock to protect quota writers from each other
+ * @local:	per-CPU shares of the value, or NULL; the counter's value is
+ * 		@quota plus all shares
+ * @refill_next:	time (seconds since the epoch) of the next refill
  */
 struct xt_quota_counter {
 	u_int64_t quota;
 	spinlock_t lock;
-	struct list_head list;
+	atomic64_t __percpu *local;
+	u_int64_t refill, refill_max;
+	u_int32_t refill_period;
+	time64_t refill_next;
+	struct hlist_node node;
 	atomic_t ref;
 	char name[sizeof(((struct xt_quota_mtinfo2 *)NULL)->name)];
 	struct proc_dir_entry *procfs_entry;
 };
 
+#define QUOTA2_HASH_BITS 10
+
+/**
+ * @counter_hash:	named counters, by jhash of the name
+ */
 struct quota2_net {
-	struct list_head counter_list;
+	DECLARE_HASHTABLE(counter_hash, QUOTA2_HASH_BITS);
 	struct proc_dir_entry *proc_xt_quota;
 };
 
@@ -52,7 +72,11 @@ static inline struct quota2_net *quota2_pernet(struct net *net)
 	return net_generic(net, quota2_net_id);
 }
 
-static DEFINE_SPINLOCK(counter_list_lock);
+/* protects counter_hash of all namespaces */
+static DEFINE_MUTEX(counter_list_lock);
+
+/* reserved, counter names may not start with a dot */
+static const char quota2_all_name[] = ".all";
 
 static unsigned int quota_list_perms = S_IRUGO | S_IWUSR;
 static unsigned int quota_list_uid   = 0;
@@ -61,59 +85,137 @@ module_param_named(perms, quota_list_perms, uint, S_IRUGO | S_IWUSR);
 module_param_named(uid, quota_list_uid, uint, S_IRUGO | S_IWUSR);
 module_param_named(gid, quota_list_gid, uint, S_IRUGO | S_IWUSR);
 
-static int quota_proc_show(struct seq_file *m, void *data)
+static unsigned int percpu_slice;
+module_param(percpu_slice, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(percpu_slice, "amount (bytes or packets) each CPU may take "
+		 "from a counter at a time without locking; 0 (default) locks "
+		 "the counter for every packet. Applies to counters created later.");
+
+/* Move @cpu's share into e->quota. Called with e->lock held. */
+static void quota_fold(struct xt_quota_counter *e, unsigned int cpu)
 {
-	struct xt_quota_counter *e = m->private;
+	e->quota += atomic64_xchg(per_cpu_ptr(e->local, cpu), 0);
+}
 
-	spin_lock_bh(&e->lock);
-	seq_printf(m, "%llu\n", e->quota);
-	spin_unlock_bh(&e->lock);
-	return 0;
+static void quota_fold_all(struct xt_quota_counter *e)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		quota_fold(e, cpu);
 }
 
-static int quota_proc_open(struct inode *inode, struct file *file)
+/*
+ * Add the refills due by @now, in one step, however many periods passed.
+ * Called with e->lock held.
+ */
+static void quota_refill(struct xt_quota_counter *e, time64_t now)
 {
-	return single_open(file, quota_proc_show, PDE_DATA(inode));
+	u_int64_t periods, add;
+
+	if (e->refill_period == 0 || now < e->refill_next)
+		return;
+	periods = div_u64(now - e->refill_next, e->refill_period) + 1;
+	WRITE_ONCE(e->refill_next, e->refill_next + periods * e->refill_period);
+	if (e->local != NULL)
+		quota_fold_all(e);
+	if (e->quota >= e->refill_max)
+		return;
+	add = (periods > div64_u64(U64_MAX, e->refill)) ? U64_MAX :
+	      periods * e->refill;
+	if (add >= e->refill_max - e->quota)
+		e->quota = e->refill_max;
+	else
+		e->quota += add;
 }
 
-static ssize_t
-quota_proc_write(struct file *file, const char __user *input,
-                 size_t size, loff_t *loff)
+static u_int64_t quota_value(struct xt_quota_counter *e)
 {
-	struct xt_quota_counter *e = PDE_DATA(file_inode(file));
-	char buf[sizeof("+-18446744073709551616")];
+	u_int64_t quota;
+	unsigned int cpu;
 
-	if (size > sizeof(buf))
-		size = sizeof(buf);
-	if (copy_from_user(buf, input, size) != 0)
-		return -EFAULT;
-	buf[sizeof(buf)-1] = '\0';
-	if (size < sizeof(buf))
-		buf[size] = '\0';
+	spin_lock_bh(&e->lock);
+	quota_refill(e, ktime_get_real_seconds());
+	quota = e->quota;
+	if (e->local != NULL)
+		for_each_possible_cpu(cpu)
+			quota += atomic64_read(per_cpu_ptr(e->local, cpu));
+	spin_unlock_bh(&e->lock);
+	return quota;
+}
 
+/*
+ * Apply a procfs write: "+N" adds, "-N" subtracts, anything else sets.
+ */
+static void quota_update(struct xt_quota_counter *e, const char *buf)
+{
+	spin_lock_bh(&e->lock);
+	quota_refill(e, ktime_get_real_seconds());
+	/* CPUs must take a new slice from the value written */
+	if (e->local != NULL)
+		quota_fold_all(e);
 	if (*buf == '+') {
 		int64_t temp = simple_strtoll(buf + 1, NULL, 0);
-		spin_lock_bh(&e->lock);
 		/* Do not let quota become negative if @tmp is very negative */
 		if (temp > 0 || -temp < e->quota)
 			e->quota += temp;
 		else
 			e->quota = 0;
-		spin_unlock_bh(&e->lock);
 	} else if (*buf == '-') {
 		int64_t temp = simple_strtoll(buf + 1, NULL, 0);
-		spin_lock_bh(&e->lock);
 		/* Do not let quota become negative if @tmp is very big */
 		if (temp < 0 || temp < e->quota)
 			e->quota -= temp;
 		else
 			e->quota = 0;
-		spin_unlock_bh(&e->lock);
 	} else {
-		spin_lock_bh(&e->lock);
 		e->quota = simple_strtoull(buf, NULL, 0);
-		spin_unlock_bh(&e->lock);
 	}
+	spin_unlock_bh(&e->lock);
+}
+
+/* Packet path: only lock when a refill is due. */
+static void quota_refill_check(struct xt_quota_counter *e)
+{
+	time64_t now;
+
+	if (e->refill_period == 0)
+		return;
+	now = ktime_get_real_seconds();
+	if (now < READ_ONCE(e->refill_next))
+		return;
+	spin_lock_bh(&e->lock);
+	quota_refill(e, now);
+	spin_unlock_bh(&e->lock);
+}
+
+static int quota_proc_show(struct seq_file *m, void *data)
+{
+	seq_printf(m, "%llu\n", quota_value(m->private));
+	return 0;
+}
+
+static int quota_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, quota_proc_show, PDE_DATA(inode));
+}
+
+static ssize_t
+quota_proc_write(struct file *file, const char __user *input,
+                 size_t size, loff_t *loff)
+{
+	struct xt_quota_counter *e = PDE_DATA(file_inode(file));
+	char buf[sizeof("+-18446744073709551616")];
+
+	if (size > sizeof(buf))
+		size = sizeof(buf);
+	if (copy_from_user(buf, input, size) != 0)
+		return -EFAULT;
+	buf[sizeof(buf)-1] = '\0';
+	if (size < sizeof(buf))
+		buf[size] = '\0';
+
+	quota_update(e, buf);
 	return size;
 }
 
@@ -125,51 +227,176 @@ static const struct proc_ops quota_proc_fops = {
 	.proc_release = single_release,
 };
 
+static inline u32 q2_name_hash(const char *name)
+{
+	return jhash(name, strlen(name), 0);
+}
+
+/* Called with counter_list_lock held. */
+static struct xt_quota_counter *
+q2_lookup_counter(struct quota2_net *quota2_net, const char *name)
+{
+	struct xt_quota_counter *e;
+
+	hash_for_each_possible(quota2_net->counter_hash, e, node,
+	                       q2_name_hash(name))
+		if (strcmp(e->name, name) == 0)
+			return e;
+	return NULL;
+}
+
+/*
+ * /proc/net/xt_quota/.all lists all named counters of the namespace as
+ * "name value" lines; writing such lines, with values as for the single
+ * files, updates many counters in one write.
+ */
+static int quota_all_proc_show(struct seq_file *m, void *data)
+{
+	struct quota2_net *quota2_net = m->private;
+	struct xt_quota_counter *e;
+	unsigned int bkt;
+
+	mutex_lock(&counter_list_lock);
+	hash_for_each(quota2_net->counter_hash, bkt, e, node)
+		seq_printf(m, "%s %llu\n", e->name, quota_value(e));
+	mutex_unlock(&counter_list_lock);
+	return 0;
+}
+
+static int quota_all_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, quota_all_proc_show, PDE_DATA(inode));
+}
+
+/*
+ * All lines are applied; if a named counter does not exist, or a line is
+ * malformed, the write fails with -ENOENT or -EINVAL afterwards.
+ */
+static ssize_t
+quota_all_proc_write(struct file *file, const char __user *input,
+                     size_t size, loff_t *loff)
+{
+	struct quota2_net *quota2_net = PDE_DATA(file_inode(file));
+	struct xt_quota_counter *e;
+	char *buf, *next, *line, *value;
+	int ret = 0;
+
+	if (size > INT_MAX)
+		return -EFBIG;
+	buf = kvmalloc(size + 1, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+	if (copy_from_user(buf, input, size) != 0) {
+		kvfree(buf);
+		return -EFAULT;
+	}
+	buf[size] = '\0';
+
+	mutex_lock(&counter_list_lock);
+	next = buf;
+	while ((line = strsep(&next, "\n")) != NULL) {
+		line = skip_spaces(line);
+		if (*line == '\0')
+			continue;
+		value = line;
+		while (*value != '\0' && !isspace(*value))
+			++value;
+		if (*value == '\0') {
+			ret = -EINVAL;
+			continue;
+		}
+		*value++ = '\0';
+		e = q2_lookup_counter(quota2_net, line);
+		if (e == NULL) {
+			ret = -ENOENT;
+			continue;
+		}
+		quota_update(e, skip_spaces(value));
+	}
+	mutex_unlock(&counter_list_lock);
+	kvfree(buf);
+	return (ret != 0) ? ret : size;
+}
+
+static const struct proc_ops quota_all_proc_fops = {
+	.proc_open    = quota_all_proc_open,
+	.proc_read    = seq_read,
+	.proc_write   = quota_all_proc_write,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
+};
+
 static struct xt_quota_counter *
-q2_new_counter(const struct xt_quota_mtinfo2 *q, bool anon)
+q2_new_counter(const struct xt_quota_mtinfo2 *q,
+               const struct xt_quota_mtinfo3 *r, bool anon)
 {
 	struct xt_quota_counter *e;
 	unsigned int size;
 
 	/* Do not need all the procfs things for anonymous counters. */
-	size = anon ? offsetof(typeof(*e), list) : sizeof(*e);
+	size = anon ? offsetof(typeof(*e), node) : sizeof(*e);
 	e = kmalloc(size, GFP_KERNEL);
 	if (e == NULL)
 		return NULL;
 
 	e->quota = q->quota;
 	spin_lock_init(&e->lock);
+	e->refill_period = 0;
+	if (r != NULL && r->refill_period != 0) {
+		e->refill        = r->refill;
+		e->refill_max    = r->refill_max;
+		e->refill_period = r->refill_period;
+		e->refill_next   = (div_u64(ktime_get_real_seconds(),
+		                   r->refill_period) + 1) * r->refill_period;
+	}
+	e->local = NULL;
+	if (READ_ONCE(percpu_slice) != 0) {
+		e->local = alloc_percpu(atomic64_t);
+		if (e->local == NULL) {
+			kfree(e);
+			return NULL;
+		}
+	}
 	if (!anon) {
-		INIT_LIST_HEAD(&e->list);
+		INIT_HLIST_NODE(&e->node);
 		atomic_set(&e->ref, 1);
 		strncpy(e->name, q->name, sizeof(e->name));
 	}
 	return e;
 }
 
+static void q2_free_counter(struct xt_quota_counter *e)
+{
+	if (e != NULL)
+		free_percpu(e->local);
+	kfree(e);
+}
+
 /**
  * q2_get_counter - get ref to counter or create new
  * @name:	name of counter
+ * @r:		refill parameters (revision 4) or NULL
  */
 static struct xt_quota_counter *
-q2_get_counter(struct net *net, const struct xt_quota_mtinfo2 *q)
+q2_get_counter(struct net *net, const struct xt_quota_mtinfo2 *q,
+               const struct xt_quota_mtinfo3 *r)
 {
 	struct proc_dir_entry *p;
 	struct xt_quota_counter *e;
 	struct quota2_net *quota2_net = quota2_pernet(net);
 
 	if (*q->name == '\0')
-		return q2_new_counter(q, true);
-
-	spin_lock_bh(&counter_list_lock);
-	list_for_each_entry(e, &quota2_net->counter_list, list)
-		if (strcmp(e->name, q->name) == 0) {
-			atomic_inc(&e->ref);
-			spin_unlock_bh(&counter_list_lock);
-			return e;
-		}
+		return q2_new_counter(q, r, true);
+
+	mutex_lock(&counter_list_lock);
+	e = q2_lookup_counter(quota2_net, q->name);
+	if (e != NULL) {
+		atomic_inc(&e->ref);
+		mutex_unlock(&counter_list_lock);
+		return e;
+	}
 
-	e = q2_new_counter(q, false);
+	e = q2_new_counter(q, r, false);
 	if (e == NULL)
 		goto out;
 
@@ -182,22 +409,29 @@ q2_get_counter(struct net *net, const struct xt_quota_mtinfo2 *q)
 	e->procfs_entry = p;
 	proc_set_user(p, make_kuid(&init_user_ns, quota_list_uid),
 	              make_kgid(&init_user_ns, quota_list_gid));
-	list_add_tail(&e->list, &quota2_net->counter_list);
-	spin_unlock_bh(&counter_list_lock);
+	hash_add(quota2_net->counter_hash, &e->node, q2_name_hash(e->name));
+	mutex_unlock(&counter_list_lock);
 	return e;
 
  out:
-	spin_unlock_bh(&counter_list_lock);
-	kfree(e);
+	mutex_unlock(&counter_list_lock);
+	q2_free_counter(e);
 	return NULL;
 }
 
 static int quota_mt2_check(const struct xt_mtchk_param *par)
 {
 	struct xt_quota_mtinfo2 *q = par->matchinfo;
+	const struct xt_quota_mtinfo3 *r = NULL;
 
 	if (q->flags & ~XT_QUOTA_MASK)
 		return -EINVAL;
+	if (par->match->revision >= 4) {
+		r = par->matchinfo;
+		if (r->refill_period != 0 &&
+		    (r->refill == 0 || (q->flags & XT_QUOTA_GROW)))
+			return -EINVAL;
+	}
 
 	q->name[sizeof(q->name)-1] = '\0';
 	if (*q->name == '.' || strchr(q->name, '/') != NULL) {
@@ -205,7 +439,7 @@ static int quota_mt2_check(const struct xt_mtchk_param *par)
 		return -EINVAL;
 	}
 
-	q->master = q2_get_counter(par->net, q);
+	q->master = q2_get_counter(par->net, q, r);
 	if (q->master == NULL) {
 		printk(KERN_ERR "xt_quota.3: memory alloc failure\n");
 		return -ENOMEM;
@@ -221,20 +455,94 @@ static void quota_mt2_destroy(const struct xt_mtdtor_param *par)
 	struct quota2_net *quota2_net = quota2_pernet(par->net);
 
 	if (*q->name == '\0') {
-		kfree(e);
+		q2_free_counter(e);
 		return;
 	}
 
-	spin_lock_bh(&counter_list_lock);
+	mutex_lock(&counter_list_lock);
 	if (!atomic_dec_and_test(&e->ref)) {
-		spin_unlock_bh(&counter_list_lock);
+		mutex_unlock(&counter_list_lock);
 		return;
 	}
 
-	list_del(&e->list);
+	hash_del(&e->node);
 	remove_proc_entry(e->name, quota2_net->proc_xt_quota);
-	spin_unlock_bh(&counter_list_lock);
-	kfree(e);
+	mutex_unlock(&counter_list_lock);
+	q2_free_counter(e);
+}
+
+/* Take @need from a CPU's share if it holds that much. */
+static bool quota_local_take(atomic64_t *local, u_int64_t need)
+{
+	s64 v = atomic64_read(local), old;
+
+	while (v >= (s64)need) {
+		old = atomic64_cmpxchg(local, v, v - need);
+		if (old == v)
+			return true;
+		v = old;
+	}
+	return false;
+}
+
+/*
+ * Per-CPU mode. Packets are charged to this CPU's share without the lock.
+ * When the share runs dry, the CPU takes a new slice of percpu_slice from
+ * e->quota, but only while every CPU could still get one; below that, the
+ * counter is charged under the lock. Before a packet is refused, all shares
+ * are folded back, so exhaustion is decided on the exact value. Growing
+ * counters add to the share and fold it once it reaches a slice. The value
+ * copied into the rule for listing lags by up to a slice per CPU.
+ */
+static bool
+quota_mt2_percpu(const struct sk_buff *skb, struct xt_quota_mtinfo2 *q,
+                 struct xt_quota_counter *e)
+{
+	u_int64_t need = (q->flags & XT_QUOTA_PACKET) ? 1 : skb->len;
+	u_int64_t slice = READ_ONCE(percpu_slice);
+	bool ret = q->flags & XT_QUOTA_INVERT;
+	atomic64_t *local = this_cpu_ptr(e->local);
+
+	if (q->flags & XT_QUOTA_GROW) {
+		if (!(q->flags & XT_QUOTA_NO_CHANGE) &&
+		    atomic64_add_return(need, local) >= (s64)slice) {
+			spin_lock_bh(&e->lock);
+			quota_fold(e, smp_processor_id());
+			q->quota = e->quota;
+			spin_unlock_bh(&e->lock);
+		}
+		return true;
+	}
+
+	if (q->flags & XT_QUOTA_NO_CHANGE) {
+		if (atomic64_read(local) >= (s64)need)
+			return !ret;
+	} else if (quota_local_take(local, need)) {
+		return !ret;
+	}
+
+	spin_lock_bh(&e->lock);
+	quota_fold(e, smp_processor_id());
+	if (e->quota < need)
+		quota_fold_all(e);
+	if (e->quota >= need) {
+		if (!(q->flags & XT_QUOTA_NO_CHANGE)) {
+			e->quota -= need;
+			if (slice != 0 &&
+			    e->quota >= slice * num_possible_cpus()) {
+				e->quota -= slice;
+				atomic64_add(slice, local);
+			}
+		}
+		ret = !ret;
+	} else {
+		/* we do not allow even small packets from now on */
+		if (!(q->flags & XT_QUOTA_NO_CHANGE))
+			e->quota = 0;
+	}
+	q->quota = e->quota;
+	spin_unlock_bh(&e->lock);
+	return ret;
 }
 
 static bool
@@ -244,6 +552,10 @@ quota_mt2(const struct sk_buff *skb, struct xt_action_param *par)
 	struct xt_quota_counter *e = q->master;
 	bool ret = q->flags & XT_QUOTA_INVERT;
 
+	quota_refill_check(e);
+	if (e->local != NULL)
+		return quota_mt2_percpu(skb, q, e);
+
 	spin_lock_bh(&e->lock);
 	if (q->flags & XT_QUOTA_GROW) {
 		/*
@@ -292,16 +604,47 @@ static struct xt_match quota_mt2_reg[] __read_mostly = {
 		.matchsize  = sizeof(struct xt_quota_mtinfo2),
 		.me         = THIS_MODULE,
 	},
+	{
+		.name       = "quota2",
+		.revision   = 4,
+		.family     = NFPROTO_IPV4,
+		.checkentry = quota_mt2_check,
+		.match      = quota_mt2,
+		.destroy    = quota_mt2_destroy,
+		.matchsize  = sizeof(struct xt_quota_mtinfo3),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "quota2",
+		.revision   = 4,
+		.family     = NFPROTO_IPV6,
+		.checkentry = quota_mt2_check,
+		.match      = quota_mt2,
+		.destroy    = quota_mt2_destroy,
+		.matchsize  = sizeof(struct xt_quota_mtinfo3),
+		.me         = THIS_MODULE,
+	},
 };
 
 static int __net_init quota2_net_init(struct net *net)
 {
 	struct quota2_net *quota2_net = quota2_pernet(net);
-	INIT_LIST_HEAD(&quota2_net->counter_list);
+	struct proc_dir_entry *p;
+
+	hash_init(quota2_net->counter_hash);
 
 	quota2_net->proc_xt_quota = proc_mkdir("xt_quota", net->proc_net);
 	if (quota2_net->proc_xt_quota == NULL)
 		return -EACCES;
+	p = proc_create_data(quota2_all_name, quota_list_perms,
+	                     quota2_net->proc_xt_quota,
+	                     &quota_all_proc_fops, quota2_net);
+	if (p == NULL) {
+		remove_proc_entry("xt_quota", net->proc_net);
+		return -EACCES;
+	}
+	proc_set_user(p, make_kuid(&init_user_ns, quota_list_uid),
+	              make_kgid(&init_user_ns, quota_list_gid));
 	return 0;
 }
 
@@ -309,18 +652,18 @@ static void __net_exit quota2_net_exit(struct net *net)
 {
 	struct quota2_net *quota2_net = quota2_pernet(net);
 	struct xt_quota_counter *e = NULL;
-	struct list_head *pos, *q;
+	struct hlist_node *tmp;
+	unsigned int bkt;
 
-	remove_proc_entry("xt_quota", net->proc_net);
+	remove_proc_subtree("xt_quota", net->proc_net);
 
-	/* destroy counter_list while freeing it's content */
-	spin_lock_bh(&counter_list_lock);
-	list_for_each_safe(pos, q, &quota2_net->counter_list) {
-		e = list_entry(pos, struct xt_quota_counter, list);
-		list_del(pos);
-		kfree(e);
+	/* destroy counter_hash while freeing it's content */
+	mutex_lock(&counter_list_lock);
+	hash_for_each_safe(quota2_net->counter_hash, bkt, tmp, e, node) {
+		hash_del(&e->node);
+		q2_free_counter(e);
 	}
-	spin_unlock_bh(&counter_list_lock);
+	mutex_unlock(&counter_list_lock);
 }
 
 static struct pernet_operations quota2_net_ops = {
@@ -22,4 +22,16 @@ struct xt_quota_mtinfo2 {
 	struct xt_quota_counter *master __attribute__((aligned(8)));
 };
 
+/*
+ * Revision 4: every @refill_period seconds, counted from the epoch, @refill
+ * is added to the counter, up to @refill_max. Taken from the rule that
+ * creates the counter; @refill_period == 0 means no refill.
+ */
+struct xt_quota_mtinfo3 {
+	struct xt_quota_mtinfo2 v2;
+	aligned_u64 refill;
+	aligned_u64 refill_max;
+	u_int32_t refill_period;
+};
+
 #endif /* _XT_QUOTA_H */